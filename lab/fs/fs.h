@@ -11,6 +11,10 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Cached read-only program pages (see textcache.c) are mapped here,
+ * above the Fd pages of open files (FILEVA in serv.c). */
+#define TEXTCACHE	0xD0400000
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
@@ -40,6 +44,10 @@ void	file_flush(struct File *f);
 int	file_remove(const char *path);
 void	fs_sync(void);
 
+/* textcache.c */
+int	textcache_get(struct File *f, off_t offset, void **pg);
+void	textcache_invalidate(struct File *f);
+
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
@@ -48,6 +48,9 @@ struct OpenFile opentab[MAXOPEN] = {
 // Virtual address at which to receive page mappings containing client requests.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
+// Virtual address at which serve_pagein builds the page it returns.
+#define PAGEINVA	((void *) fsreq - PGSIZE)
+
 void
 serve_init(void)
 {
@@ -299,11 +302,60 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Return a page holding the PGSIZE bytes of req->req_fileid starting
+// at req->req_offset, which must be page-aligned and inside the file,
+// in *pg_store and *perm_store.  The part of the page past the end of
+// the file is zero.  The seek position is not used.
+// Unless req->req_private is set, the page is a read-only mapping of
+// the copy in the text cache, shared with everyone else paging in the
+// same file; otherwise it is a fresh writable copy.
+// This is how the demand-paging loader (lib/loader.c) brings in the
+// pages of a spawned program.
+int
+serve_pagein(envid_t envid, struct Fsreq_pagein *req,
+	     void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_pagein %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0 || PGOFF(req->req_offset) != 0
+	    || req->req_offset >= o->o_file->f_size)
+		return -E_INVAL;
+
+	if (!req->req_private) {
+		r = textcache_get(o->o_file, req->req_offset, pg_store);
+		if (r >= 0) {
+			*perm_store = PTE_P|PTE_U;
+			return 0;
+		}
+		// If every cached page is in use, fall back to a copy.
+		if (r != -E_NO_MEM)
+			return r;
+	}
+
+	if ((r = sys_page_alloc(0, PAGEINVA, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	if ((r = file_read(o->o_file, PAGEINVA, PGSIZE, req->req_offset)) < 0) {
+		sys_page_unmap(0, PAGEINVA);
+		return r;
+	}
+
+	*pg_store = PAGEINVA;
+	*perm_store = PTE_P|PTE_U|PTE_W;
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open and pagein are handled specially because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
+	/* [FSREQ_PAGEIN] =	(fshandler)serve_pagein, */
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
@@ -337,6 +389,8 @@ serve(void)
 		pg = NULL;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_PAGEIN) {
+			r = serve_pagein(whom, (struct Fsreq_pagein*)fsreq, &pg, &perm);
 		} else if (req < NHANDLERS && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
@@ -345,6 +399,8 @@ serve(void)
 		}
 		ipc_send(whom, r, pg, perm);
 		sys_page_unmap(0, fsreq);
+		if (pg == PAGEINVA)
+			sys_page_unmap(0, PAGEINVA);
 	}
 }
 
@@ -0,0 +1,107 @@
+// Cache of read-only program pages, shared by every environment that
+// runs the same binary.
+//
+// The demand-paging loader (lib/loader.c) asks for the text and rodata
+// pages of a program with FSREQ_PAGEIN.  Rather than building a new
+// copy of a page for each request, the file server keeps one copy per
+// (file, offset) here and hands out read-only mappings of it, so ten
+// shells running at once share one copy of sh's text.
+//
+// Cached pages are copies, not block cache pages, so freeing or
+// reusing disk blocks cannot change a page a program is running.
+// Writing to or resizing a file drops its pages from the cache;
+// environments that already map them keep the old contents.
+
+#include "fs.h"
+
+#define debug		0
+
+// Cached pages live at TEXTCACHE + i*PGSIZE.
+#define NTEXTPAGES	1024
+
+struct TextPage {
+	struct File *tp_file;	// File the page belongs to; NULL if free
+	off_t tp_offset;	// Page-aligned offset of the page in tp_file
+};
+
+static struct TextPage textpages[NTEXTPAGES];
+static int ntextpages;		// Number of slots in use
+static int textclock;		// Where the search for a victim resumes
+
+static void *
+textpage_va(int i)
+{
+	return (void *) (TEXTCACHE + i * PGSIZE);
+}
+
+// Find a slot for a new page: a free one, or one whose page nobody but
+// the file server maps any more.  Returns -E_NO_MEM if every cached page
+// is in use.
+static int
+textcache_victim(void)
+{
+	int i, n;
+
+	for (n = 0; n < NTEXTPAGES; n++) {
+		i = textclock;
+		textclock = (textclock + 1) % NTEXTPAGES;
+		if (!textpages[i].tp_file || pageref(textpage_va(i)) <= 1)
+			return i;
+	}
+	return -E_NO_MEM;
+}
+
+// Set *pg to the cached copy of the page at 'offset' in 'f', reading
+// it from the file if it is not cached yet.  The rest of the page past
+// the end of the file is zero.  The caller must hand the page out
+// read-only.
+// Returns 0 on success, < 0 on error; -E_NO_MEM if the cache is full
+// of pages that are in use.
+int
+textcache_get(struct File *f, off_t offset, void **pg)
+{
+	int i, r;
+
+	for (i = 0; i < NTEXTPAGES; i++)
+		if (textpages[i].tp_file == f && textpages[i].tp_offset == offset) {
+			*pg = textpage_va(i);
+			return 0;
+		}
+
+	if ((i = textcache_victim()) < 0)
+		return i;
+	if (textpages[i].tp_file) {
+		if (debug)
+			cprintf("textcache: evict %s+%x\n",
+				textpages[i].tp_file->f_name, textpages[i].tp_offset);
+		textpages[i].tp_file = NULL;
+		ntextpages--;
+	}
+	if ((r = sys_page_alloc(0, textpage_va(i), PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	if ((r = file_read(f, textpage_va(i), PGSIZE, offset)) < 0) {
+		sys_page_unmap(0, textpage_va(i));
+		return r;
+	}
+	textpages[i].tp_file = f;
+	textpages[i].tp_offset = offset;
+	ntextpages++;
+	*pg = textpage_va(i);
+	return 0;
+}
+
+// Drop all of f's pages from the cache, because its contents are
+// about to change.
+void
+textcache_invalidate(struct File *f)
+{
+	int i;
+
+	// Most writes are to files that were never paged in.
+	for (i = 0; ntextpages > 0 && i < NTEXTPAGES; i++)
+		if (textpages[i].tp_file == f) {
+			sys_page_unmap(0, textpage_va(i));
+			textpages[i].tp_file = NULL;
+			ntextpages--;
+		}
+}
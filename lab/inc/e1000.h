@@ -0,0 +1,277 @@
+#ifndef JOS_INC_E1000_H
+#define JOS_INC_E1000_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/syscall.h>
+
+// Intel 82540EM (e1000) registers and descriptors, for the kernel's driver
+// and for a network server driving the card through a kernel-bypass
+// mapping (sys_net_bypass).
+
+/* Register Set. (82543, 82544)
+ *  
+ * Registers are defined to be 32 bits and  should be accessed as 32 bit values.
+ * These registers are physically located on the NIC, but are mapped into the
+ * host memory address space.
+ *     
+ * RW - register is both readable and writable
+ * RO - register is read only
+ * WO - register is write only
+ * R/clr - register is read only and is cleared when read
+ * A - register array
+ */
+#define CTRL     0x00000  /* Device Control - RW */
+#define CTRL_DUP 0x00004  /* Device Control Duplicate (Shadow) - RW */
+#define STATUS   0x00008  /* Device Status - RO */
+#define EECD     0x00010  /* EEPROM/Flash Control - RW */
+#define EERD     0x00014  /* EEPROM Read - RW */
+
+#define TDBAL    0x03800  /* TX Descriptor Base Address Low - RW */
+#define TDBAH    0x03804  /* TX Descriptor Base Address High - RW */
+#define TDLEN    0x03808  /* TX Descriptor Length - RW */
+#define TDH      0x03810  /* TX Descriptor Head - RW */
+#define TDT      0x03818  /* TX Descripotr Tail - RW */
+#define TCTL     0x00400  /* TX Control - RW */
+#define TIPG     0x00410  /* TX Inter-packet gap -RW */
+
+#define	RA       0x05400  /* Receive Address - RW Array */
+#define MTA      0x05200  /* Multicast Table Array - RW Array */
+#define RDBAL    0x02800  /* RX Descriptor Base Address Low - RW */
+#define RDBAH    0x02804  /* RX Descriptor Base Address High - RW */
+#define RDLEN    0x02808  /* RX Descriptor Length - RW */
+#define RDH      0x02810  /* RX Descriptor Head - RW */
+#define RDT      0x02818  /* RX Descriptor Tail - RW */
+#define RCTL     0x00100  /* RX Control - RW */
+#define ICR      0x000C0  /* Interrupt Cause Read - R/clr */
+#define ICS      0x000C8  /* Interrupt Cause Set - WO */
+#define IMS      0x000D0  /* Interrupt Mask Set - RW */
+#define IMC      0x000D8  /* Interrupt Mask Clear - WO */
+#define ITR      0x000C4  /* Interrupt Throttling Rate - RW */
+#define RXCSUM   0x05000  /* RX Checksum Control - RW */
+#define RAS_DEST       0x00000000
+#define RAV	       0x80000000
+
+/* Interrupt Cause Read / Interrupt Mask Set bits */
+#define ICR_TXDW       0x00000001 /* Transmit desc written back */
+#define ICR_TXQE       0x00000002 /* Transmit Queue empty */
+#define ICR_LSC        0x00000004 /* Link Status Change */
+#define ICR_RXDMT0     0x00000010 /* rx desc min. threshold (0) */
+#define ICR_RXO        0x00000040 /* rx overrun */
+#define ICR_RXT0       0x00000080 /* rx timer intr (ring 0) */
+
+/* Transmit Descriptor bit definitions */
+#define TXD_CMD_EOP    0x01 /* End of Packet */
+#define TXD_CMD_IFCS   0x02 /* Insert FCS (Ethernet CRC) */
+#define TXD_CMD_IC     0x04 /* Insert Checksum */
+#define TXD_CMD_RS     0x08 /* Report Status */
+#define TXD_CMD_RPS    0x10 /* Report Packet Sent */
+#define TXD_CMD_DEXT   0x20 /* Descriptor extension (0 = legacy) */
+#define TXD_CMD_VLE    0x40 /* Add VLAN tag */
+#define TXD_CMD_IDE    0x80 /* Enable Tidv register */
+#define TXD_STAT_DD    0x01 /* Descriptor Done */
+#define TXD_STAT_EC    0x02 /* Excess Collisions */
+#define TXD_STAT_LC    0x04 /* Late Collisions */
+#define TXD_STAT_TU    0x08 /* Transmit underrun */
+#define TXD_CMD_TCP    0x01 /* TCP packet */
+#define TXD_CMD_IP     0x02 /* IP packet */
+#define TXD_CMD_TSE    0x04 /* TCP Seg enable */
+#define TXD_STAT_TC    0x04 /* Tx Underrun */
+#define TXD_DTYP_CTX   0x00 /* Context descriptor (dtyp byte, with DEXT) */
+#define TXD_DTYP_DATA  0x10 /* Extended data descriptor (dtyp byte) */
+#define TXD_POPTS_IXSM 0x01 /* Insert IP checksum */
+#define TXD_POPTS_TXSM 0x02 /* Insert TCP/UDP checksum */
+
+/* Receive Descriptor bit definitions */
+#define RXD_STAT_DD       0x01    /* Descriptor Done */
+#define RXD_STAT_EOP      0x02    /* End of Packet */
+#define RXD_STAT_IXSM     0x04    /* Ignore checksum */
+#define RXD_STAT_VP       0x08    /* IEEE VLAN Packet */
+#define RXD_STAT_UDPCS    0x10    /* UDP xsum caculated */
+#define RXD_STAT_TCPCS    0x20    /* TCP xsum calculated */
+#define RXD_STAT_IPCS     0x40    /* IP xsum calculated */
+#define RXD_STAT_PIF      0x80    /* passed in-exact filter */
+#define RXD_STAT_IPIDV    0x200   /* IP identification valid */
+#define RXD_STAT_UDPV     0x400   /* Valid UDP checksum */
+#define RXD_STAT_ACK      0x8000  /* ACK Packet indication */
+#define RXD_ERR_CE        0x01    /* CRC Error */
+#define RXD_ERR_SE        0x02    /* Symbol Error */
+#define RXD_ERR_SEQ       0x04    /* Sequence Error */
+#define RXD_ERR_CXE       0x10    /* Carrier Extension Error */
+#define RXD_ERR_TCPE      0x20    /* TCP/UDP Checksum Error */
+#define RXD_ERR_IPE       0x40    /* IP Checksum Error */
+#define RXD_ERR_RXE       0x80    /* Rx Data Error */
+#define RXD_SPC_VLAN_MASK 0x0FFF  /* VLAN ID is in lower 12 bits */
+#define RXD_SPC_PRI_MASK  0xE000  /* Priority is in upper 3 bits */
+#define RXD_SPC_PRI_SHIFT 13
+#define RXD_SPC_CFI_MASK  0x1000  /* CFI is bit 12 */
+#define RXD_SPC_CFI_SHIFT 12
+
+/* Receive Checksum Control */
+#define RXCSUM_IPOFL 0x00000100   /* IPv4 checksum offload */
+#define RXCSUM_TUOFL 0x00000200   /* TCP / UDP checksum offload */
+
+/* Transmit Control */
+#define TCTL_RST    0x00000001    /* software reset */
+#define TCTL_EN     0x00000002    /* enable tx */
+#define TCTL_BCE    0x00000004    /* busy check enable */
+#define TCTL_PSP    0x00000008    /* pad short packets */
+#define TCTL_CT     0x00000ff0    /* collision threshold */
+#define TCTL_COLD   0x003ff000    /* collision distance */
+#define TCTL_SWXOFF 0x00400000    /* SW Xoff transmission */
+#define TCTL_PBE    0x00800000    /* Packet Burst Enable */
+#define TCTL_RTLC   0x01000000    /* Re-transmit on late collision */
+#define TCTL_NRTU   0x02000000    /* No Re-transmit on underrun */
+#define TCTL_MULR   0x10000000    /* Multiple request support */
+
+
+/* Receive Control */
+#define RCTL_RST            0x00000001    /* Software reset */
+#define RCTL_EN             0x00000002    /* enable */
+#define RCTL_SBP            0x00000004    /* store bad packet */
+#define RCTL_UPE            0x00000008    /* unicast promiscuous enable */
+#define RCTL_MPE            0x00000010    /* multicast promiscuous enab */
+#define RCTL_LPE            0x00000020    /* long packet enable */
+#define RCTL_LBM_NO         0x00000000    /* no loopback mode */
+#define RCTL_BAM            0x00008000    /* broadcast enable */
+#define RCTL_SECRC          0x04000000    /* Strip Ethernet CRC */
+#define RCTL_DTYP_MASK      0x00000C00    /* Descriptor type mask */
+#define RCTL_BSIZE_2048     0x00000000
+#define RCTL_BSIZE	    RCTL_BSIZE_2048
+
+#define TXRING_LEN	128
+#define RXRING_LEN	128
+#define TBUFFSIZE	2048
+#define RBUFFSIZE	2048
+#define ETH_HLEN	14		// Ethernet header, before the IP header
+
+struct tx_desc
+{
+	uint64_t addr;
+	uint16_t length;
+	uint8_t cso;
+	uint8_t cmd;
+	uint8_t status;
+	uint8_t css;
+	uint16_t special;
+} __attribute__((packed));
+
+// Extended transmit descriptors.  A context descriptor tells the card
+// where the checksums of the data descriptors that follow go; it stays
+// in effect until the next one.  Both are the size of a struct tx_desc,
+// with status and cmd in the same places.
+struct tx_ctx_desc
+{
+	uint8_t ipcss;		// IP checksum start
+	uint8_t ipcso;		// IP checksum offset
+	uint16_t ipcse;		// IP checksum end (inclusive)
+	uint8_t tucss;		// TCP/UDP checksum start
+	uint8_t tucso;		// TCP/UDP checksum offset
+	uint16_t tucse;		// TCP/UDP checksum end (0: end of packet)
+	uint16_t paylen;
+	uint8_t dtyp;
+	uint8_t tucmd;
+	uint8_t status;
+	uint8_t hdrlen;
+	uint16_t mss;
+} __attribute__((packed));
+
+struct tx_data_desc
+{
+	uint64_t addr;
+	uint16_t length;
+	uint8_t dtyp;
+	uint8_t dcmd;
+	uint8_t status;
+	uint8_t popts;
+	uint16_t special;
+} __attribute__((packed));
+
+struct rx_desc
+{
+	uint64_t addr;
+	uint16_t length;
+	uint16_t cs;
+	uint8_t status;
+	uint8_t errors;
+	uint16_t special;
+}  __attribute__((packed));
+
+// Make c a context descriptor for frames with an IPv4 header of iphlen
+// bytes carrying TCP, for the NETFRAG_CSUM_* and NETFRAG_TSO work in
+// 'offload'.  For segmentation the frame carries paylen bytes of
+// payload after its headers, and the context lasts for that frame only.
+static __inline void
+e1000_tx_ctx(struct tx_ctx_desc *c, uint8_t iphlen, int offload,
+	     uint32_t paylen)
+{
+	c->ipcss = ETH_HLEN;
+	c->ipcso = ETH_HLEN + 10;
+	c->ipcse = ETH_HLEN + iphlen - 1;
+	c->tucss = ETH_HLEN + iphlen;
+	c->tucso = ETH_HLEN + iphlen + 16;
+	c->tucse = 0;
+	c->dtyp = TXD_DTYP_CTX;
+	c->tucmd = TXD_CMD_DEXT | TXD_CMD_RS | TXD_CMD_IP | TXD_CMD_TCP;
+	c->status = 0;
+	c->paylen = c->hdrlen = c->mss = 0;
+	if (offload & NETFRAG_TSO) {
+		c->tucmd |= TXD_CMD_TSE;
+		c->paylen = paylen & 0xFFFF;
+		c->dtyp |= (paylen >> 16) & 0xF;
+		c->hdrlen = ETH_HLEN + iphlen + NETFRAG_TCPHLEN_OF(offload);
+		c->mss = NETFRAG_MSS_OF(offload);
+	}
+}
+
+// The NETRX_* checksums the card verified for the frame of d.  With
+// IXSM set it checked nothing.
+static __inline int
+e1000_rx_csum(const struct rx_desc *d)
+{
+	int flags = 0;
+
+	if (!(d->status & RXD_STAT_IXSM)) {
+		if ((d->status & RXD_STAT_IPCS) && !(d->errors & RXD_ERR_IPE))
+			flags |= NETRX_CSUM_IP;
+		if ((d->status & RXD_STAT_TCPCS) && !(d->errors & RXD_ERR_TCPE))
+			flags |= NETRX_CSUM_L4;
+	}
+	return flags;
+}
+
+/*
+ * Kernel-bypass mapping.  sys_net_bypass maps, from the given address:
+ *	NB_INFO		a read-only struct NetBypass
+ *	NB_REGS		the card's registers, read-only
+ *	NB_TXRING	the transmit ring, TXRING_LEN struct tx_descs,
+ *			read-only
+ *	NB_RXRING	the receive ring, RXRING_LEN struct rx_descs,
+ *			read-only
+ *	NB_TXQUEUE	TXRING_LEN struct tx_descs for the transmit ring
+ *	NB_TXBUF	a TBUFFSIZE-byte buffer for each transmit descriptor
+ *	NB_RXBUF	the RBUFFSIZE-byte buffer of each receive descriptor
+ * Receive descriptor i points at receive buffer i, and the card owns
+ * all but the last of them: RDH is 0 and RDT is RXRING_LEN - 1.  The
+ * transmit ring starts out empty, with TDH and TDT 0.  Descriptors
+ * are written to NB_TXQUEUE and handed to the card, and receive
+ * descriptors given back, with sys_net_bypass_push.
+ */
+#define NB_REGSIZE	0x20000
+#define NB_INFO		0
+#define NB_REGS		(NB_INFO + PGSIZE)
+#define NB_TXRING	(NB_REGS + NB_REGSIZE)
+#define NB_RXRING	(NB_TXRING + PGSIZE)
+#define NB_TXQUEUE	(NB_RXRING + PGSIZE)
+#define NB_TXBUF	(NB_TXQUEUE + PGSIZE)
+#define NB_RXBUF	(NB_TXBUF + TXRING_LEN * TBUFFSIZE)
+#define NB_SIZE		(NB_RXBUF + RXRING_LEN * RBUFFSIZE)
+
+struct NetBypass {
+	// Interrupts taken from the card so far.  The kernel wakes
+	// futex waiters on it, and interrupts the owner's sys_ipc_recv
+	// with -E_INTR, after each.
+	volatile uint32_t nb_intr;
+};
+
+#endif	// !JOS_INC_E1000_H
@@ -51,6 +51,8 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+struct Timer;
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -59,7 +61,14 @@ struct Env {
 	enum EnvType env_type;		// Indicates special system environments
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
+	uint32_t env_syscalls;		// Number of system calls made
+	uint64_t env_cycles;		// TSC cycles spent running, in user
+					// mode or in the kernel on its behalf
 	int env_cpunum;			// The CPU that the env is running on
+	uint32_t env_affinity;		// CPUs it may run on: bit i for CPU i
+	uint32_t env_migrations;	// Times it moved to a different CPU
+	uint32_t env_tx_done;		// Packets it sent that the NIC has
+					// finished with (see sys_netpacket_tx_reclaim)
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
@@ -70,12 +79,26 @@ struct Env {
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
+	bool env_notify_pending;	// Next sys_ipc_recv fails with -E_INTR
+	envid_t env_ipc_want;		// Only sender accepted, or 0 for any
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
 
+	// Timeout for sys_sleep_until and sys_ipc_recv (kernel only)
+	struct Timer *env_timer;
+
+	// Futex queue this env is blocked on, if any (kernel only)
+	physaddr_t env_futex_key;	// Physical address waited on
+	struct Env *env_futex_next;
+	struct Env **env_futex_pprev;	//   (NULL: not waiting)
+
 	// challenge fixed-priority schedule
 	int env_priority;
+
+	// Fair-share scheduling: env_cycles scaled down by the weight
+	// env_priority gives the environment (kernel only)
+	uint64_t env_vruntime;
 };
 
 #endif // !JOS_INC_ENV_H
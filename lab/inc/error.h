@@ -26,6 +26,11 @@ enum {
 	E_NOT_EXEC	,	// File not a valid executable
 	E_NOT_SUPP	,	// Operation not supported
 
+	// Newer error codes -- add them at the end, so that the codes
+	// above keep their values
+	E_TIMEOUT	,	// Timed out waiting
+	E_INTR		,	// Interrupted by a notification
+
 	MAXERROR
 };
 
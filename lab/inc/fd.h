@@ -29,6 +29,7 @@ struct FdFile {
 
 struct FdSock {
 	int sockid;
+	bool sockbuf;		// Data moves through a struct Sockbuf
 };
 
 struct Fd {
@@ -70,7 +70,9 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Pagein returns a page holding file data (see lib/loader.c)
+	FSREQ_PAGEIN
 };
 
 union Fsipc {
@@ -108,6 +110,11 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_pagein {
+		int req_fileid;
+		off_t req_offset;
+		int req_private;
+	} pagein;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
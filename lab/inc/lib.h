@@ -59,10 +59,26 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_until(void *rcv_pg, unsigned int deadline);
+int	sys_sleep_until(unsigned int deadline);
+int	sys_env_set_affinity(envid_t env, uint32_t mask);
+int	sys_futex_wait(const volatile uint32_t *addr, uint32_t val, unsigned int deadline);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
 unsigned int sys_time_msec(void);
 int	sys_env_set_priority(envid_t env, int priority);
 int	sys_netpacket_try_send(void *addr, size_t len);
 int	sys_netpacket_recv(void *addr, size_t buflen);
+int	sys_netpacket_try_sendv(const struct NetFrag *frags, int nfrags);
+int	sys_netpacket_tx_reclaim(void);
+int	sys_netpacket_recv_page(void *dstva);
+int	sys_netpacket_wait(int what, unsigned int deadline);
+int	sys_netpacket_recv_batch(void *dstva, int npages);
+int	sys_netpacket_send_batch(const struct NetFrag *frags, int nfrags);
+int	sys_net_bypass(void *va);
+int	sys_net_bypass_push(uint32_t tdt, uint32_t rdt);
+int	sys_env_notify(envid_t envid);
+int	sys_ipc_recv_from(envid_t from, void *dstva);
+int	sys_page_map_batch(struct PageMapOp *ops, int nops);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -80,10 +96,25 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_until(envid_t *from_env_store, void *pg, int *perm_store,
+		       unsigned int deadline);
 envid_t	ipc_find_env(enum EnvType type);
 
+// pgmap.c
+#define PGMAP_BATCH	16
+struct PageMapBatch {
+	int n;
+	int npages;		// Pages the queued operations cover
+	struct PageMapOp ops[PGMAP_BATCH];
+};
+void	pgmap_init(struct PageMapBatch *b);
+int	pgmap_add(struct PageMapBatch *b, int type, void *srcva,
+		  envid_t dstenv, void *dstva, int perm, int npages);
+int	pgmap_flush(struct PageMapBatch *b);
+
 // fork.c
 #define	PTE_SHARE	0x400
+#define	PTE_CONTINUED	0x200	// malloc: block continues on the next page
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -125,6 +156,8 @@ int     nsipc_listen(int s, int backlog);
 int     nsipc_recv(int s, void *mem, int len, unsigned int flags);
 int     nsipc_send(int s, const void *buf, int size, unsigned int flags);
 int     nsipc_socket(int domain, int type, int protocol);
+int     nsipc_sockbuf(struct Sockbuf *sb);
+void    nsipc_notify(void);
 
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
@@ -143,6 +176,9 @@ int	pipeisclosed(int pipefd);
 // wait.c
 void	wait(envid_t env);
 
+// time.c
+uint64_t time_nsec(void);
+
 /* File open modes */
 #define	O_RDONLY	0x0000		/* open for reading only */
 #define	O_WRONLY	0x0001		/* open for writing only */
@@ -0,0 +1,65 @@
+// Interface between spawn and the demand-paging loader (lib/loader.c).
+
+#ifndef JOS_INC_LOADER_H
+#define JOS_INC_LOADER_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/trap.h>
+#include <inc/memlayout.h>
+
+// Maximum number of segments the loader can page in for one program
+#define LOADINFO_MAXSEGS	8
+
+// A program segment that is paged in on demand.
+struct LoadSeg {
+	uintptr_t ls_va;	// Page-aligned start of the segment
+	size_t ls_memsz;	// Bytes in memory, counted from ls_va
+	size_t ls_filesz;	// Bytes backed by the file, counted from ls_va
+	off_t ls_offset;	// Page-aligned file offset of ls_va
+	int ls_perm;		// Permissions of the segment's pages
+};
+
+// Kept at ULOADINFO in every environment whose program is paged in on
+// demand.  The program file's Fd page is mapped at ULOADFD so the file
+// stays open for as long as the environment (or any fork of it) lives.
+struct LoadInfo {
+	envid_t li_fsenv;	// File server to page in from
+	int li_fileid;		// File ID of the open program file
+	int li_nsegs;		// Number of valid entries in li_segs
+	struct LoadSeg li_segs[LOADINFO_MAXSEGS];
+};
+
+// Entry points of the loader, at the very start of ULOADER.
+struct LoaderVec {
+	// Page fault upcall to give to sys_env_set_pgfault_upcall.
+	// Faults the loader does not handle kill the environment.
+	void (*lv_upcall)(void);
+	// Resolve a page fault on a page that has not been paged in yet.
+	// Returns 1 if the fault was handled, 0 if it is not the loader's.
+	int (*lv_fault)(struct UTrapframe *utf);
+};
+
+#define loadervec	((const struct LoaderVec *) ULOADER)
+
+// Is there a loader mapped at ULOADER?
+static inline bool
+loader_present(void)
+{
+	const volatile pde_t *pd = (const volatile pde_t *) (UVPT + (UVPT >> 12) * 4);
+	const volatile pte_t *pt = (const volatile pte_t *) UVPT;
+
+	return (pd[PDX(ULOADER)] & PTE_P) && (pt[PGNUM(ULOADER)] & PTE_P);
+}
+
+// Is part of this environment's program paged in on demand?
+static inline bool
+loader_active(void)
+{
+	const volatile pde_t *pd = (const volatile pde_t *) (UVPT + (UVPT >> 12) * 4);
+	const volatile pte_t *pt = (const volatile pte_t *) UVPT;
+
+	return (pd[PDX(ULOADINFO)] & PTE_P) && (pt[PGNUM(ULOADINFO)] & PTE_P);
+}
+
+#endif /* !JOS_INC_LOADER_H */
@@ -43,14 +43,18 @@
  *                     +------------------------------+                   |
  *                     :              .               :                   |
  *                     :              .               :                   |
- *    MMIOLIM ------>  +------------------------------+ 0xefc00000      --+
+ *                     | - - - - - - - - - - - - - - -|                   |
+ *                     |  Kernel Env Table (grows up) | RW/--             |
+ * MMIOLIM, KENVS -->  +------------------------------+ 0xefc00000      --+
  *                     |       Memory-mapped I/O      | RW/--  PTSIZE
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
+ *                     |         RO Time Page         | R-/R-  PGSIZE
+ *    UTIME     ---->  +------------------------------+ 0xeefff000
+ *                     |           RO ENVS            | R-/R-  PTSIZE-PGSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
@@ -68,6 +72,12 @@
  *                     |     Program Data & Heap      |
  *    UTEXT -------->  +------------------------------+ 0x00800000
  *    PFTEMP ------->  |       Empty Memory (*)       |        PTSIZE
+ *                     | - - - - - - - - - - - - - - -| 0x007ff000
+ *    ULOADBUF ----->  |    Loader Request Page       | RW/RW  PGSIZE
+ *    ULOADFD ------>  |    Loader Program Fd         | RW/RW  PGSIZE
+ *    ULOADINFO ---->  |    Loader Segment Table      | R-/R-  PGSIZE
+ *    ULOADER ------>  |    Demand-Paging Loader      | R-/R-  4*PGSIZE
+ *                     | - - - - - - - - - - - - - - -| 0x007f7000
  *                     |                              |
  *    UTEMP -------->  +------------------------------+ 0x00400000      --+
  *                     |       Empty Memory (*)       |                   |
@@ -101,6 +111,11 @@
 #define MMIOLIM		(KSTACKTOP - PTSIZE)
 #define MMIOBASE	(MMIOLIM - PTSIZE)
 
+// The kernel's read-write view of the envs[] array, which users see
+// read-only at UENVS.  It shares the page table of the kernel stacks
+// and is backed by memory a page at a time as it grows (see env_grow).
+#define KENVS		MMIOLIM
+
 #define ULIM		(MMIOBASE)
 
 /*
@@ -114,6 +129,9 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only kernel clock (see <inc/time.h>), in the top page of UENVS's
+// page table
+#define UTIME		(UPAGES - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -135,6 +153,14 @@
 // Used for temporary page mappings for the user page-fault handler
 // (should not conflict with other temporary page mappings)
 #define PFTEMP		(UTEMP + PTSIZE - PGSIZE)
+// The demand-paging loader for spawned programs (see lib/loader.c).
+// The kernel maps its code read-only into every environment at ULOADER;
+// spawn sets up the pages above it for programs that are loaded lazily.
+#define ULOADER		((uintptr_t) PFTEMP - 8*PGSIZE)
+#define ULOADERPAGES	4
+#define ULOADINFO	(ULOADER + ULOADERPAGES*PGSIZE)
+#define ULOADFD		(ULOADINFO + PGSIZE)
+#define ULOADBUF	(ULOADFD + PGSIZE)
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE / 2)
 
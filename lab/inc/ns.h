@@ -9,9 +9,31 @@
 
 struct jif_pkt {
 	int jp_len;
+	int jp_flags;		// NETRX_* for received packets
 	char jp_data[0];
 };
 
+// A page of packets holds struct jif_pkts back to back, each starting
+// on a 4-byte boundary, up to one with a jp_len of 0 or the end of the
+// page.  NSREQ_OUTPUT pages are pages of packets, and so are the pages
+// the input environment passes the server (see net/input.c).
+static inline struct jif_pkt *
+jif_pkt_next(const struct jif_pkt *pkt)
+{
+	return (struct jif_pkt *) ((char *) pkt
+		+ ROUNDUP(sizeof(*pkt) + pkt->jp_len, 4));
+}
+
+// Is pkt a packet of the page of packets at page, rather than its end?
+static inline bool
+jif_pkt_valid(const void *page, const struct jif_pkt *pkt)
+{
+	size_t off = (const char *) pkt - (const char *) page;
+
+	return off + sizeof(*pkt) <= PGSIZE && pkt->jp_len > 0
+		&& pkt->jp_len <= PGSIZE - off - sizeof(*pkt);
+}
+
 // Definitions for requests from clients to network server
 enum {
 	// The following messages pass a page containing an Nsipc.
@@ -26,15 +48,16 @@ enum {
 	NSREQ_RECV,
 	NSREQ_SEND,
 	NSREQ_SOCKET,
-
-	// The following two messages pass a page containing a struct jif_pkt
-	NSREQ_INPUT,
-	// NSREQ_OUTPUT, unlike all other messages, is sent *from* the
-	// network server, to the output environment
+	// Sockbuf passes a struct Sockbuf instead, which the server keeps.
+	NSREQ_SOCKBUF,
+
+	// The following message passes a page containing a struct jif_pkt.
+	// Received packets reach the server through shared memory instead.
+	// NSREQ_OUTPUT, unlike all other messages, is sent to the output
+	// environment, not the network server.  The network server itself
+	// transmits directly (see jif.c); the output environment serves
+	// the testoutput and testinput programs.
 	NSREQ_OUTPUT,
-
-	// The following message passes no page
-	NSREQ_TIMER,
 };
 
 union Nsipc {
@@ -103,4 +126,51 @@ union Nsipc {
 	char _pad[PGSIZE];
 };
 
+// Bytes in each direction's ring of a Sockbuf
+#define SOCKBUF_RINGSIZ	2016
+
+// A stream socket's data buffers, in a page the client and the network
+// server share.  (Datagram sockets use NSREQ_RECV and NSREQ_SEND, which
+// keep datagrams whole.)  The client sends the page, with sb_s set, as
+// an NSREQ_SOCKBUF request once it has the socket; from then on reads
+// and writes move through the two rings like through a pipe, with no
+// IPC.  Each ring has one writer and one reader, and each side only
+// writes its own positions.  A side about to block sets its wait flag,
+// and the other then wakes it: the server the client with
+// sys_futex_wake on the position it waits on, the client the server
+// with sys_env_notify.  Positions count modulo twice the ring size, so
+// that a full ring is told apart from an empty one.
+struct Sockbuf {
+	int sb_s;
+	// Client to server
+	volatile uint32_t sb_txwpos;
+	volatile uint32_t sb_txrpos;
+	volatile int32_t sb_txerr;	// Set (to -E_*) when the server
+					// cannot send
+	// Server to client
+	volatile uint32_t sb_rxwpos;
+	volatile uint32_t sb_rxrpos;
+	volatile uint32_t sb_rxdone;	// Set after the last data ...
+	volatile int32_t sb_rxerr;	// ... to -E_*, or 0 at end of file
+	volatile uint32_t sb_txwait;
+	volatile uint32_t sb_rxwait;
+	volatile uint32_t sb_srvwait;
+	char sb_txbuf[SOCKBUF_RINGSIZ];
+	char sb_rxbuf[SOCKBUF_RINGSIZ];
+};
+
+// Bytes between ring positions rpos and wpos
+static inline uint32_t
+sockbuf_used(uint32_t wpos, uint32_t rpos)
+{
+	return (wpos + 2 * SOCKBUF_RINGSIZ - rpos) % (2 * SOCKBUF_RINGSIZ);
+}
+
+// Ring position n bytes after pos
+static inline uint32_t
+sockbuf_advance(uint32_t pos, uint32_t n)
+{
+	return (pos + n) % (2 * SOCKBUF_RINGSIZ);
+}
+
 #endif // !JOS_INC_NS_H
@@ -1,6 +1,9 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+#include <inc/env.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -21,7 +24,104 @@ enum {
 	SYS_env_set_priority,
 	SYS_netpacket_try_send,
 	SYS_netpacket_recv,
+	SYS_page_map_batch,
+	SYS_sleep_until,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_env_set_affinity,
+	SYS_netpacket_try_sendv,
+	SYS_netpacket_tx_reclaim,
+	SYS_netpacket_recv_page,
+	SYS_netpacket_wait,
+	SYS_netpacket_recv_batch,
+	SYS_netpacket_send_batch,
+	SYS_net_bypass,
+	SYS_net_bypass_push,
+	SYS_env_notify,
+	SYS_ipc_recv_from,
 	NSYSCALLS
 };
 
+// Operations understood by SYS_page_map_batch
+enum {
+	PGMAP_MAP = 0,		// like sys_page_map from the calling env
+	PGMAP_ALLOC,		// like sys_page_alloc
+	PGMAP_UNMAP,		// like sys_page_unmap
+	PGMAP_GET,		// like sys_page_map from dstenv to the
+				// calling env: the reverse of PGMAP_MAP
+};
+
+// One entry of a SYS_page_map_batch request.  It covers 'npages'
+// consecutive pages starting at 'srcva' (PGMAP_MAP only) and 'dstva'.
+struct PageMapOp {
+	int op;			// PGMAP_*
+	void *srcva;		// Source VA in the calling env
+	envid_t dstenv;		// Target env (0 means the calling env)
+	void *dstva;		// Target VA in dstenv
+	int perm;		// PTE permissions for MAP and ALLOC
+	int npages;		// Number of consecutive pages
+};
+
+// Maximum number of operations in one SYS_page_map_batch call
+#define PGMAP_MAXOPS	256
+// Maximum number of pages all operations in one call cover together
+#define PGMAP_MAXPAGES	1024
+
+// One piece of a packet for SYS_netpacket_try_sendv and
+// SYS_netpacket_send_batch.  The pieces of a packet are sent back to
+// back, straight from the sender's memory.
+struct NetFrag {
+	const void *nf_va;	// Start of the piece in the calling env
+	size_t nf_len;		// Its length in bytes
+	int nf_flags;		// NETFRAG_*
+};
+
+// nf_flags: this is the last piece of a packet (SYS_netpacket_send_batch)
+#define NETFRAG_EOP	0x1
+
+// nf_flags of a packet's first piece: have the NIC fill in checksums of
+// an Ethernet frame carrying IPv4, whose header is NETFRAG_IPHLEN bytes
+// long.  The IP header checksum field must be zero; the TCP one must
+// hold the (uncomplemented) sum of the TCP pseudo-header.
+#define NETFRAG_CSUM_IP		0x2
+#define NETFRAG_CSUM_TCP	0x4
+#define NETFRAG_IPHLEN(n)	((n) << 8)
+#define NETFRAG_IPHLEN_OF(f)	(((f) >> 8) & 0xFF)
+
+// nf_flags of a packet's first piece: the packet is one TCP segment
+// with a payload of up to NETPACKET_TSO_MAX bytes, which the NIC sends
+// as segments of NETFRAG_MSS bytes of payload, copying the headers
+// (NETFRAG_TCPHLEN bytes of TCP header) and fixing up lengths,
+// sequence numbers and checksums.  Needs NETFRAG_CSUM_IP and _TCP,
+// but the TCP pseudo-header sum must leave out the TCP length.
+#define NETFRAG_TSO		0x8
+#define NETFRAG_TCPHLEN(n)	(((n) >> 2) << 4)
+#define NETFRAG_TCPHLEN_OF(f)	((((f) >> 4) & 0xF) << 2)
+#define NETFRAG_MSS(n)		((n) << 16)
+#define NETFRAG_MSS_OF(f)	(((f) >> 16) & 0x3FFF)
+
+// Maximum number of pieces in one packet
+#define NETFRAG_MAX	16
+
+// Maximum number of pieces in one SYS_netpacket_send_batch, and of
+// pages in one SYS_netpacket_recv_batch
+#define NETBATCH_MAXFRAGS	64
+#define NETBATCH_MAXPAGES	16
+
+// Largest packet SYS_netpacket_try_send{,v} will send, and largest
+// piece of one; with NETFRAG_TSO, the largest before segmentation
+#define NETPACKET_MAX		2048
+#define NETPACKET_TSO_MAX	(NETFRAG_MAX * NETPACKET_MAX)
+
+// Checksums the NIC verified for a received frame, kept next to its
+// length (struct jif_pkt's jp_flags)
+#define NETRX_CSUM_IP	0x1	// IPv4 header checksum is good
+#define NETRX_CSUM_L4	0x2	// TCP or UDP checksum is good
+
+// What SYS_netpacket_wait waits for
+enum {
+	NETWAIT_RX = 0,		// a received frame
+	NETWAIT_TX,		// room in the transmit ring
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
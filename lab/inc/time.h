@@ -0,0 +1,32 @@
+#ifndef JOS_INC_TIME_H
+#define JOS_INC_TIME_H
+
+#include <inc/types.h>
+
+// The kernel's clock, which user environments can read without a system
+// call at UTIME.  The time is the number of TSC cycles since tp_tsc_base,
+// scaled to nanoseconds by tp_mult and tp_shift:
+//
+//	ns = (cycles * tp_mult) >> tp_shift
+//
+// The kernel calibrates the TSC and fills in the page once, at boot.
+struct TimePage {
+	uint64_t tp_tsc_base;		// TSC value at time 0
+	uint32_t tp_tsc_khz;		// TSC frequency
+	uint32_t tp_mult;		// Scale from cycles to nanoseconds
+	uint32_t tp_shift;		//   (tp_shift <= 32)
+};
+
+// Nanoseconds since time 0 at TSC value 'tsc'.  The product needs up
+// to 96 bits, so it is built from two 32x32-bit multiplications.
+static __inline uint64_t
+timepage_nsec(const volatile struct TimePage *tp, uint64_t tsc)
+{
+	uint64_t cycles = tsc - tp->tp_tsc_base;
+	uint64_t hi = (uint64_t) (uint32_t) (cycles >> 32) * tp->tp_mult;
+	uint64_t lo = (uint64_t) (uint32_t) cycles * tp->tp_mult;
+
+	return (hi << (32 - tp->tp_shift)) + (lo >> tp->tp_shift);
+}
+
+#endif /* !JOS_INC_TIME_H */
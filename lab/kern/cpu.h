@@ -23,6 +23,11 @@ struct CpuInfo {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	bool cpu_tlb_defer;             // Batch TLB invalidations (see tlb_defer_begin)
+	bool cpu_tlb_stale;             // A deferred invalidation is pending
+	volatile uint32_t cpu_wakeup;   // Set by sched_wakeup to end sched_halt
+	uint64_t cpu_deadline;          // When an idle CPU's timer fires (ns), or 0
+	uint64_t cpu_tsc;               // TSC when curenv was last charged
 };
 
 // Initialized in mpconfig.c
@@ -41,6 +46,8 @@ void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
+void lapic_timer_oneshot(uint64_t ns);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
 
 #endif
@@ -1,54 +1,124 @@
 #include <inc/x86.h>
 #include <inc/string.h>
+#include <inc/error.h>
 #include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/futex.h>
+#include <kern/picirq.h>
 #include <kern/e1000.h>
 
 // LAB 6: Your driver code here
 uint32_t mac[2] = {0x12005452, 0x5634};
 volatile uint32_t * e1000;
+static physaddr_t e1000_pa;	// Physical address of the registers
+int e1000_irq = -1;		// IRQ line, once attached
+
+// Statistics for the monitor's 'nic' command
+static struct {
+	uint32_t nintr;		// Interrupts taken
+	uint32_t nrx;		// Frames received
+	uint32_t ntx;		// Packets sent
+	uint32_t ntxcsum;	// ... of which the card checksummed
+	uint32_t ntso;		// ... of which the card segmented
+	uint32_t nrxcsum;	// Frames whose checksums the card verified
+	unsigned itr_usec;	// Current interrupt throttling gap
+} stats;
 
 struct tx_desc tx_d[TXRING_LEN] __attribute__((aligned (PGSIZE))) 
 		= {{0, 0, 0, 0, 0, 0, 0}};
-struct packet pbuf[TXRING_LEN] __attribute__((aligned (PGSIZE)))
-		= {{{0}}};
+
+// The transmit ring points straight at the sender's pages.  Each page
+// is pinned with a reference from the time its descriptor is queued
+// until the card sets DD, so the sender may unmap it meanwhile.
+// Descriptors tx_clean up to tx_tail are owned by the card.
+static struct PageInfo *tx_page[TXRING_LEN];
+static envid_t tx_owner[TXRING_LEN];	// Sender, on a packet's last descriptor
+static uint32_t tx_clean, tx_tail;
+// IP header length the card's checksum context was last set up for,
+// or 0 if none has been loaded or the last one was for segmentation
+static uint8_t tx_ctx_iphlen;
 
 struct rx_desc rx_d[RXRING_LEN] __attribute__((aligned (PGSIZE)))
 		= {{0, 0, 0, 0, 0, 0}};
-struct packet prbuf[RXRING_LEN] __attribute__((aligned (PGSIZE)))
-		= {{{0}}};
+
+// Every receive descriptor has a whole page of its own, which the ring
+// holds a reference to.  The card writes the frame RXPKT_OFF bytes into
+// the page, so that once its length is filled in the page is a struct
+// jif_pkt and can be handed to the receiver as it is.
+static struct PageInfo *rx_page[RXRING_LEN];
+
+// While an environment drives the card itself (see e1000_bypass), the
+// card works on these pages rather than on tx_d and rx_d: the pages
+// mapped at NB_INFO and at NB_TXRING onwards, in order.
+#define BYPASS_NPAGES	(1 + (NB_SIZE - NB_TXRING) / PGSIZE)
+static struct Env *bypass_env;
+static uintptr_t bypass_va;
+static struct PageInfo *bypass_page[BYPASS_NPAGES];
+
+// Kernel and physical addresses of the byte at offset 'off' of the
+// bypass mapping, which must not be in the registers
+static void *
+bypass_kva(uint32_t off)
+{
+	int i = off < NB_TXRING ? 0 : 1 + (off - NB_TXRING) / PGSIZE;
+
+	return (char *) page2kva(bypass_page[i]) + PGOFF(off);
+}
+
+static physaddr_t
+bypass_pa(uint32_t off)
+{
+	return PADDR(bypass_kva(off));
+}
 
 static void
 init_desc(){
 	int i;
 
-	for(i = 0; i < TXRING_LEN; i++){
+	for(i = 0; i < TXRING_LEN; i++)
 		memset(&tx_d[i], 0, sizeof(tx_d[i]));
-		tx_d[i].addr = PADDR(&pbuf[i]);
-		tx_d[i].status = TXD_STAT_DD;
-		tx_d[i].cmd = TXD_CMD_RS | TXD_CMD_EOP;
-	}
+	tx_clean = tx_tail = 0;
+	tx_ctx_iphlen = 0;
 	
 	for(i = 0; i < RXRING_LEN; i++){
 		memset(&rx_d[i], 0, sizeof(rx_d[i]));
-		rx_d[i].addr = PADDR(&prbuf[i]);
+		if (!(rx_page[i] = page_alloc(ALLOC_ZERO)))
+			panic("e1000: out of memory for receive buffers");
+		rx_page[i]->pp_ref++;
+		rx_d[i].addr = page2pa(rx_page[i]) + RXPKT_OFF;
 		rx_d[i].status = 0;
 	}
 }
 
+// Point the card at the transmit ring at physical address 'tx' and
+// the receive ring at 'rx', with the transmit ring empty and all but
+// one receive descriptor given to the card.  The card must be stopped.
+static void
+rings_load(physaddr_t tx, physaddr_t rx)
+{
+	e1000[TDBAL/4] = tx;
+	e1000[TDBAH/4] = 0;
+	e1000[TDLEN/4] = TXRING_LEN * sizeof(struct tx_desc);
+	e1000[TDH/4] = 0;
+	e1000[TDT/4] = 0;
+	e1000[RDBAL/4] = rx;
+	e1000[RDBAH/4] = 0;
+	e1000[RDLEN/4] = RXRING_LEN * sizeof(struct rx_desc);
+	e1000[RDH/4] = 0;
+	e1000[RDT/4] = RXRING_LEN - 1;
+}
+
 int
 pci_e1000_attach(struct pci_func *pcif)
 {
 	pci_func_enable(pcif);
 	init_desc();
 
+	e1000_pa = pcif->reg_base[0];
 	e1000 = mmio_map_region(pcif->reg_base[0], pcif->reg_size[0]);
 	cprintf("e1000: bar0  %x size0 %x\n", pcif->reg_base[0], pcif->reg_size[0]);
 	
-	e1000[TDBAL/4] = PADDR(tx_d);
-	e1000[TDBAH/4] = 0;
-	e1000[TDLEN/4] = TXRING_LEN * sizeof(struct tx_desc);
-	e1000[TDH/4] = 0;
-	e1000[TDT/4] = 0;
+	rings_load(PADDR(tx_d), PADDR(rx_d));
 	e1000[TCTL/4] = TCTL_EN | TCTL_PSP | (TCTL_CT & (0x10 << 4)) | (TCTL_COLD & (0x40 << 12));
     e1000[TIPG/4] = 10 | (8 << 10) | (12 << 20);
 
@@ -59,34 +129,138 @@ pci_e1000_attach(struct pci_func *pcif)
 	cprintf("e1000: mac address %x:%x\n", mac[1], mac[0]);
 
 	memset((void*)&e1000[MTA/4], 0, 128 * 4);
-    e1000[ICS/4] = 0;
-    e1000[IMS/4] = 0;
-    //e1000[IMC/4] = 0xFFFF;
-	e1000[RDBAL/4] = PADDR(rx_d);
-	e1000[RDBAH/4] = 0;
-	e1000[RDLEN/4] = RXRING_LEN * sizeof(struct rx_desc);
-	e1000[RDH/4] = 0;
-	e1000[RDT/4] = RXRING_LEN - 1;
+	e1000_set_itr(E1000_ITR_USEC);
+	e1000[RXCSUM/4] = RXCSUM_IPOFL | RXCSUM_TUOFL;
 	e1000[RCTL/4] = RCTL_EN | RCTL_LBM_NO | RCTL_SECRC | RCTL_BSIZE | RCTL_BAM;
+
+	// Interrupt when frames arrive or the receive ring runs low, and
+	// when transmit descriptors are done, so that waiters can block.
+	e1000_irq = pcif->irq_line;
+	e1000[IMC/4] = ~0;
+	(void) e1000[ICR/4];
+	e1000[IMS/4] = ICR_RXT0 | ICR_RXO | ICR_RXDMT0 | ICR_TXDW;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << e1000_irq));
     cprintf("e1000: status %x\n", e1000[STATUS/4]);
 	return 1;
 }
 
+//
+// Release the pages of descriptors the card has finished with, and
+// credit each finished packet to the env that sent it.
+//
+void
+e1000_tx_reclaim(void)
+{
+	struct tx_desc *d;
+	struct Env *e;
+
+	while (tx_clean != tx_tail && (tx_d[tx_clean].status & TXD_STAT_DD)) {
+		d = &tx_d[tx_clean];
+		// Context descriptors carry no page
+		if (tx_page[tx_clean]) {
+			page_decref(tx_page[tx_clean]);
+			tx_page[tx_clean] = NULL;
+			if ((d->cmd & TXD_CMD_EOP)
+			    && envid2env(tx_owner[tx_clean], &e, 0) == 0) {
+				e->env_tx_done++;
+				stats.ntx++;
+			}
+		}
+		tx_clean = (tx_clean + 1) % TXRING_LEN;
+	}
+}
+
+//
+// Point the card's checksum context at a frame with an IPv4 header of
+// iphlen bytes carrying TCP, using the descriptor at tail.  For TCP
+// segmentation, 'offload' has NETFRAG_TSO and the payload is paylen
+// bytes; the context then lasts for one packet.
+//
+static void
+tx_load_ctx(uint32_t tail, uint8_t iphlen, int offload, uint32_t paylen)
+{
+	e1000_tx_ctx((struct tx_ctx_desc *) &tx_d[tail], iphlen, offload,
+		     paylen);
+	tx_page[tail] = NULL;
+	tx_ctx_iphlen = offload & NETFRAG_TSO ? 0 : iphlen;
+}
+
+//
+// Queue one packet, made of nsegs pieces of physical pages, on behalf
+// of env 'owner'.  The card reads the pages directly; nothing is
+// copied.  Each page gains a reference until the card is done with it.
+// 'offload' holds the NETFRAG_CSUM_*, NETFRAG_TSO and header lengths
+// of the work the card is to do, which the caller has checked make
+// sense for the packet.  Such packets go in extended descriptors,
+// preceded by a context descriptor when the work differs from the
+// last packet's: always for segmentation.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_MEM if the ring does not have room for the packet.
+//	-E_NOT_SUPP if an environment drives the card itself.
+//
 int
-e1000_transmit(void *addr, size_t len)
+e1000_transmit(const struct e1000_seg *segs, int nsegs, int offload,
+	       envid_t owner)
 {
-	uint32_t tail = e1000[TDT/4];
-	struct tx_desc *nxt = &tx_d[tail];
-	
-	if((nxt->status & TXD_STAT_DD) != TXD_STAT_DD)
-		return -1;	
-	if(len > TBUFFSIZE)
-		len = TBUFFSIZE;
-
-	memmove(&pbuf[tail], addr, len);
-	nxt->length = (uint16_t)len;
-	nxt->status &= !TXD_STAT_DD;
-	e1000[TDT/4] = (tail + 1) % TXRING_LEN;
+	uint32_t nfree, tail, len;
+	struct tx_desc *d;
+	struct tx_data_desc *dd;
+	uint8_t iphlen = 0, popts = 0, dcmd = 0;
+	bool newctx;
+	int i;
+
+	if (offload & (NETFRAG_CSUM_IP | NETFRAG_CSUM_TCP)) {
+		iphlen = NETFRAG_IPHLEN_OF(offload);
+		popts = (offload & NETFRAG_CSUM_IP ? TXD_POPTS_IXSM : 0)
+			| (offload & NETFRAG_CSUM_TCP ? TXD_POPTS_TXSM : 0);
+	}
+	if (offload & NETFRAG_TSO)
+		dcmd = TXD_CMD_TSE;
+	newctx = popts && (dcmd || iphlen != tx_ctx_iphlen);
+
+	if (bypass_env)
+		return -E_NOT_SUPP;
+	e1000_tx_reclaim();
+	nfree = (tx_clean + TXRING_LEN - tx_tail - 1) % TXRING_LEN;
+	if (nsegs + newctx > nfree)
+		return -E_NO_MEM;
+
+	tail = tx_tail;
+	if (newctx) {
+		for (len = 0, i = 0; i < nsegs; i++)
+			len += segs[i].len;
+		tx_load_ctx(tail, iphlen, offload, len - (ETH_HLEN + iphlen
+				+ NETFRAG_TCPHLEN_OF(offload)));
+		tail = (tail + 1) % TXRING_LEN;
+	}
+	for (i = 0; i < nsegs; i++) {
+		d = &tx_d[tail];
+		segs[i].pp->pp_ref++;
+		tx_page[tail] = segs[i].pp;
+		d->addr = page2pa(segs[i].pp) + segs[i].off;
+		d->length = segs[i].len;
+		d->cmd = TXD_CMD_RS | (i == nsegs - 1 ? TXD_CMD_EOP : 0);
+		d->status = 0;
+		d->cso = d->css = d->special = 0;
+		if (popts) {
+			dd = (struct tx_data_desc *) d;
+			dd->dtyp = TXD_DTYP_DATA;
+			dd->dcmd |= TXD_CMD_DEXT | dcmd;
+			dd->popts = popts;
+		}
+		tail = (tail + 1) % TXRING_LEN;
+	}
+	tx_owner[(tail + TXRING_LEN - 1) % TXRING_LEN] = owner;
+	if (popts)
+		stats.ntxcsum++;
+	if (dcmd)
+		stats.ntso++;
+
+	// Descriptors must be complete before the card sees the new tail
+	asm volatile("" : : : "memory");
+	tx_tail = tail;
+	e1000[TDT/4] = tail;
 	return 0;
 }
 
@@ -96,16 +270,418 @@ e1000_receive(void *addr, size_t buflen)
 	uint32_t tail = (e1000[RDT/4] + 1) % RXRING_LEN;
 	struct rx_desc *nxt = &rx_d[tail];
 
-	if((nxt->status & RXD_STAT_DD) != RXD_STAT_DD) {
+	if(bypass_env || (nxt->status & RXD_STAT_DD) != RXD_STAT_DD) {
 		// cprintf("head: %d\n", e1000[RDH/4]);
 		return -1;
 	}
 	if(nxt->length < buflen)
 		buflen = nxt->length;
 
-	memmove(addr, &prbuf[tail], buflen);
+	memmove(addr, (char *) page2kva(rx_page[tail]) + RXPKT_OFF, buflen);
+	stats.nrx++;
 	nxt->status &= !RXD_STAT_DD;
 	e1000[RDT/4] = tail;
 
 	return buflen;
 }
+
+//
+// Store a received frame's length and the NETRX_* checksums the card
+// verified for it at dst, in front of the frame.
+//
+static void
+rx_set_header(char *dst, const struct rx_desc *d)
+{
+	int32_t flags = e1000_rx_csum(d);
+
+	if (flags)
+		stats.nrxcsum++;
+	((int32_t *) dst)[0] = d->length;
+	((int32_t *) dst)[1] = flags;
+}
+
+//
+// Take the page holding the next received frame out of the ring,
+// putting a fresh zeroed page in its place, and store it in *pp.  The
+// frame starts RXPKT_OFF bytes into the page, after its length and
+// checksum flags.  The caller gets the ring's reference to the page.
+//
+// Returns the frame's length on success, < 0 on error.  Errors are:
+//	-E_NO_MEM if no frame is waiting (try again later), or there is
+//		no page to replace it with; the frame stays in the ring.
+//
+int
+e1000_receive_page(struct PageInfo **pp)
+{
+	uint32_t tail = (e1000[RDT/4] + 1) % RXRING_LEN;
+	struct rx_desc *nxt = &rx_d[tail];
+	struct PageInfo *fresh;
+	int len;
+
+	if(bypass_env || (nxt->status & RXD_STAT_DD) != RXD_STAT_DD)
+		return -E_NO_MEM;
+	if (!(fresh = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	fresh->pp_ref++;
+
+	len = nxt->length;
+	stats.nrx++;
+	*pp = rx_page[tail];
+	rx_set_header(page2kva(*pp), nxt);
+	// End the page of packets after this one (the page may have held
+	// a longer frame before)
+	*(int32_t *) (page2kva(*pp) + RXPKT_OFF + ROUNDUP(len, 4)) = 0;
+
+	rx_page[tail] = fresh;
+	nxt->addr = page2pa(fresh) + RXPKT_OFF;
+	nxt->status = 0;
+	e1000[RDT/4] = tail;
+	return len;
+}
+
+//
+// Take up to npages pages of received frames out of the ring and store
+// them in pages[], transferring a reference to each.  Frames longer
+// than RX_COPYBREAK get their ring page to themselves, as in
+// e1000_receive_page.  Shorter frames are copied, back to back, into a
+// fresh zeroed page, which saves a page per frame: the ring keeps its
+// page.  Either way a page holds struct jif_pkts aligned to 4 bytes,
+// ended by a zero length or the end of the page, in arrival order.
+//
+// Returns the number of pages stored, 0 if no frame is waiting.
+//
+int
+e1000_receive_batch(struct PageInfo **pages, int npages)
+{
+	struct PageInfo *pack = NULL;
+	size_t packoff = 0, need;
+	uint32_t tail;
+	struct rx_desc *nxt;
+	char *dst;
+	int n = 0;
+
+	if (bypass_env)
+		return 0;
+	for (;;) {
+		tail = (e1000[RDT/4] + 1) % RXRING_LEN;
+		nxt = &rx_d[tail];
+		if (!(nxt->status & RXD_STAT_DD))
+			break;
+
+		if (nxt->length > RX_COPYBREAK) {
+			if (n == npages || e1000_receive_page(&pages[n]) < 0)
+				break;
+			n++;
+			pack = NULL;	// later frames go after this one
+			continue;
+		}
+
+		need = RXPKT_OFF + ROUNDUP(nxt->length, 4);
+		if (!pack || packoff + need > PGSIZE) {
+			if (n == npages || !(pack = page_alloc(ALLOC_ZERO)))
+				break;
+			pack->pp_ref++;
+			pages[n++] = pack;
+			packoff = 0;
+		}
+		dst = (char *) page2kva(pack) + packoff;
+		rx_set_header(dst, nxt);
+		memmove(dst + RXPKT_OFF,
+			(char *) page2kva(rx_page[tail]) + RXPKT_OFF, nxt->length);
+		packoff += need;
+		stats.nrx++;
+		nxt->status = 0;
+		e1000[RDT/4] = tail;
+	}
+	return n;
+}
+
+static bool
+rx_ready(void)
+{
+	return !bypass_env
+		&& (rx_d[(e1000[RDT/4] + 1) % RXRING_LEN].status & RXD_STAT_DD);
+}
+
+// Room for a packet of any shape, and then some, so that a sender
+// that had to wait gets to queue several packets before waiting again
+static bool
+tx_ready(void)
+{
+	e1000_tx_reclaim();
+	return (tx_clean + TXRING_LEN - tx_tail - 1) % TXRING_LEN >= TXRING_LEN / 2;
+}
+
+//
+// Handle an interrupt from the card: wake the envs waiting in
+// sys_netpacket_wait for whatever it reports.  If an environment
+// drives the card, tell it instead, whatever the cause.
+//
+void
+e1000_intr(void)
+{
+	uint32_t icr;
+	struct NetBypass *info;
+
+	// Reading ICR acknowledges the causes and lowers the line.
+	icr = e1000[ICR/4];
+	irq_eoi();
+	stats.nintr++;
+
+	if (bypass_env) {
+		info = bypass_kva(NB_INFO);
+		info->nb_intr++;
+		futex_wake(bypass_pa(NB_INFO)
+			   + offsetof(struct NetBypass, nb_intr), NENV);
+		env_notify(bypass_env);
+		return;
+	}
+
+	if (icr & (ICR_RXT0 | ICR_RXO | ICR_RXDMT0))
+		futex_wake(PADDR(rx_d), NENV);
+	if ((icr & ICR_TXDW) && tx_ready())
+		futex_wake(PADDR(tx_d), NENV);
+}
+
+//
+// Return the futex key on which to wait for 'what' (NETWAIT_RX or
+// NETWAIT_TX), or 0 if it is ready now.  e1000_intr wakes the key.
+//
+physaddr_t
+e1000_wait_key(int what)
+{
+	if (what == NETWAIT_RX)
+		return rx_ready() ? 0 : PADDR(rx_d);
+	return tx_ready() ? 0 : PADDR(tx_d);
+}
+
+//
+// Have the card leave at least 'usec' microseconds between interrupts
+// (0 for no limit).  ITR counts in units of 256 ns.
+//
+void
+e1000_set_itr(unsigned usec)
+{
+	stats.itr_usec = usec;
+	e1000[ITR/4] = MIN(usec * 1000 / 256, 0xFFFF);
+}
+
+// Offset in the bypass mapping of bypass_page[i]
+static uint32_t
+bypass_off(int i)
+{
+	return i == 0 ? NB_INFO : NB_TXRING + (i - 1) * PGSIZE;
+}
+
+static void
+bypass_free(void)
+{
+	int i;
+
+	for (i = 0; i < BYPASS_NPAGES; i++)
+		if (bypass_page[i]) {
+			page_decref(bypass_page[i]);
+			bypass_page[i] = NULL;
+		}
+}
+
+// Drop the packets in the kernel's transmit ring, releasing their
+// pages and crediting them to their senders as if they had gone out.
+static void
+tx_drop(void)
+{
+	struct Env *e;
+
+	for (; tx_clean != tx_tail; tx_clean = (tx_clean + 1) % TXRING_LEN) {
+		if (!tx_page[tx_clean])
+			continue;
+		page_decref(tx_page[tx_clean]);
+		tx_page[tx_clean] = NULL;
+		if ((tx_d[tx_clean].cmd & TXD_CMD_EOP)
+		    && envid2env(tx_owner[tx_clean], &e, 0) == 0)
+			e->env_tx_done++;
+	}
+	memset(tx_d, 0, sizeof(tx_d));
+	tx_clean = tx_tail = 0;
+	tx_ctx_iphlen = 0;
+}
+
+//
+// Hand the card to environment e, which then drives it from user space
+// through the rings, buffers and registers mapped at 'va' as laid out
+// in inc/e1000.h.  Frames the kernel had received but not yet handed
+// out, and packets it had not yet sent, are dropped.  From then on
+// e1000_transmit fails, nothing is received for other environments,
+// and interrupts only go to e (see e1000_intr), until it exits.
+//
+// Whatever e can write, the card could be made to DMA anywhere: the
+// base address registers and the address in each descriptor.  So the
+// registers and both rings are mapped read-only, and only the kernel
+// fills in descriptors, from the ones e queues (see e1000_bypass_push).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NOT_SUPP if there is no card, or an environment already has it.
+//	-E_NO_MEM if there is no memory for the rings, buffers or page
+//		tables.
+//
+int
+e1000_bypass(struct Env *e, uintptr_t va)
+{
+	struct rx_desc *rd;
+	pte_t *pte;
+	uint32_t off;
+	int i, r;
+
+	if (!e1000 || bypass_env)
+		return -E_NOT_SUPP;
+
+	for (i = 0; i < BYPASS_NPAGES; i++) {
+		if (!(bypass_page[i] = page_alloc(ALLOC_ZERO))) {
+			r = -E_NO_MEM;
+			goto fail;
+		}
+		bypass_page[i]->pp_ref++;
+		if ((r = page_insert(e->env_pgdir, bypass_page[i],
+				     (void *) (va + bypass_off(i)),
+				     PTE_P | PTE_U
+				     | (bypass_off(i) >= NB_TXQUEUE ? PTE_W : 0))) < 0)
+			goto fail;
+	}
+	// The registers are device memory: map them uncached, and without
+	// a struct PageInfo (see page_lookup).  Not writable: with TDBAL
+	// and RDBAL, e could point the rings anywhere.
+	for (off = 0; off < NB_REGSIZE; off += PGSIZE) {
+		page_remove(e->env_pgdir, (void *) (va + NB_REGS + off));
+		if (!(pte = pgdir_walk(e->env_pgdir,
+				       (void *) (va + NB_REGS + off), 1))) {
+			r = -E_NO_MEM;
+			goto fail;
+		}
+		*pte = (e1000_pa + off) | PTE_PCD | PTE_PWT | PTE_P | PTE_U;
+	}
+
+	rd = bypass_kva(NB_RXRING);
+	for (i = 0; i < RXRING_LEN; i++)
+		rd[i].addr = bypass_pa(NB_RXBUF + i * RBUFFSIZE);
+
+	e1000[TCTL/4] &= ~TCTL_EN;
+	e1000[RCTL/4] &= ~RCTL_EN;
+	tx_drop();
+	rings_load(bypass_pa(NB_TXRING), bypass_pa(NB_RXRING));
+	bypass_env = e;
+	bypass_va = va;
+	e1000[TCTL/4] |= TCTL_EN;
+	e1000[RCTL/4] |= RCTL_EN;
+	return 0;
+
+fail:
+	for (off = 0; off < NB_SIZE; off += PGSIZE)
+		page_remove(e->env_pgdir, (void *) (va + off));
+	bypass_free();
+	return r;
+}
+
+// Copy transmit descriptor i from the bypass queue into the ring, if it
+// is safe to give the card: a context descriptor holds no address and
+// goes as it is, and a data descriptor is pointed at transmit buffer i,
+// which its data must fit in.
+static int
+bypass_tx_copy(uint32_t i)
+{
+	struct tx_desc d = ((struct tx_desc *) bypass_kva(NB_TXQUEUE))[i];
+	struct tx_data_desc *dd = (struct tx_data_desc *) &d;
+
+	if (!(d.cmd & TXD_CMD_DEXT) || (dd->dtyp & 0xF0) != TXD_DTYP_CTX) {
+		// A data descriptor's dtyp also holds bits 16-19 of its
+		// length
+		if ((d.cmd & TXD_CMD_DEXT) && dd->dtyp != TXD_DTYP_DATA)
+			return -E_INVAL;
+		if (d.length > TBUFFSIZE)
+			return -E_INVAL;
+		d.addr = bypass_pa(NB_TXBUF + i * TBUFFSIZE);
+	}
+	((struct tx_desc *) bypass_kva(NB_TXRING))[i] = d;
+	return 0;
+}
+
+//
+// For environment e, which drives the card (see e1000_bypass): give
+// the card the transmit descriptors from its current TDT up to 'tdt',
+// copied from those e queued at NB_TXQUEUE, and the receive
+// descriptors from its current RDT up to 'rdt', with their status
+// cleared.  Either may be left where it is.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if e does not drive the card.
+//	-E_INVAL if tdt or rdt is not a ring index, or a queued
+//		descriptor is of an unknown type or longer than its
+//		buffer.  The transmit descriptors before that one are
+//		still given to the card.
+//
+int
+e1000_bypass_push(struct Env *e, uint32_t tdt, uint32_t rdt)
+{
+	struct rx_desc *rd = bypass_kva(NB_RXRING);
+	uint32_t i;
+	int r = 0;
+
+	if (!bypass_env || bypass_env != e)
+		return -E_BAD_ENV;
+	if (tdt >= TXRING_LEN || rdt >= RXRING_LEN)
+		return -E_INVAL;
+
+	for (i = e1000[RDT/4]; i != rdt; i = (i + 1) % RXRING_LEN)
+		rd[i].status = 0;
+	for (i = e1000[TDT/4]; i != tdt; i = (i + 1) % TXRING_LEN)
+		if ((r = bypass_tx_copy(i)) < 0)
+			break;
+
+	// Descriptors must be complete before the card sees the new tails.
+	asm volatile("" : : : "memory");
+	e1000[RDT/4] = rdt;
+	e1000[TDT/4] = i;
+	return r;
+}
+
+//
+// Take the card back from environment e, if e drives it: called as e
+// is freed.  The kernel's rings start again from empty.
+//
+void
+e1000_bypass_release(struct Env *e)
+{
+	int i;
+
+	if (!bypass_env || bypass_env != e)
+		return;
+	e1000[TCTL/4] &= ~TCTL_EN;
+	e1000[RCTL/4] &= ~RCTL_EN;
+	bypass_env = NULL;
+	bypass_free();
+
+	for (i = 0; i < RXRING_LEN; i++)
+		rx_d[i].status = 0;
+	rings_load(PADDR(tx_d), PADDR(rx_d));
+	e1000[TCTL/4] |= TCTL_EN;
+	e1000[RCTL/4] |= RCTL_EN;
+}
+
+void
+e1000_print_stats(void)
+{
+	if (!e1000) {
+		cprintf("no e1000\n");
+		return;
+	}
+	cprintf("irq %d, itr %u us\n", e1000_irq, stats.itr_usec);
+	cprintf("interrupts %u, frames received %u, packets sent %u\n",
+		stats.nintr, stats.nrx, stats.ntx);
+	cprintf("checksums: %u packets offloaded, %u frames verified\n",
+		stats.ntxcsum, stats.nrxcsum);
+	cprintf("segmentation: %u packets\n", stats.ntso);
+	cprintf("tx ring: %u in flight\n",
+		(tx_tail + TXRING_LEN - tx_clean) % TXRING_LEN);
+	if (bypass_env)
+		cprintf("driven by env %08x at %08x\n",
+			bypass_env->env_id, bypass_va);
+}
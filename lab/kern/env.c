@@ -14,13 +14,27 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
-
-struct Env *envs = NULL;		// All environments
+#include <kern/kmalloc.h>
+#include <kern/timer.h>
+#include <kern/futex.h>
+#include <kern/trace.h>
+#include <kern/e1000.h>
+#include <kern/prof.h>
+
+struct Env *envs = (struct Env *) KENVS;	// All environments
+size_t nenvs;				// Entries of envs[] in use
+static size_t envs_npages;		// Pages of envs[] backed by memory
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
+// Pages of the demand-paging loader (lib/loader.c), mapped read-only at
+// ULOADER in every environment.  NULL entries are left unmapped.
+static struct PageInfo *loader_pages[ULOADERPAGES];
+
+static void loader_init(void);
+
 // Global descriptor table.
 //
 // Set up global descriptor table (GDT) with separate segments for
@@ -88,6 +102,10 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// to ensure that the envid is not stale
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
+	if (ENVX(envid) >= nenvs) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
 	e = &envs[ENVX(envid)];
 	if (e->env_status == ENV_FREE || e->env_id != envid) {
 		*env_store = 0;
@@ -108,27 +126,114 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
-// Mark all environments in 'envs' as free, set their env_ids to 0,
-// and insert them into the env_free_list.
-// Make sure the environments are in the free list in the same order
-// they are in the envs array (i.e., so that the first call to
-// env_alloc() returns envs[0]).
+// Start with an empty envs array; env_grow extends it as environments
+// are allocated.  The free list is kept in the same order as the envs
+// array (i.e., so that the first call to env_alloc() returns envs[0]).
 //
 void
 env_init(void)
 {
-	// Set up envs array
-	int i;
+	// The envs array must not run into the kernel stacks.
+	static_assert(KENVS + (NENV * sizeof(struct Env) + PGSIZE - 1) / PGSIZE * PGSIZE
+		      <= KSTACKTOP - NCPU * (KSTKSIZE + KSTKGAP));
+
 	env_free_list = NULL;
+	nenvs = 0;
+	envs_npages = 0;
 
-	for (i = NENV - 1; i >= 0; i--) {
-		envs[i].env_id = 0;
-		envs[i].env_status = ENV_FREE;
-		envs[i].env_link = env_free_list;
-		env_free_list = &envs[i];
-	}
 	// Per-CPU part of the initialization
 	env_init_percpu();
+
+	loader_init();
+}
+
+//
+// Back the next page of the envs array with memory, both at KENVS and
+// at UENVS, and put the environments that now fit on the free list.
+// Only called when the free list is empty.
+//
+// Returns 0 on success, < 0 on failure.  Errors include:
+//	-E_NO_FREE_ENV if the envs array already holds NENV environments
+//	-E_NO_MEM on memory exhaustion
+//
+static int
+env_grow(void)
+{
+	struct PageInfo *pp;
+	uintptr_t off;
+	size_t i, n;
+
+	if (nenvs == NENV)
+		return -E_NO_FREE_ENV;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+
+	// mem_init made the page tables for both ranges, so these
+	// cannot fail.  At UENVS the new page replaces the zero page.
+	off = envs_npages * PGSIZE;
+	if (page_insert(kern_pgdir, pp, (void *) (KENVS + off), PTE_W) < 0
+	    || page_insert(kern_pgdir, pp, (void *) (UENVS + off), PTE_U) < 0)
+		panic("env_grow: no page table for envs");
+	// Every address space shares kern_pgdir's page table for UENVS,
+	// so only stale TLB entries can still show the zero page.  Flush
+	// ours; other CPUs drop theirs when env_run next loads %cr3.
+	invlpg((void *) (UENVS + off));
+	envs_npages++;
+
+	// Environments stored entirely within the mapped pages are usable.
+	n = MIN(NENV, envs_npages * PGSIZE / sizeof(struct Env));
+	for (i = n; i > nenvs; i--) {
+		envs[i - 1].env_link = env_free_list;
+		env_free_list = &envs[i - 1];
+	}
+	nenvs = n;
+	return 0;
+}
+
+//
+// Copy the demand-paging loader out of the kernel image into
+// loader_pages, which env_setup_vm maps into every environment.
+// The loader must fit below ULOADER + ULOADERPAGES*PGSIZE and must
+// not have writable segments, since all environments share its pages.
+//
+static void
+loader_init(void)
+{
+	extern uint8_t _binary_obj_lib_loader_start[];
+	struct Elf *elf = (struct Elf *) _binary_obj_lib_loader_start;
+	struct Proghdr *ph, *eph;
+	struct PageInfo *pp;
+	uintptr_t va, end, n;
+
+	if (elf->e_magic != ELF_MAGIC)
+		panic("loader_init: loader is not an ELF file");
+
+	ph = (struct Proghdr *) ((uint8_t *) elf + elf->e_phoff);
+	eph = ph + elf->e_phnum;
+	for (; ph < eph; ph++) {
+		if (ph->p_type != ELF_PROG_LOAD || ph->p_memsz == 0)
+			continue;
+		if ((ph->p_flags & ELF_PROG_FLAG_WRITE)
+		    || ph->p_va < ULOADER || ph->p_memsz < ph->p_filesz
+		    || ph->p_va + ph->p_memsz > ULOADER + ULOADERPAGES*PGSIZE)
+			panic("loader_init: bad loader segment at %08x", ph->p_va);
+
+		end = ph->p_va + ph->p_filesz;
+		for (va = ROUNDDOWN(ph->p_va, PGSIZE); va < ph->p_va + ph->p_memsz; va += PGSIZE) {
+			pp = loader_pages[(va - ULOADER) / PGSIZE];
+			if (!pp) {
+				if (!(pp = page_alloc(ALLOC_ZERO)))
+					panic("loader_init: out of memory");
+				pp->pp_ref++;
+				loader_pages[(va - ULOADER) / PGSIZE] = pp;
+			}
+			n = MIN(va + PGSIZE, end);
+			if (n > MAX(va, ph->p_va))
+				memmove(page2kva(pp) + PGOFF(MAX(va, ph->p_va)),
+					(uint8_t *) elf + ph->p_offset + (MAX(va, ph->p_va) - ph->p_va),
+					n - MAX(va, ph->p_va));
+		}
+	}
 }
 
 // Load GDT and segment descriptors.
@@ -202,6 +307,17 @@ env_setup_vm(struct Env *e)
 	// Permissions: kernel R, user R
 	e->env_pgdir[PDX(UVPT)] = PADDR(e->env_pgdir) | PTE_P | PTE_U;
 
+	// Map the demand-paging loader read-only.  All of it is in one
+	// page table, so once that exists page_insert cannot fail.
+	if (!pgdir_walk(e->env_pgdir, (void *) ULOADER, 1)) {
+		page_decref(p);
+		return -E_NO_MEM;
+	}
+	for (i = 0; i < ULOADERPAGES; i++)
+		if (loader_pages[i])
+			page_insert(e->env_pgdir, loader_pages[i],
+				    (void *) (ULOADER + i*PGSIZE), PTE_P | PTE_U);
+
 	return 0;
 }
 
@@ -220,8 +336,9 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
-		return -E_NO_FREE_ENV;
+	if (!env_free_list && (r = env_grow()) < 0)
+		return r;
+	e = env_free_list;
 
 	// Allocate and set up the page directory for this environment.
 	if ((r = env_setup_vm(e)) < 0)
@@ -238,6 +355,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_type = ENV_TYPE_USER;
 	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_syscalls = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -268,9 +386,15 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_notify_pending = 0;
 
 	// Set normal priority 
 	e->env_priority = ENV_PRIOR_NORMAL;
+	e->env_cycles = 0;
+	e->env_vruntime = 0;
+	e->env_affinity = ~0;
+	e->env_migrations = 0;
+	e->env_tx_done = 0;
 	// commit the allocation
 	env_free_list = e->env_link;
 	*newenv_store = e;
@@ -417,6 +541,35 @@ env_create(uint8_t *binary, enum EnvType type)
 	// LAB 5: Your code here.
 	if (type == ENV_TYPE_FS)
 		e->env_tf.tf_eflags |= FL_IOPL_MASK;
+
+	// With CPUs to spare, keep the file and network servers each on
+	// a CPU of its own, so their caches stay warm.  Other
+	// environments may still run there.
+	if (type == ENV_TYPE_FS && ncpu >= 3)
+		e->env_affinity = 1 << (ncpu - 1);
+	if (type == ENV_TYPE_NS && ncpu >= 3)
+		e->env_affinity = 1 << (ncpu - 2);
+}
+
+//
+// Tell env e that something happened, as e1000_intr does for the env
+// driving the card and sys_env_notify for others: if e is blocked in
+// sys_ipc_recv, that returns -E_INTR; otherwise its next sys_ipc_recv
+// returns -E_INTR at once.
+//
+void
+env_notify(struct Env *e)
+{
+	if (e->env_status != ENV_NOT_RUNNABLE || !e->env_ipc_recving) {
+		e->env_notify_pending = true;
+		return;
+	}
+	if (e->env_timer)
+		timer_del(e->env_timer);
+	e->env_ipc_recving = false;
+	e->env_tf.tf_regs.reg_eax = -E_INTR;
+	e->env_status = ENV_RUNNABLE;
+	sched_wakeup(e);
 }
 
 //
@@ -428,6 +581,7 @@ env_free(struct Env *e)
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
+	struct PageInfo *pp;
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
@@ -435,6 +589,10 @@ env_free(struct Env *e)
 	if (e == curenv)
 		lcr3(PADDR(kern_pgdir));
 
+	// Take back the network card if e was driving it, before its
+	// pages go
+	e1000_bypass_release(e);
+
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
@@ -466,10 +624,21 @@ env_free(struct Env *e)
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
-	// return the environment to the free list
+	// cancel any sleep, IPC or futex timeout
+	if (e->env_timer) {
+		timer_del(e->env_timer);
+		kfree(e->env_timer);
+		e->env_timer = NULL;
+	}
+	futex_dequeue(e);
+
+	// return the environment to the free list, and wake anyone
+	// waiting for it to exit (see wait() in lib/wait.c)
 	e->env_status = ENV_FREE;
 	e->env_link = env_free_list;
 	env_free_list = e;
+	if ((pp = page_lookup(kern_pgdir, &e->env_status, NULL)))
+		futex_wake(page2pa(pp) + PGOFF(&e->env_status), NENV);
 }
 
 //
@@ -546,14 +715,25 @@ env_run(struct Env *e)
 	//	e->env_tf.  Go back through the code you wrote above
 	//	and make sure you have set the relevant parts of
 	//	e->env_tf to sensible values.
-	if (curenv != NULL && curenv->env_status == ENV_RUNNING)
+	sched_account();
+	trace(TRACE_ENV_RUN, e->env_id, curenv ? curenv->env_id : 0);
+	if (curenv != NULL && curenv->env_status == ENV_RUNNING) {
 		curenv->env_status = ENV_RUNNABLE;
+		// Idle CPUs no longer poll on timer ticks, so tell one
+		// that the environment we are switching away from could
+		// run there.
+		if (curenv != e)
+			sched_wakeup(curenv);
+	}
 
+	if (e->env_runs > 0 && e->env_cpunum != cpunum())
+		e->env_migrations++;
 	curenv = e;
 	curenv->env_status = ENV_RUNNING;
 	curenv->env_runs++;
 	lcr3(PADDR(curenv->env_pgdir));
 	
+	prof_release();
 	unlock_kernel();
 	env_pop_tf(&curenv->env_tf);
 	
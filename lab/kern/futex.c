@@ -0,0 +1,77 @@
+// Futex wait queues.
+//
+// An environment blocked in sys_futex_wait sits on a queue keyed by the
+// physical address of the word it is waiting on.  Keying on the
+// physical address rather than the virtual one lets environments that
+// share a page (PTE_SHARE pages, or the read-only envs array) wait and
+// wake on the same word, wherever each of them has it mapped.
+//
+// All of this runs under the big kernel lock.
+
+#include <inc/assert.h>
+
+#include <kern/futex.h>
+#include <kern/sched.h>
+#include <kern/timer.h>
+
+#define FUTEX_HASHSIZE	64
+
+static struct Env *futex_queues[FUTEX_HASHSIZE];
+
+static struct Env **
+futex_bucket(physaddr_t key)
+{
+	return &futex_queues[(key >> 2) % FUTEX_HASHSIZE];
+}
+
+// Put e, which the caller is about to block, on the queue for 'key'.
+void
+futex_enqueue(struct Env *e, physaddr_t key)
+{
+	struct Env **b = futex_bucket(key);
+
+	assert(!e->env_futex_pprev);
+	e->env_futex_key = key;
+	e->env_futex_next = *b;
+	if (*b)
+		(*b)->env_futex_pprev = &e->env_futex_next;
+	e->env_futex_pprev = b;
+	*b = e;
+}
+
+// Take e off its futex queue.  Returns whether it was on one.
+bool
+futex_dequeue(struct Env *e)
+{
+	if (!e->env_futex_pprev)
+		return false;
+	if (e->env_futex_next)
+		e->env_futex_next->env_futex_pprev = e->env_futex_pprev;
+	*e->env_futex_pprev = e->env_futex_next;
+	e->env_futex_next = NULL;
+	e->env_futex_pprev = NULL;
+	return true;
+}
+
+// Wake up to n environments waiting on 'key'; their sys_futex_wait
+// returns 0.  Returns the number woken.
+int
+futex_wake(physaddr_t key, int n)
+{
+	struct Env *e, *next;
+	int woken = 0;
+
+	for (e = *futex_bucket(key); e && woken < n; e = next) {
+		next = e->env_futex_next;
+		if (e->env_futex_key != key)
+			continue;
+		futex_dequeue(e);
+		if (e->env_timer)
+			timer_del(e->env_timer);
+		e->env_tf.tf_regs.reg_eax = 0;
+		e->env_status = ENV_RUNNABLE;
+		sched_wakeup(e);
+		woken++;
+	}
+	return woken;
+}
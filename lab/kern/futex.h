@@ -0,0 +1,14 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+void	futex_enqueue(struct Env *e, physaddr_t key);
+bool	futex_dequeue(struct Env *e);
+int	futex_wake(physaddr_t key, int n);
+
+#endif	// !JOS_KERN_FUTEX_H
@@ -7,6 +7,7 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
@@ -16,6 +17,8 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/pci.h>
+#include <kern/prof.h>
+#include <kern/trace.h>
 
 static void boot_aps(void);
 
@@ -38,20 +41,32 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kmem_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
 	trap_init();
 
+	// The clock, which lapic_init needs to calibrate the LAPIC timer
+	time_init();
+
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
 	lapic_init();
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
+	sched_init();
+#if defined(PROF)
+	// Profile from boot: make INIT_CFLAGS=-DPROF=<callers per sample>
+	prof_start(PROF);
+#endif
+#if defined(TRACE)
+	// Trace from boot: make INIT_CFLAGS=-DTRACE=<mask of TRACE_* bits>
+	trace_mask = TRACE;
+#endif
 
 	// Lab 6 hardware initialization functions
-	time_init();
 	pci_init();
 
 	// Acquire the big kernel lock before waking up APs
@@ -0,0 +1,322 @@
+// Kernel object allocator.
+//
+// A KmemCache hands out objects of one size.  Objects are carved out of
+// one-page slabs taken from page_alloc; each slab starts with a struct
+// Slab header, so kmem_cache_free and kfree find an object's slab by
+// rounding its address down to a page boundary.
+//
+// In front of the slabs, every CPU keeps up to KMEM_CPUCACHE objects
+// per cache.  Most allocations and frees only touch that per-CPU array
+// and take no lock; the cache's lock is taken to move objects between
+// it and the slabs in batches of KMEM_CPUCACHE/2.
+//
+// kmalloc serves sizes up to KMALLOC_MAX from power-of-two caches.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/error.h>
+
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+
+struct Slab {
+	struct KmemCache *s_cache;	// Cache this slab belongs to
+	struct Slab *s_next;		// Links in the cache's partial list
+	struct Slab *s_prev;
+	void *s_free;			// Free objects, linked by first word
+	int s_inuse;			// Objects handed out
+};
+
+#define SLAB_HDRSIZE	ROUNDUP(sizeof(struct Slab), 16)
+
+// Caches are few and live forever, so keep them in a static array
+#define KMEM_MAXCACHES	32
+
+static struct KmemCache caches[KMEM_MAXCACHES];
+static int ncaches;
+static struct spinlock caches_lock;
+
+// kmalloc's caches, for sizes KMALLOC_MIN, 2*KMALLOC_MIN, ..., KMALLOC_MAX
+#define KMALLOC_MIN	16
+#define KMALLOC_NSIZES	8
+static struct KmemCache *kmalloc_caches[KMALLOC_NSIZES];
+
+static void check_kmalloc(void);
+
+void
+kmem_init(void)
+{
+	static const char *names[KMALLOC_NSIZES] = {
+		"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+		"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+	};
+	int i;
+
+	static_assert(KMALLOC_MIN << (KMALLOC_NSIZES - 1) == KMALLOC_MAX);
+
+	spin_initlock(&caches_lock);
+	for (i = 0; i < KMALLOC_NSIZES; i++)
+		if (!(kmalloc_caches[i] = kmem_cache_create(names[i], KMALLOC_MIN << i)))
+			panic("kmem_init: out of caches");
+
+	check_kmalloc();
+}
+
+//
+// Create a cache of objects of 'size' bytes.
+// Returns NULL if there are too many caches or 'size' does not fit in
+// a slab.
+//
+struct KmemCache *
+kmem_cache_create(const char *name, size_t size)
+{
+	struct KmemCache *c;
+
+	size = ROUNDUP(MAX(size, sizeof(void *)), 8);
+	if (size > PGSIZE - SLAB_HDRSIZE)
+		return NULL;
+
+	spin_lock(&caches_lock);
+	if (ncaches == KMEM_MAXCACHES) {
+		spin_unlock(&caches_lock);
+		return NULL;
+	}
+	c = &caches[ncaches++];
+	spin_unlock(&caches_lock);
+
+	memset(c, 0, sizeof(*c));
+	c->km_name = name;
+	c->km_size = size;
+	c->km_perslab = (PGSIZE - SLAB_HDRSIZE) / size;
+	__spin_initlock(&c->km_lock, (char *) name);
+	return c;
+}
+
+static void
+slab_unlink(struct KmemCache *c, struct Slab *s)
+{
+	if (s->s_prev)
+		s->s_prev->s_next = s->s_next;
+	else
+		c->km_partial = s->s_next;
+	if (s->s_next)
+		s->s_next->s_prev = s->s_prev;
+	s->s_next = s->s_prev = NULL;
+}
+
+static void
+slab_push(struct KmemCache *c, struct Slab *s)
+{
+	s->s_prev = NULL;
+	s->s_next = c->km_partial;
+	if (c->km_partial)
+		c->km_partial->s_prev = s;
+	c->km_partial = s;
+}
+
+// Allocate a new slab for c and put it on the partial list.
+// Called with c->km_lock held.
+static int
+slab_grow(struct KmemCache *c)
+{
+	struct PageInfo *pp;
+	struct Slab *s;
+	char *obj;
+	int i;
+
+	if (!(pp = page_alloc(0)))
+		return -E_NO_MEM;
+	pp->pp_ref++;
+
+	s = page2kva(pp);
+	s->s_cache = c;
+	s->s_inuse = 0;
+	s->s_free = NULL;
+	for (i = c->km_perslab - 1; i >= 0; i--) {
+		obj = (char *) s + SLAB_HDRSIZE + i * c->km_size;
+		*(void **) obj = s->s_free;
+		s->s_free = obj;
+	}
+	slab_push(c, s);
+	c->km_nslabs++;
+	return 0;
+}
+
+// Take an object from c's slabs.  Called with c->km_lock held.
+static void *
+slab_alloc(struct KmemCache *c)
+{
+	struct Slab *s;
+	void *obj;
+
+	if (!c->km_partial && slab_grow(c) < 0)
+		return NULL;
+	s = c->km_partial;
+	obj = s->s_free;
+	s->s_free = *(void **) obj;
+	s->s_inuse++;
+	if (!s->s_free)
+		slab_unlink(c, s);
+	c->km_inuse++;
+	return obj;
+}
+
+// Return an object to its slab, freeing the slab if it becomes empty.
+// Called with c->km_lock held.
+static void
+slab_free(struct KmemCache *c, void *obj)
+{
+	struct Slab *s = ROUNDDOWN(obj, PGSIZE);
+
+	assert(s->s_cache == c && s->s_inuse > 0);
+	if (!s->s_free)
+		slab_push(c, s);
+	*(void **) obj = s->s_free;
+	s->s_free = obj;
+	s->s_inuse--;
+	c->km_inuse--;
+	if (s->s_inuse == 0) {
+		slab_unlink(c, s);
+		page_decref(pa2page(PADDR(s)));
+		c->km_nslabs--;
+	}
+}
+
+//
+// Allocate an object from cache c.
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct KmemCache *c)
+{
+	struct KmemCpuCache *cc = &c->km_cpu[cpunum()];
+	void *obj;
+
+	if (cc->kc_n == 0) {
+		// Refill half of this CPU's cache in one go.
+		spin_lock(&c->km_lock);
+		while (cc->kc_n < KMEM_CPUCACHE / 2
+		       && (obj = slab_alloc(c)))
+			cc->kc_objs[cc->kc_n++] = obj;
+		spin_unlock(&c->km_lock);
+		if (cc->kc_n == 0)
+			return NULL;
+	}
+	return cc->kc_objs[--cc->kc_n];
+}
+
+//
+// Return an object allocated from cache c.
+//
+void
+kmem_cache_free(struct KmemCache *c, void *obj)
+{
+	struct KmemCpuCache *cc = &c->km_cpu[cpunum()];
+
+	if (!obj)
+		return;
+	if (cc->kc_n == KMEM_CPUCACHE) {
+		// Give the older half back to the slabs.
+		spin_lock(&c->km_lock);
+		while (cc->kc_n > KMEM_CPUCACHE / 2)
+			slab_free(c, cc->kc_objs[--cc->kc_n]);
+		spin_unlock(&c->km_lock);
+	}
+	cc->kc_objs[cc->kc_n++] = obj;
+}
+
+//
+// Allocate 'size' bytes of kernel memory.
+// Returns NULL if out of memory or size > KMALLOC_MAX.
+//
+void *
+kmalloc(size_t size)
+{
+	int i;
+
+	for (i = 0; i < KMALLOC_NSIZES; i++)
+		if (size <= (KMALLOC_MIN << i))
+			return kmem_cache_alloc(kmalloc_caches[i]);
+	return NULL;
+}
+
+//
+// Like kmalloc, but zero the memory.
+//
+void *
+kzalloc(size_t size)
+{
+	void *p;
+
+	if ((p = kmalloc(size)))
+		memset(p, 0, size);
+	return p;
+}
+
+//
+// Free memory from kmalloc or kzalloc.
+//
+void
+kfree(void *p)
+{
+	struct Slab *s;
+
+	if (!p)
+		return;
+	s = ROUNDDOWN(p, PGSIZE);
+	kmem_cache_free(s->s_cache, p);
+}
+
+//
+// Print how much memory each cache is using.
+//
+void
+kmem_print_stats(void)
+{
+	struct KmemCache *c;
+	int i, j, cached;
+
+	cprintf("%-14s %6s %6s %6s %6s\n", "cache", "size", "slabs", "inuse", "cpu");
+	for (i = 0; i < ncaches; i++) {
+		c = &caches[i];
+		for (cached = 0, j = 0; j < NCPU; j++)
+			cached += c->km_cpu[j].kc_n;
+		cprintf("%-14s %6d %6d %6d %6d\n", c->km_name, c->km_size,
+			c->km_nslabs, c->km_inuse - cached, cached);
+	}
+}
+
+static void
+check_kmalloc(void)
+{
+#define NCHECK	(3 * KMEM_CPUCACHE)
+	void *p[NCHECK];
+	struct KmemCache *c = kmalloc_caches[0];
+	uint32_t nslabs = c->km_nslabs;
+	int i, j;
+
+	// Objects are distinct, aligned, and from the right cache
+	for (i = 0; i < NCHECK; i++) {
+		assert((p[i] = kmalloc(KMALLOC_MIN)));
+		assert((uintptr_t) p[i] % 8 == 0);
+		assert(((struct Slab *) ROUNDDOWN(p[i], PGSIZE))->s_cache == c);
+		memset(p[i], i, KMALLOC_MIN);
+		for (j = 0; j < i; j++)
+			assert(p[i] != p[j]);
+	}
+	for (i = 0; i < NCHECK; i++)
+		assert(*(uint8_t *) p[i] == (uint8_t) i);
+	for (i = 0; i < NCHECK; i++)
+		kfree(p[i]);
+	// Everything beyond the per-CPU cache went back to the slabs
+	assert(c->km_inuse <= KMEM_CPUCACHE);
+	assert(c->km_nslabs <= nslabs + 1);
+
+	// Size classes
+	assert((p[0] = kzalloc(KMALLOC_MAX)) && *(uint32_t *) p[0] == 0);
+	assert(((struct Slab *) ROUNDDOWN(p[0], PGSIZE))->s_cache->km_size == KMALLOC_MAX);
+	kfree(p[0]);
+	assert(!kmalloc(KMALLOC_MAX + 1));
+
+	cprintf("check_kmalloc() succeeded!\n");
+}
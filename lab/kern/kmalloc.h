@@ -0,0 +1,50 @@
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Objects each CPU keeps on hand per cache before going to the slabs
+#define KMEM_CPUCACHE	16
+
+// Largest size kmalloc can allocate
+#define KMALLOC_MAX	2048
+
+struct Slab;
+
+// Objects a CPU has freed or pre-allocated for a cache.  Only touched
+// by its own CPU, which runs the kernel with interrupts disabled.
+struct KmemCpuCache {
+	int kc_n;
+	void *kc_objs[KMEM_CPUCACHE];
+};
+
+// A cache of equal-sized kernel objects, carved out of one-page slabs.
+struct KmemCache {
+	const char *km_name;
+	size_t km_size;			// Object size, rounded up for alignment
+	int km_perslab;			// Objects per slab
+	struct spinlock km_lock;	// Protects the fields below
+	struct Slab *km_partial;	// Slabs with free objects
+	uint32_t km_nslabs;		// Slabs allocated
+	uint32_t km_inuse;		// Objects taken from the slabs, including
+					// those sitting in CPU caches
+	struct KmemCpuCache km_cpu[NCPU];
+};
+
+void	kmem_init(void);
+struct KmemCache *kmem_cache_create(const char *name, size_t size);
+void	*kmem_cache_alloc(struct KmemCache *c);
+void	kmem_cache_free(struct KmemCache *c, void *obj);
+
+void	*kmalloc(size_t size);
+void	*kzalloc(size_t size);
+void	kfree(void *p);
+
+void	kmem_print_stats(void);
+
+#endif	// !JOS_KERN_KMALLOC_H
@@ -9,6 +9,7 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/time.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -45,6 +46,11 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// Timer ticks per millisecond, measured by lapic_timer_calibrate()
+static uint32_t lapic_timer_khz;
+
+static void lapic_timer_calibrate(void);
+
 static void
 lapicw(int index, int value)
 {
@@ -65,13 +71,15 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  It stays stopped until the
+	// scheduler sets a deadline with lapic_timer_oneshot(); see
+	// lapic_timer_calibrate() for the rate.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	if (thiscpu == bootcpu)
+		lapic_timer_calibrate();
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, 0);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -111,6 +119,47 @@ lapic_init(void)
 	lapicw(TPR, 0);
 }
 
+// Measure the timer's rate against the TSC clock (see kern/time.c).
+// All CPUs share the bus clock, so the boot CPU does this for everyone.
+static void
+lapic_timer_calibrate(void)
+{
+	const uint64_t calibrate_ns = 10000000;
+	uint64_t start;
+
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0xffffffff);
+	start = time_nsec();
+	while (time_nsec() - start < calibrate_ns)
+		/* spin */;
+	lapic_timer_khz = (0xffffffff - lapic[TCCR]) / (calibrate_ns / 1000000);
+	lapicw(TICR, 0);
+	cprintf("lapic: timer runs at %u.%03u MHz\n",
+		lapic_timer_khz / 1000, lapic_timer_khz % 1000);
+}
+
+// Interrupt this CPU once, 'ns' nanoseconds from now, replacing any
+// earlier deadline.  ns == 0 stops the timer.
+void
+lapic_timer_oneshot(uint64_t ns)
+{
+	uint64_t count;
+
+	if (!lapic)
+		return;
+	if (ns == 0) {
+		lapicw(TICR, 0);
+		return;
+	}
+	// Divide first: ns * khz would overflow for deadlines of hours.
+	count = ns / 1000 * lapic_timer_khz / 1000;
+	if (count == 0)
+		count = 1;
+	if (count > 0xffffffff)
+		count = 0xffffffff;
+	lapicw(TICR, count);
+}
+
 int
 cpunum(void)
 {
@@ -173,6 +222,7 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// Send interrupt 'vector' to all other CPUs.
 void
 lapic_ipi(int vector)
 {
@@ -180,3 +230,13 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send interrupt 'vector' to the CPU with local APIC ID 'apicid'.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
@@ -12,6 +12,12 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/spinlock.h>
+#include <kern/sched.h>
+#include <kern/prof.h>
+#include <kern/trace.h>
+#include <kern/e1000.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 #define TESTERR(a) {if (a) goto ERR;}  //test showmapping argument 
@@ -30,7 +36,13 @@ static struct Command commands[] = {
 	{ "backtrace", "Display the backtrace of stacks", "backstrace", mon_backtrace },
 	{ "showmapping", "Display the physical page mappings of special virtual address", "showmapping [begin] [end]\nshow the physical page mappings of virtual address form begin to end", mon_showmapping },
 	{ "setpri", "Set the perimissions of any mapping in the current address space page", "setpri [address] [+-][pri]\np\\P:Present\nw\\W:Writeable\nu\\U:User\nt\\T:Write-Through\nc\\C:Cache-Disable\na\\A:Accessed\nd\\D:Dirty\ng\\G:Global", mon_setpri },
-	{ "dump", "Dump the contentss of a range of memory given either a virtual or physical address range", "dump -[pv] [begin] [end]\nBy default dump virtual address, use -p to present physical address, -v to present virtual address\n", mon_dump }
+	{ "dump", "Dump the contentss of a range of memory given either a virtual or physical address range", "dump -[pv] [begin] [end]\nBy default dump virtual address, use -p to present physical address, -v to present virtual address\n", mon_dump },
+	{ "kmem", "Display kernel object cache usage", "kmem", mon_kmem },
+	{ "sched", "Display CPU time per environment, or set the scheduling policy", "sched [fair|priority]", mon_sched },
+	{ "prof", "Display the sampling profile, or start or stop the profiler", "prof [on [depth]|off]\ndepth: callers to record per sample, up to 4", mon_prof },
+	{ "locks", "Display the most contended spinlocks", "locks", mon_locks },
+	{ "trace", "Record kernel events, or dump the ones recorded", "trace on [event...]|off|clear|dump [n]|raw\nevents: syscall sysret run send recv pgfault irq (default all)\ndump: the last n events, as text\nraw: all events, as hex struct TraceEvents (see kern/trace.h)", mon_trace },
+	{ "nic", "Display network card statistics, or set its interrupt rate", "nic [itr usec]\nitr: least time between interrupts, 0 for no limit", mon_nic }
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -277,6 +289,90 @@ ERR:
 	return 0;
 }
 
+int
+mon_kmem(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print_stats();
+	return 0;
+}
+
+int
+mon_sched(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 2 && strcmp(argv[1], "fair") == 0)
+		sched_set_policy(SCHED_FAIR);
+	else if (argc == 2 && strcmp(argv[1], "priority") == 0)
+		sched_set_policy(SCHED_PRIORITY);
+	else if (argc != 1) {
+		cprintf("Usage: sched [fair|priority]\n");
+		return 0;
+	}
+	sched_print_stats();
+	return 0;
+}
+
+int
+mon_nic(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 3 && strcmp(argv[1], "itr") == 0 && e1000)
+		e1000_set_itr(strtol(argv[2], NULL, 0));
+	else if (argc != 1) {
+		cprintf("Usage: nic [itr usec]\n");
+		return 0;
+	}
+	e1000_print_stats();
+	return 0;
+}
+
+int
+mon_prof(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc >= 2 && strcmp(argv[1], "on") == 0)
+		prof_start(argc >= 3 ? strtol(argv[2], NULL, 0) : 0);
+	else if (argc == 2 && strcmp(argv[1], "off") == 0)
+		prof_stop();
+	else if (argc != 1)
+		cprintf("Usage: prof [on [depth]|off]\n");
+	else
+		prof_print();
+	return 0;
+}
+
+int
+mon_locks(int argc, char **argv, struct Trapframe *tf)
+{
+	spin_print_stats();
+	return 0;
+}
+
+int
+mon_trace(int argc, char **argv, struct Trapframe *tf)
+{
+	uint32_t mask = 0;
+	int i, type;
+
+	if (argc >= 2 && strcmp(argv[1], "on") == 0) {
+		for (i = 2; i < argc; i++) {
+			if ((type = trace_parse(argv[i])) < 0) {
+				cprintf("Unknown event %s\n", argv[i]);
+				return 0;
+			}
+			mask |= 1 << type;
+		}
+		trace_mask = mask ? mask : (1 << NTRACE) - 1;
+	} else if (argc == 2 && strcmp(argv[1], "off") == 0)
+		trace_mask = 0;
+	else if (argc == 2 && strcmp(argv[1], "clear") == 0)
+		trace_clear();
+	else if (argc >= 2 && argc <= 3 && strcmp(argv[1], "dump") == 0)
+		trace_dump(argc == 3 ? strtol(argv[2], NULL, 0) : 0);
+	else if (argc == 2 && strcmp(argv[1], "raw") == 0)
+		trace_dump_raw();
+	else
+		cprintf("Usage: trace on [event...]|off|clear|dump [n]|raw\n");
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -120,7 +120,8 @@ void
 mem_init(void)
 {
 	uint32_t cr0;
-	size_t n;
+	size_t n, i;
+	struct PageInfo *pp;
 	pte_t *ppte;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
@@ -149,11 +150,6 @@ mem_init(void)
 	pages = (struct PageInfo*) boot_alloc(npages * sizeof(struct PageInfo));
 	memset(pages, 0, npages * sizeof(struct PageInfo));
 
-	//////////////////////////////////////////////////////////////////////
-	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
-	envs = (struct Env*) boot_alloc(NENV * sizeof(struct Env));
-	memset(envs, 0, NENV * sizeof(struct Env));
-
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
 	// up the list of free physical pages. Once we've done so, all further
@@ -178,12 +174,19 @@ mem_init(void)
 	boot_map_region(kern_pgdir, UPAGES, PTSIZE, PADDR(pages), PTE_U);
 
 	//////////////////////////////////////////////////////////////////////
-	// Map the 'envs' array read-only by the user at linear address UENVS
-	// (ie. perm = PTE_U | PTE_P).
+	// The 'envs' array lives at KENVS and is backed by memory a page at
+	// a time as environments are allocated (see env_grow).  Users see
+	// it read-only at linear address UENVS; until a page of it is in
+	// use, that part of UENVS shows a shared page of zeroes, which
+	// reads as free environments.
 	// Permissions:
 	//    - the new image at UENVS  -- kernel R, user R
 	//    - envs itself -- kernel RW, user NONE
-	boot_map_region(kern_pgdir, UENVS, PTSIZE, PADDR(envs), PTE_U);
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		panic("mem_init: out of memory");
+	for (i = 0; i < ROUNDUP(NENV * sizeof(struct Env), PGSIZE); i += PGSIZE)
+		if (page_insert(kern_pgdir, pp, (void *) (UENVS + i), PTE_U) < 0)
+			panic("mem_init: out of memory");
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -517,7 +520,9 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 // can be used to verify page permissions for syscall arguments,
 // but should not be used by most callers.
 //
-// Return NULL if there is no page mapped at va.
+// Return NULL if there is no page mapped at va.  Device memory mapped
+// into an environment (see e1000_bypass) has no struct PageInfo, so
+// this returns NULL for it too.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
@@ -530,7 +535,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 	entry = pgdir_walk(pgdir, va, 0);
 	if (entry == NULL)
 		return NULL;
-	if (!(*entry & PTE_P))
+	if (!(*entry & PTE_P) || PGNUM(PTE_ADDR(*entry)) >= npages)
 		return NULL;
 
 	ret = pa2page(PTE_ADDR(*entry));
@@ -561,10 +566,13 @@ page_remove(pde_t *pgdir, void *va)
 	pte_t *entry = NULL;
 	struct PageInfo *page = page_lookup(pgdir, va, &entry);
 
-	if (page == NULL)
-		return;
-
-	page_decref(page);
+	if (page == NULL) {
+		// Device memory has no page to release, just the mapping
+		entry = pgdir_walk(pgdir, va, 0);
+		if (entry == NULL || !(*entry & PTE_P))
+			return;
+	} else
+		page_decref(page);
 	tlb_invalidate(pgdir, va);
 	*entry = 0;
 }
@@ -577,8 +585,35 @@ void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
-		invlpg(va);
+	if (!curenv || curenv->env_pgdir == pgdir) {
+		if (thiscpu->cpu_tlb_defer)
+			thiscpu->cpu_tlb_stale = true;
+		else
+			invlpg(va);
+	}
+}
+
+//
+// Start collecting TLB invalidations on this CPU instead of issuing
+// one invlpg per page.  tlb_defer_end() then flushes the TLB once if
+// anything in the current address space was changed in between.
+// Used when many mappings are updated in a single system call.
+//
+void
+tlb_defer_begin(void)
+{
+	thiscpu->cpu_tlb_defer = true;
+	thiscpu->cpu_tlb_stale = false;
+}
+
+void
+tlb_defer_end(void)
+{
+	thiscpu->cpu_tlb_defer = false;
+	if (thiscpu->cpu_tlb_stale) {
+		thiscpu->cpu_tlb_stale = false;
+		lcr3(rcr3());
+	}
 }
 
 //
@@ -851,10 +886,13 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 
-	// check envs array (new test for lab 3)
+	// check envs array: nothing is in use yet, so all of UENVS shows
+	// the zero page and KENVS is unmapped
 	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
-	for (i = 0; i < n; i += PGSIZE)
-		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
+	for (i = 0; i < n; i += PGSIZE) {
+		assert(check_va2pa(pgdir, UENVS + i) == check_va2pa(pgdir, UENVS));
+		assert(check_va2pa(pgdir, KENVS + i) == ~0);
+	}
 
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
@@ -62,6 +62,8 @@ struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_defer_begin(void);
+void	tlb_defer_end(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
@@ -0,0 +1,283 @@
+// Sampling profiler.
+//
+// While the profiler is on, a CPU running an environment takes a timer
+// interrupt at least every PROF_INTERVAL_NS, and on every timer
+// interrupt trap() calls prof_tick.  That records the interrupted eip,
+// the environment, and optionally the first few callers found by
+// walking the %ebp chain, in a per-CPU ring that keeps the latest
+// PROF_NSAMPLES samples.
+//
+// The kernel runs with interrupts disabled, so timer interrupts only
+// land in user code or in the idle loop.  To see into the kernel, a
+// CPU taking a tick also asks the CPU holding the big kernel lock, if
+// there is one, for a sample.  That CPU records one in prof_release,
+// just before it lets go of the lock, with its call chain from there.
+// This says which kernel path the time went to but not where in it.
+// With a single CPU, time in the kernel does not show up at all.
+//
+// Interrupting the holder instead (with an NMI, say) is not safe: by
+// the time it arrives the holder may have released the lock and be in
+// env_pop_tf, with %esp pointing into the Env it is about to run.
+//
+// prof_print symbolizes the samples with debuginfo_eip and prints a
+// flat profile: for each function, the samples that landed in it
+// ("self") and those with it anywhere on the recorded call chain
+// ("total").
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+
+#include <kern/prof.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/trap.h>
+#include <kern/kdebug.h>
+#include <kern/spinlock.h>
+
+#define PROF_NSAMPLES	2048		// Samples kept per CPU
+#define PROF_NFUNCS	128		// Functions prof_print tells apart
+#define PROF_NSHOW	30		// Functions prof_print lists
+
+struct ProfSample {
+	envid_t ps_env;			// Environment on the CPU, or 0
+	uintptr_t ps_pc[PROF_MAXDEPTH + 1];	// eip, then callers
+};
+
+struct ProfCpu {
+	uint32_t pc_n;			// Samples taken since prof_start
+	volatile bool pc_want;		// Sample wanted at prof_release
+	struct ProfSample pc_samples[PROF_NSAMPLES];
+};
+
+// One line of prof_print's output
+struct ProfFunc {
+	uintptr_t pf_addr;		// Start of the function
+	bool pf_user;
+	char pf_name[32];
+	uint32_t pf_self;
+	uint32_t pf_total;
+};
+
+bool prof_running;
+static int prof_depth;
+static struct ProfCpu prof_cpus[NCPU];
+
+void
+prof_start(int depth)
+{
+	int i;
+
+	prof_running = false;
+	for (i = 0; i < NCPU; i++)
+		prof_cpus[i].pc_n = 0;
+	prof_depth = MIN(MAX(depth, 0), PROF_MAXDEPTH);
+	prof_running = true;
+}
+
+void
+prof_stop(void)
+{
+	prof_running = false;
+}
+
+// Whether the 8-byte stack frame at 'ebp' is safe to read in the
+// context of tf: within this CPU's kernel stack for a kernel sample,
+// or in a present user page for a user sample.
+static bool
+prof_frame_ok(struct Trapframe *tf, uintptr_t ebp)
+{
+	uintptr_t top = KSTACKTOP - cpunum() * (KSTKSIZE + KSTKGAP);
+	pte_t *pte;
+
+	if (ebp % 4 != 0 || PGOFF(ebp) > PGSIZE - 8)
+		return false;
+	if ((tf->tf_cs & 3) == 0)
+		return ebp >= top - KSTKSIZE && ebp < top;
+	if (ebp >= UTOP || !curenv)
+		return false;
+	pte = pgdir_walk(curenv->env_pgdir, (void *) ebp, 0);
+	return pte && (*pte & (PTE_P | PTE_U)) == (PTE_P | PTE_U);
+}
+
+// Record a sample for this CPU.  Called with interrupts disabled.
+static void
+prof_record(struct Trapframe *tf)
+{
+	struct ProfCpu *pc = &prof_cpus[cpunum()];
+	struct ProfSample *s;
+	uintptr_t ebp;
+	int i;
+
+	s = &pc->pc_samples[pc->pc_n % PROF_NSAMPLES];
+	s->ps_env = curenv ? curenv->env_id : 0;
+	s->ps_pc[0] = tf->tf_eip;
+	ebp = tf->tf_regs.reg_ebp;
+	for (i = 1; i <= PROF_MAXDEPTH; i++) {
+		if (i > prof_depth || !prof_frame_ok(tf, ebp)) {
+			s->ps_pc[i] = 0;
+			continue;
+		}
+		s->ps_pc[i] = ((uintptr_t *) ebp)[1];
+		ebp = ((uintptr_t *) ebp)[0];
+	}
+	pc->pc_n++;
+}
+
+// Called by trap() on every timer interrupt, before it takes the big
+// kernel lock.
+void
+prof_tick(struct Trapframe *tf)
+{
+	struct CpuInfo *holder = NULL;
+
+	if (!prof_running)
+		return;
+	prof_record(tf);
+
+#ifdef DEBUG_SPINLOCK
+	if (spin_is_locked(&kernel_lock))
+		holder = kernel_lock.cpu;
+#endif
+	// Only a flag: if the holder has let go of the lock by now, the
+	// sample just lands at its next release instead.
+	if (holder && holder != thiscpu)
+		prof_cpus[holder - cpus].pc_want = true;
+}
+
+// Called with the big kernel lock held, just before releasing it.
+// Records the sample other CPUs asked for, if any, as if this CPU had
+// been interrupted on return from here.
+void
+prof_release(void)
+{
+	struct ProfCpu *pc = &prof_cpus[cpunum()];
+	struct Trapframe tf;
+	uintptr_t *ebp = (uintptr_t *) read_ebp();
+
+	if (!pc->pc_want)
+		return;
+	pc->pc_want = false;
+	if (!prof_running)
+		return;
+
+	tf.tf_cs = GD_KT;
+	tf.tf_eip = ebp[1];
+	tf.tf_regs.reg_ebp = ebp[0];
+	prof_record(&tf);
+}
+
+// Look up the function containing 'pc'.  User addresses are looked up
+// in the address space of environment 'envid', if it still exists.
+static int
+prof_debuginfo(envid_t envid, uintptr_t pc, struct Eipdebuginfo *info)
+{
+	struct Env *e, *saved = curenv;
+	int r;
+
+	if (pc >= ULIM)
+		return debuginfo_eip(pc, info);
+	if (envid == 0 || envid2env(envid, &e, 0) < 0)
+		return -1;
+
+	// debuginfo_eip reads the environment's symbols through the
+	// current address space and checks them against curenv.
+	curenv = e;
+	lcr3(PADDR(e->env_pgdir));
+	r = debuginfo_eip(pc, info);
+	curenv = saved;
+	lcr3(PADDR(saved ? saved->env_pgdir : kern_pgdir));
+	return r;
+}
+
+// Find or add the line for the function containing 'pc'.
+static struct ProfFunc *
+prof_func(struct ProfFunc *funcs, int *nfuncs, envid_t envid, uintptr_t pc)
+{
+	struct Eipdebuginfo info;
+	char name[sizeof(funcs[0].pf_name)];
+	bool user = pc < ULIM;
+	uintptr_t addr = 0;
+	int i;
+
+	if (prof_debuginfo(envid, pc, &info) == 0) {
+		addr = info.eip_fn_addr;
+		i = MIN(info.eip_fn_namelen, (int) sizeof(name) - 1);
+		memmove(name, info.eip_fn_name, i);
+		name[i] = 0;
+	} else
+		strcpy(name, user ? "<user>" : "<kernel>");
+
+	for (i = 0; i < *nfuncs; i++)
+		if (funcs[i].pf_user == user && funcs[i].pf_addr == addr
+		    && strcmp(funcs[i].pf_name, name) == 0)
+			return &funcs[i];
+	if (*nfuncs == PROF_NFUNCS) {
+		// Out of lines: lump the rest together in the last one.
+		strcpy(funcs[PROF_NFUNCS - 1].pf_name, "<other>");
+		funcs[PROF_NFUNCS - 1].pf_addr = 0;
+		return &funcs[PROF_NFUNCS - 1];
+	}
+	funcs[*nfuncs].pf_addr = addr;
+	funcs[*nfuncs].pf_user = user;
+	strcpy(funcs[*nfuncs].pf_name, name);
+	funcs[*nfuncs].pf_self = funcs[*nfuncs].pf_total = 0;
+	return &funcs[(*nfuncs)++];
+}
+
+// Print the flat profile of the samples taken since prof_start.
+void
+prof_print(void)
+{
+	static struct ProfFunc funcs[PROF_NFUNCS];
+	struct ProfFunc *f, t;
+	struct ProfSample *s;
+	uint32_t n, nsamples = 0, dropped = 0;
+	int i, j, k, nfuncs = 0;
+
+	for (i = 0; i < ncpu; i++) {
+		n = prof_cpus[i].pc_n;
+		if (n > PROF_NSAMPLES) {
+			dropped += n - PROF_NSAMPLES;
+			n = PROF_NSAMPLES;
+		}
+		for (j = 0; j < n; j++) {
+			s = &prof_cpus[i].pc_samples[j];
+			for (k = 0; k <= PROF_MAXDEPTH; k++) {
+				if (k > 0 && s->ps_pc[k] == 0)
+					break;
+				f = prof_func(funcs, &nfuncs, s->ps_env, s->ps_pc[k]);
+				if (k == 0)
+					f->pf_self++;
+				f->pf_total++;
+			}
+		}
+		nsamples += n;
+	}
+	cprintf("profiler %s, %u samples", prof_running ? "on" : "off", nsamples);
+	if (dropped)
+		cprintf(" (%u older samples overwritten)", dropped);
+	cprintf("\n");
+	if (nsamples == 0)
+		return;
+
+	// Sort by self samples, most first.
+	for (i = 1; i < nfuncs; i++)
+		for (j = i; j > 0 && funcs[j].pf_self > funcs[j - 1].pf_self; j--) {
+			t = funcs[j];
+			funcs[j] = funcs[j - 1];
+			funcs[j - 1] = t;
+		}
+
+	cprintf("%6s %7s %6s  %-4s %-8s %s\n",
+		"self", "%", "total", "", "addr", "function");
+	for (i = 0; i < nfuncs && i < PROF_NSHOW; i++) {
+		f = &funcs[i];
+		cprintf("%6u %4u.%u%% %6u  %-4s %08x %s\n", f->pf_self,
+			f->pf_self * 100 / nsamples,
+			f->pf_self * 1000 / nsamples % 10, f->pf_total,
+			f->pf_user ? "user" : "kern", f->pf_addr, f->pf_name);
+	}
+}
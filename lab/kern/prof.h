@@ -0,0 +1,25 @@
+#ifndef JOS_KERN_PROF_H
+#define JOS_KERN_PROF_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/trap.h>
+
+// Most callers recorded per sample
+#define PROF_MAXDEPTH		4
+
+// A running CPU takes a timer interrupt at least this often while the
+// profiler is on (see sched_set_timer)
+#define PROF_INTERVAL_NS	1000000
+
+extern bool prof_running;
+
+void	prof_start(int depth);
+void	prof_stop(void);
+void	prof_tick(struct Trapframe *tf);
+void	prof_release(void);
+void	prof_print(void);
+
+#endif	// !JOS_KERN_PROF_H
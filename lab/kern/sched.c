@@ -4,8 +4,227 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/cpu.h>
+#include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/sched.h>
+#include <kern/prof.h>
 
-void sched_halt(void);
+void sched_halt(void) __attribute__((noreturn));
+
+// How long an environment runs before the timer preempts it
+#define SCHED_SLICE_NS	10000000
+
+// Scheduling policies.  SCHED_PRIORITY, the default, runs the
+// runnable environment with the lowest env_priority, round-robin among
+// equals.  SCHED_FAIR shares the CPU in proportion to a weight derived
+// from env_priority: every environment accumulates a virtual runtime,
+// its CPU time divided by its weight, and the one that has had least
+// runs next.  The monitor's 'sched' command switches between them.
+static int sched_policy = SCHED_PRIORITY;
+
+// Weight of an environment at ENV_PRIOR_NORMAL.  Weights are inversely
+// proportional to env_priority, so ENV_PRIOR_HIGH gets ten times the
+// CPU of ENV_PRIOR_NORMAL.
+#define SCHED_WEIGHT_NORMAL	1024
+
+// Moving to another CPU costs an environment its warm caches and TLB,
+// so the fair scheduler only picks one that last ran elsewhere if its
+// virtual runtime is behind by more than this fraction of sched_credit.
+#define SCHED_MIGRATE_DIV	2
+
+// The smallest virtual runtime the fair scheduler has picked, which
+// only goes up.  An environment that has been blocked for a while runs
+// ahead of the others for at most sched_credit cycles, one timeslice,
+// rather than until it has caught up with them.
+static uint64_t sched_min_vruntime;
+static uint64_t sched_credit;
+
+// CPUID.1:ECX bit that advertises MONITOR/MWAIT
+#define CPUID1_ECX_MONITOR	(1 << 3)
+
+// Idle with MONITOR/MWAIT rather than HLT.
+static bool idle_mwait;
+
+// Program this CPU's one-shot timer.  A CPU about to run an environment
+// needs an interrupt at the end of the timeslice or at the next kernel
+// timer, whichever comes first.  An idle CPU only wakes for kernel
+// timers, and only if no other idle CPU will wake for them first.
+static void
+sched_set_timer(bool idle)
+{
+	uint64_t now = time_nsec(), deadline = 0;
+	uint32_t next = timer_next();
+	struct CpuInfo *c;
+
+	if (next != TIMER_NEVER)
+		deadline = (uint64_t) next * 1000000;
+	if (!idle && (!deadline || deadline > now + SCHED_SLICE_NS))
+		deadline = now + SCHED_SLICE_NS;
+	if (!idle && prof_running && deadline > now + PROF_INTERVAL_NS)
+		deadline = now + PROF_INTERVAL_NS;
+	if (idle && deadline)
+		for (c = cpus; c < cpus + ncpu; c++)
+			if (c != thiscpu && c->cpu_status == CPU_HALTED
+			    && c->cpu_deadline && c->cpu_deadline <= deadline) {
+				deadline = 0;
+				break;
+			}
+
+	thiscpu->cpu_deadline = idle ? deadline : 0;
+	if (!deadline)
+		lapic_timer_oneshot(0);
+	else
+		lapic_timer_oneshot(deadline > now ? deadline - now : 1);
+}
+
+void
+sched_init(void)
+{
+	uint32_t ecx;
+
+	cpuid(1, NULL, NULL, &ecx, NULL);
+	idle_mwait = (ecx & CPUID1_ECX_MONITOR) != 0;
+	cprintf("sched: idle with %s\n", idle_mwait ? "mwait" : "hlt");
+
+	sched_credit = (uint64_t) time_tsc_khz() * (SCHED_SLICE_NS / 1000000);
+}
+
+void
+sched_set_policy(int policy)
+{
+	int i;
+
+	// Virtual runtimes grow under either policy, but only the fair
+	// one keeps them close: start everyone level.
+	if (policy == SCHED_FAIR && sched_policy != SCHED_FAIR) {
+		for (i = 0; i < nenvs; i++)
+			envs[i].env_vruntime = 0;
+		sched_min_vruntime = 0;
+	}
+	sched_policy = policy;
+}
+
+static uint64_t
+sched_weight(struct Env *e)
+{
+	return MAX(SCHED_WEIGHT_NORMAL * ENV_PRIOR_NORMAL / MAX(e->env_priority, 1), 1);
+}
+
+// Charge this CPU's curenv for the TSC cycles since the last charge:
+// its time in user mode when called on entry to the kernel, and its
+// time in the kernel when called from env_run or sched_halt.
+void
+sched_account(void)
+{
+	uint64_t now = read_tsc(), delta = now - thiscpu->cpu_tsc;
+
+	if (curenv) {
+		curenv->env_cycles += delta;
+		curenv->env_vruntime += delta * SCHED_WEIGHT_NORMAL / sched_weight(curenv);
+	}
+	thiscpu->cpu_tsc = now;
+}
+
+// Whether e may run on this CPU (see sys_env_set_affinity).
+static bool
+sched_allowed(struct Env *e)
+{
+	return e->env_affinity & (1 << cpunum());
+}
+
+// Whether e last ran on a different CPU.
+static bool
+sched_remote(struct Env *e)
+{
+	return e->env_runs > 0 && e->env_cpunum != cpunum();
+}
+
+// Pick the runnable environment with the lowest env_priority, starting
+// the search just after 'cur' so that equals take turns.  Among equals,
+// one that last ran on this CPU goes first.  'cur' itself is a
+// candidate if it is still running.
+static struct Env *
+sched_pick_priority(struct Env *cur)
+{
+	uint32_t i, j, start;
+	struct Env *e, *runenv = NULL;
+
+	start = cur ? ENVX(cur->env_id) : 0;
+	for (i = 0; i < nenvs; i++) {
+		j = (start + i) % nenvs;
+		e = &envs[j];
+		if (e->env_status != ENV_RUNNABLE || !sched_allowed(e))
+			continue;
+		if (runenv == NULL || e->env_priority < runenv->env_priority
+		    || (e->env_priority == runenv->env_priority
+			&& sched_remote(runenv) && !sched_remote(e)))
+			runenv = e;
+	}
+	if ((cur && cur->env_status == ENV_RUNNING && sched_allowed(cur)) && (runenv == NULL || cur->env_priority < runenv->env_priority))
+		runenv = cur;
+	return runenv;
+}
+
+// The fair scheduler's sort key: virtual runtime, plus a handicap for
+// environments that would have to migrate.
+static uint64_t
+sched_key(struct Env *e)
+{
+	return e->env_vruntime + (sched_remote(e) ? sched_credit / SCHED_MIGRATE_DIV : 0);
+}
+
+// Pick the candidate with the smallest virtual runtime, allowing for
+// the cost of migrating (see SCHED_MIGRATE_DIV), first lifting
+// the virtual runtime of any that fell far behind (see
+// sched_min_vruntime).
+static struct Env *
+sched_pick_fair(struct Env *cur)
+{
+	uint32_t i, start;
+	uint64_t floor;
+	struct Env *e, *runenv = NULL;
+
+	floor = sched_min_vruntime > sched_credit ? sched_min_vruntime - sched_credit : 0;
+	start = cur ? ENVX(cur->env_id) + 1 : 0;
+	for (i = 0; i < nenvs; i++) {
+		e = &envs[(start + i) % nenvs];
+		if (e->env_status != ENV_RUNNABLE
+		    && !(e == cur && e->env_status == ENV_RUNNING))
+			continue;
+		if (!sched_allowed(e))
+			continue;
+		if (e->env_vruntime < floor)
+			e->env_vruntime = floor;
+		if (runenv == NULL || sched_key(e) < sched_key(runenv))
+			runenv = e;
+	}
+	if (runenv && runenv->env_vruntime > sched_min_vruntime)
+		sched_min_vruntime = runenv->env_vruntime;
+	return runenv;
+}
+
+// Print each environment's CPU time, for the monitor.
+void
+sched_print_stats(void)
+{
+	uint32_t i, khz = time_tsc_khz();
+	struct Env *e;
+
+	cprintf("policy %s\n", sched_policy == SCHED_FAIR ? "fair" : "priority");
+	cprintf("%-8s %6s %8s %8s %10s %10s %3s %8s %8s\n",
+		"env", "status", "priority", "runs", "cpu ms", "vruntime",
+		"cpu", "affinity", "migrated");
+	for (i = 0; i < nenvs; i++) {
+		e = &envs[i];
+		if (e->env_status == ENV_FREE)
+			continue;
+		cprintf("%08x %6d %8d %8u %10llu %10llu %3d %8x %8u\n", e->env_id,
+			e->env_status, e->env_priority, e->env_runs,
+			e->env_cycles / khz, e->env_vruntime / khz,
+			e->env_cpunum, e->env_affinity, e->env_migrations);
+	}
+}
 
 // Choose a user environment to run and run it.
 void
@@ -29,34 +248,95 @@ sched_yield(void)
 	// below to halt the cpu.
 
 	// LAB 4: Your code here.
-	uint32_t i, j, start;
 	struct Env *runenv;
 
 	idle = thiscpu->cpu_env;
-	start = (idle != NULL) ? ENVX(idle->env_id) : 0;
-	runenv = NULL;
-
-	for (i = 0; i < NENV; i++) {
-		j = (start + i) % NENV;
-		if (envs[j].env_status == ENV_RUNNABLE) {
-			if (runenv == NULL || envs[j].env_priority < runenv->env_priority)
-				runenv = &envs[j];
-		}
-	}
-	if ((idle && idle->env_status == ENV_RUNNING) && (runenv == NULL || idle->env_priority < runenv->env_priority)){
-		env_run(idle);
-		return;
+	if (idle && idle->env_status == ENV_RUNNING && !sched_allowed(idle)) {
+		// Its affinity no longer includes this CPU: hand it to
+		// one that it may run on.
+		idle->env_status = ENV_RUNNABLE;
+		sched_wakeup(idle);
 	}
+	if (sched_policy == SCHED_FAIR)
+		runenv = sched_pick_fair(idle);
+	else
+		runenv = sched_pick_priority(idle);
 	if (runenv) {
+		// Start a new timeslice.  The timer is one-shot, so it
+		// only fires if the environment is still running when
+		// the slice is over.
+		sched_set_timer(false);
 		env_run(runenv);
-		return;
 	}
 	// sched_halt never returns
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// Wake CPU c from sched_halt so it can run e, unless e may not run
+// there or c is not halted.  A CPU idling in MWAIT wakes up when its
+// cpu_wakeup flag is written; one in HLT needs an IPI.  Returns false,
+// without doing anything, if c was already woken by someone else.
+static bool
+sched_kick(struct CpuInfo *c, struct Env *e)
+{
+	if (c == thiscpu || c->cpu_status != CPU_HALTED
+	    || !(e->env_affinity & (1 << (c - cpus))))
+		return false;
+	if (xchg(&c->cpu_wakeup, 1))
+		return false;
+	if (!idle_mwait)
+		lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+	return true;
+}
+
+// Environment e has become runnable: if a CPU it may run on is halted
+// in sched_halt, get it to run the scheduler now instead of at its
+// next timer tick.  The CPU e last ran on is tried first.  Each call
+// wakes at most one CPU, and skips CPUs that somebody has already
+// woken.  Called with the big kernel lock held.
+void
+sched_wakeup(struct Env *e)
+{
+	struct CpuInfo *c;
+
+	if (e->env_cpunum >= 0 && e->env_cpunum < ncpu
+	    && sched_kick(&cpus[e->env_cpunum], e))
+		return;
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (sched_kick(c, e))
+			return;
+}
+
+// Wait for an interrupt or a sched_wakeup on the fresh stack set up by
+// sched_halt.  Interrupts enter trap(), which never returns here.
+static void __attribute__((used))
+sched_idle(void)
+{
+	for (;;) {
+		if (!idle_mwait) {
+			asm volatile("sti; hlt; cli");
+			continue;
+		}
+		// Arm the monitor before checking the flag, so that a
+		// sched_wakeup after the check still ends the MWAIT.
+		// STI takes effect after the next instruction, so no
+		// interrupt slips in between it and MWAIT.
+		asm volatile("monitor" : : "a" (&thiscpu->cpu_wakeup), "c" (0), "d" (0));
+		if (thiscpu->cpu_wakeup)
+			break;
+		asm volatile("sti; mwait; cli" : : "a" (0), "c" (0));
+	}
+
+	// Woken without an interrupt: take the kernel lock back the way
+	// trap() does and look for work.
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+		lock_kernel();
+	sched_yield();
+}
+
+// Halt this CPU when there is nothing to do. Wait until a kernel
+// timer is due or sched_wakeup wakes it up. This function never
+// returns.
 //
 void
 sched_halt(void)
@@ -64,41 +344,48 @@ sched_halt(void)
 	int i;
 
 	// For debugging and testing purposes, if there are no runnable
-	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
+	// environments in the system, and no timer that could make one
+	// runnable, then drop into the kernel monitor.
+	for (i = 0; i < nenvs; i++) {
 		if ((envs[i].env_status == ENV_RUNNABLE ||
 		     envs[i].env_status == ENV_RUNNING ||
 		     envs[i].env_status == ENV_DYING))
 			break;
 	}
-	if (i == NENV) {
+	if (i == nenvs && timer_next() == TIMER_NEVER) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
 	// Mark that no environment is running on this CPU
+	sched_account();
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
+	// There is no timeslice to end, so an idle CPU takes no timer
+	// interrupts unless it has to run kernel timers.
+	sched_set_timer(true);
+
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// big kernel lock.  Clear any stale wakeup first, so that
+	// sched_wakeup cannot skip us once we are marked halted.
+	thiscpu->cpu_wakeup = 0;
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
 	// Release the big kernel lock as if we were "leaving" the kernel
+	prof_release();
 	unlock_kernel();
 
-	// Reset stack pointer, enable interrupts and then halt.
+	// Reset stack pointer and wait for work in sched_idle.
 	asm volatile (
 		"movl $0, %%ebp\n"
 		"movl %0, %%esp\n"
 		"pushl $0\n"
 		"pushl $0\n"
-		"sti\n"
-		"1:\n"
-		"hlt\n"
-		"jmp 1b\n"
+		"call sched_idle\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("sched_idle returned");
 }
 
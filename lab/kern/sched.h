@@ -6,7 +6,24 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/env.h>
+
+// Scheduling policies (see kern/sched.c)
+#define SCHED_PRIORITY	0
+#define SCHED_FAIR	1
+
+void sched_init(void);
+void sched_set_policy(int policy);
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+// Call after making environment e runnable.
+void sched_wakeup(struct Env *e);
+
+// Charge curenv for the time since its last charge.
+void sched_account(void);
+
+void sched_print_stats(void);
+
 #endif	// !JOS_KERN_SCHED_H
@@ -1,4 +1,11 @@
 // Mutual exclusion spin locks.
+//
+// These are ticket locks.  A test-and-set lock has every waiter
+// hammering the lock's cache line with locked writes, and lets
+// whichever CPU happens to win take the lock, so one CPU can starve.
+// Here each waiter takes a ticket with one atomic add and then only
+// reads 'owner' until its turn comes, so the lock is handed out in
+// arrival order.
 
 #include <inc/types.h>
 #include <inc/assert.h>
@@ -8,6 +15,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
+#include <kern/time.h>
 
 // The big kernel lock
 struct spinlock kernel_lock = {
@@ -16,6 +24,15 @@ struct spinlock kernel_lock = {
 #endif
 };
 
+#ifdef SPINLOCK_STATS
+// All locks that have been initialized, linked through 'link'
+static struct spinlock *all_locks = &kernel_lock;
+static volatile uint32_t all_locks_busy;
+
+// Most locks spin_print_stats lists
+#define SPIN_NSHOW	16
+#endif
+
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -39,18 +56,46 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return spin_is_locked(lock) && lock->cpu == thiscpu;
+}
+
+// Print the function and line of each pc in pcs[].
+static void
+print_pcs(uintptr_t pcs[])
+{
+	struct Eipdebuginfo info;
+	int i;
+
+	for (i = 0; i < 10 && pcs[i]; i++) {
+		if (debuginfo_eip(pcs[i], &info) >= 0)
+			cprintf("  %08x %s:%d: %.*s+%x\n", pcs[i],
+				info.eip_file, info.eip_line,
+				info.eip_fn_namelen, info.eip_fn_name,
+				pcs[i] - info.eip_fn_addr);
+		else
+			cprintf("  %08x\n", pcs[i]);
+	}
 }
 #endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
+	lk->next = lk->owner = 0;
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
 	lk->cpu = 0;
 #endif
+#ifdef SPINLOCK_STATS
+	lk->nacquire = lk->ncontended = 0;
+	lk->spin_cycles = lk->max_hold = 0;
+	lk->max_hold_pcs[0] = 0;
+	while (xchg(&all_locks_busy, 1) != 0)
+		asm volatile ("pause");
+	lk->link = all_locks;
+	all_locks = lk;
+	xchg(&all_locks_busy, 0);
+#endif
 }
 
 // Acquire the lock.
@@ -60,61 +105,132 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	uint32_t ticket;
+#ifdef SPINLOCK_STATS
+	uint64_t spin_start = 0;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
+	// The xadd is atomic.
 	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// reordered before it.
+	ticket = xadd(&lk->next, 1);
+	if (lk->owner != ticket) {
+#ifdef SPINLOCK_STATS
+		spin_start = read_tsc();
+#endif
+		while (lk->owner != ticket)
+			asm volatile ("pause");
+	}
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
 	lk->cpu = thiscpu;
 	get_caller_pcs(lk->pcs);
 #endif
+#ifdef SPINLOCK_STATS
+	lk->hold_start = read_tsc();
+	lk->nacquire++;
+	if (spin_start) {
+		lk->ncontended++;
+		lk->spin_cycles += lk->hold_start - spin_start;
+	}
+#endif
 }
 
 // Release the lock.
 void
 spin_unlock(struct spinlock *lk)
 {
+#ifdef SPINLOCK_STATS
+	uint64_t held;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (!holding(lk)) {
-		int i;
-		uint32_t pcs[10];
+		uintptr_t pcs[10];
 		// Nab the acquiring EIP chain before it gets released
 		memmove(pcs, lk->pcs, sizeof pcs);
 		cprintf("CPU %d cannot release %s: held by CPU %d\nAcquired at:", 
-			cpunum(), lk->name, lk->cpu->cpu_id);
-		for (i = 0; i < 10 && pcs[i]; i++) {
-			struct Eipdebuginfo info;
-			if (debuginfo_eip(pcs[i], &info) >= 0)
-				cprintf("  %08x %s:%d: %.*s+%x\n", pcs[i],
-					info.eip_file, info.eip_line,
-					info.eip_fn_namelen, info.eip_fn_name,
-					pcs[i] - info.eip_fn_addr);
-			else
-				cprintf("  %08x\n", pcs[i]);
-		}
+			cpunum(), lk->name, lk->cpu ? lk->cpu->cpu_id : -1);
+		print_pcs(pcs);
 		panic("spin_unlock");
 	}
+#endif
+
+#ifdef SPINLOCK_STATS
+	held = read_tsc() - lk->hold_start;
+	if (held > lk->max_hold) {
+		lk->max_hold = held;
+		memmove(lk->max_hold_pcs, lk->pcs, sizeof lk->pcs);
+	}
+#endif
 
+#ifdef DEBUG_SPINLOCK
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
 #endif
 
-	// The xchg serializes, so that reads before release are 
-	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-	// 7.2) says reads can be carried out speculatively and in
-	// any order, which implies we need to serialize here.
-	// But the 2007 Intel 64 Architecture Memory Ordering White
-	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
-	// The xchg being asm volatile ensures gcc emits it after
-	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+	// Only the holder writes 'owner', so a plain increment hands
+	// the lock to the next ticket.  The 2007 Intel 64 Architecture
+	// Memory Ordering White Paper says that Intel 64 and IA-32 will
+	// not move a load or store after a later store, so the critical
+	// section cannot leak past this store; the compiler barrier
+	// keeps gcc from moving it either.
+	asm volatile("" : : : "memory");
+	lk->owner = lk->owner + 1;
+}
+
+#ifdef SPINLOCK_STATS
+// Print the statistics of the most contended locks, and where the
+// longest hold of each happened.
+void
+spin_print_stats(void)
+{
+	struct spinlock *locks[SPIN_NSHOW], *lk, *t;
+	uint32_t khz = time_tsc_khz();
+	int i, j, n = 0;
+
+	// Keep the SPIN_NSHOW locks with the most contended acquisitions.
+	for (lk = all_locks; lk; lk = lk->link) {
+		if (n < SPIN_NSHOW)
+			locks[n++] = lk;
+		else if (lk->ncontended > locks[n - 1]->ncontended)
+			locks[n - 1] = lk;
+		else
+			continue;
+		for (j = n - 1; j > 0 && locks[j]->ncontended > locks[j - 1]->ncontended; j--) {
+			t = locks[j];
+			locks[j] = locks[j - 1];
+			locks[j - 1] = t;
+		}
+	}
+
+	cprintf("%-16s %10s %10s %12s %12s\n",
+		"lock", "acquired", "contended", "avg spin", "max hold us");
+	for (i = 0; i < n; i++) {
+		lk = locks[i];
+		cprintf("%-16s %10u %10u %12llu %12llu\n", lk->name,
+			lk->nacquire, lk->ncontended,
+			lk->ncontended ? lk->spin_cycles / lk->ncontended : 0,
+			lk->max_hold * 1000 / khz);
+	}
+	for (i = 0; i < n; i++) {
+		lk = locks[i];
+		if (!lk->ncontended || !lk->max_hold_pcs[0])
+			continue;
+		cprintf("%s held longest at:\n", lk->name);
+		print_pcs(lk->max_hold_pcs);
+	}
 }
+#else
+void
+spin_print_stats(void)
+{
+	cprintf("Lock statistics are off; define SPINLOCK_STATS in kern/spinlock.h\n");
+}
+#endif
@@ -6,9 +6,19 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
-// Mutual exclusion lock.
+// Uncomment this to keep contention statistics for each lock
+// (see spin_print_stats).  Requires DEBUG_SPINLOCK.
+//#define SPINLOCK_STATS
+
+#if defined(SPINLOCK_STATS) && !defined(DEBUG_SPINLOCK)
+# error "SPINLOCK_STATS requires DEBUG_SPINLOCK"
+#endif
+
+// Mutual exclusion lock.  A ticket lock: each CPU that wants the lock
+// takes the next ticket, and CPUs get the lock in ticket order.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile uint32_t next;	// Next ticket to hand out
+	volatile uint32_t owner;	// Ticket that holds the lock
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
@@ -17,14 +27,33 @@ struct spinlock {
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
+
+#ifdef SPINLOCK_STATS
+	// Contention statistics, updated while holding the lock
+	uint32_t nacquire;     // Times acquired
+	uint32_t ncontended;   // Times some other CPU had it first
+	uint64_t spin_cycles;  // TSC cycles spent waiting for it
+	uint64_t hold_start;   // TSC when last acquired
+	uint64_t max_hold;     // Longest time held, in TSC cycles
+	uintptr_t max_hold_pcs[10];	// Who held it that long
+	struct spinlock *link; // All locks, for spin_print_stats
+#endif
 };
 
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+void spin_print_stats(void);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
+// Whether anyone holds the lock right now.
+static inline bool
+spin_is_locked(struct spinlock *lk)
+{
+	return lk->next != lk->owner;
+}
+
 extern struct spinlock kernel_lock;
 
 static inline void
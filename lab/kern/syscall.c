@@ -12,6 +12,10 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/futex.h>
+#include <kern/trace.h>
+#include <kern/kmalloc.h>
 #include <kern/e1000.h>
 
 // Print a string to the system console.
@@ -90,6 +94,7 @@ sys_exofork(void)
 	env->env_status = ENV_NOT_RUNNABLE;
 	env->env_tf = curenv->env_tf;
 	env->env_tf.tf_regs.reg_eax = 0;
+	env->env_affinity = curenv->env_affinity;
 	return env->env_id;
 }
 
@@ -119,6 +124,13 @@ sys_env_set_status(envid_t envid, int status)
 	if ((ret = envid2env(envid, &env, 1)) < 0)
 		return ret;
 	env->env_status = status;
+	if (status == ENV_RUNNABLE) {
+		// Cut short any sleep the environment was in.
+		if (env->env_timer)
+			timer_del(env->env_timer);
+		futex_dequeue(env);
+		sched_wakeup(env);
+	}
 	return 0;
 }
 
@@ -291,6 +303,96 @@ sys_page_unmap(envid_t envid, void *va)
 	return 0;
 }
 
+// Do 'npages' pages starting at 'va' all lie below UTOP?
+static bool
+pgmap_range_ok(void *va, int npages)
+{
+	return (uintptr_t) va <= UTOP
+		&& npages <= (UTOP - (uintptr_t) va) / PGSIZE;
+}
+
+// Apply an array of 'nops' page mapping operations in one system call.
+// Each struct PageMapOp covers op->npages consecutive pages and behaves
+// like the matching single-page call for every page in it:
+//	PGMAP_MAP	sys_page_map(0, srcva, dstenv, dstva, perm)
+//	PGMAP_ALLOC	sys_page_alloc(dstenv, dstva, perm)
+//	PGMAP_UNMAP	sys_page_unmap(dstenv, dstva)
+//	PGMAP_GET	sys_page_map(dstenv, srcva, 0, dstva, perm)
+// Operations are applied in order, and the TLB is flushed at most once
+// for the whole batch.  If an operation fails, the pages mapped before
+// it stay mapped.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if nops is negative or larger than PGMAP_MAXOPS,
+//		or an operation is unknown or has a negative npages,
+//		or its range runs past UTOP,
+//		or the operations cover more than PGMAP_MAXPAGES pages.
+//		Nothing is mapped in these cases.
+//	Any error returned by sys_page_map, sys_page_alloc or
+//		sys_page_unmap for one of the pages.
+static int
+sys_page_map_batch(struct PageMapOp *uops, int nops)
+{
+	// The batch may unmap or remap the page holding the caller's
+	// array, so it runs from a copy.  The kernel lock makes one copy
+	// enough for all CPUs.
+	static struct PageMapOp ops[PGMAP_MAXOPS];
+	int i, j, r, npages;
+	struct PageMapOp *op;
+
+	if (nops < 0 || nops > PGMAP_MAXOPS)
+		return -E_INVAL;
+	user_mem_assert(curenv, uops, nops * sizeof(struct PageMapOp), PTE_U);
+	memmove(ops, uops, nops * sizeof(struct PageMapOp));
+
+	// Check every range up front, so a bad one cannot wrap around
+	// the address space or keep the kernel busy for long.
+	for (i = 0, npages = 0; i < nops; i++) {
+		op = &ops[i];
+		if (op->op < PGMAP_MAP || op->op > PGMAP_GET
+		    || op->npages < 0 || op->npages > PGMAP_MAXPAGES - npages)
+			return -E_INVAL;
+		if (!pgmap_range_ok(op->dstva, op->npages))
+			return -E_INVAL;
+		if ((op->op == PGMAP_MAP || op->op == PGMAP_GET)
+		    && !pgmap_range_ok(op->srcva, op->npages))
+			return -E_INVAL;
+		npages += op->npages;
+	}
+
+	r = 0;
+	tlb_defer_begin();
+	for (i = 0; i < nops && r == 0; i++) {
+		op = &ops[i];
+		for (j = 0; j < op->npages && r == 0; j++) {
+			switch (op->op) {
+			case PGMAP_MAP:
+				r = sys_page_map(0, op->srcva + j * PGSIZE,
+						 op->dstenv, op->dstva + j * PGSIZE,
+						 op->perm);
+				break;
+			case PGMAP_ALLOC:
+				r = sys_page_alloc(op->dstenv, op->dstva + j * PGSIZE,
+						   op->perm);
+				break;
+			case PGMAP_UNMAP:
+				r = sys_page_unmap(op->dstenv, op->dstva + j * PGSIZE);
+				break;
+			case PGMAP_GET:
+				r = sys_page_map(op->dstenv, op->srcva + j * PGSIZE,
+						 0, op->dstva + j * PGSIZE,
+						 op->perm);
+				break;
+			default:
+				r = -E_INVAL;
+				break;
+			}
+		}
+	}
+	tlb_defer_end();
+	return r;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -340,7 +442,10 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 
 	if ((r = envid2env(envid, &env, 0)) < 0)
 		return -E_BAD_ENV;
-	if (env->env_ipc_recving != true || env->env_ipc_from != 0)
+	if (env->env_ipc_recving != true)
+		return -E_IPC_NOT_RECV;
+	if (env->env_ipc_want ? env->env_ipc_want != curenv->env_id
+	    : env->env_ipc_from != 0)
 		return -E_IPC_NOT_RECV;
 	if (srcva < (void *)UTOP && PGOFF(srcva))
 		return -E_INVAL;
@@ -357,18 +462,60 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	if (srcva < (void *)UTOP && env->env_ipc_dstva != 0) {
 		if ((r = page_insert(env->env_pgdir, pp, env->env_ipc_dstva, perm)) < 0)
 			return -E_NO_MEM;
-		env->env_ipc_perm = perm;
+		if (!env->env_ipc_want)
+			env->env_ipc_perm = perm;
 	}
 	
-	env->env_ipc_from = curenv->env_id;
+	if (env->env_timer)
+		timer_del(env->env_timer);
+	trace(TRACE_IPC_SEND, env->env_id, value);
 	env->env_ipc_recving = false;
-	env->env_ipc_value = value;
 	env->env_status = ENV_RUNNABLE;
-	env->env_tf.tf_regs.reg_eax = 0;
+	if (env->env_ipc_want)
+		env->env_tf.tf_regs.reg_eax = value;
+	else {
+		env->env_ipc_from = curenv->env_id;
+		env->env_ipc_value = value;
+		env->env_tf.tf_regs.reg_eax = 0;
+	}
+	sched_wakeup(env);
 	return 0;
 	// panic("sys_ipc_try_send not implemented");
 }
 
+// Called when a sleeping or receiving environment's deadline passes.
+static void
+env_timeout(void *arg)
+{
+	struct Env *e = arg;
+
+	if (e->env_status != ENV_NOT_RUNNABLE)
+		return;
+	if (e->env_ipc_recving) {
+		e->env_ipc_recving = false;
+		e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+	} else if (futex_dequeue(e))
+		e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+	else
+		e->env_tf.tf_regs.reg_eax = 0;
+	e->env_status = ENV_RUNNABLE;
+	sched_wakeup(e);
+}
+
+// Arrange for env_timeout(e) at time 'deadline' (ms since boot).
+static int
+env_set_timeout(struct Env *e, uint32_t deadline)
+{
+	if (!e->env_timer) {
+		if (!(e->env_timer = kzalloc(sizeof(struct Timer))))
+			return -E_NO_MEM;
+		e->env_timer->t_func = env_timeout;
+		e->env_timer->t_arg = e;
+	}
+	timer_add(e->env_timer, deadline);
+	return 0;
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
@@ -376,17 +523,38 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If 'deadline' is nonzero, give up when the time (see sys_time_msec)
+// reaches 'deadline'.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_TIMEOUT if the deadline passes before a value arrives.
+//	-E_INTR if the environment is notified (see env_notify) before a
+//		value arrives, or was since it last received.
+//	-E_NO_MEM if there is no memory to keep track of the deadline.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, uint32_t deadline)
 {
+	int r;
+
 	// LAB 4: Your code here.
 	if (dstva < (void *)UTOP && PGOFF(dstva))
 		return -E_INVAL;
+	if (curenv->env_notify_pending) {
+		curenv->env_notify_pending = false;
+		return -E_INTR;
+	}
+	if (deadline) {
+		if ((int32_t) (deadline - time_msec()) <= 0)
+			return -E_TIMEOUT;
+		if ((r = env_set_timeout(curenv, deadline)) < 0)
+			return r;
+	}
+	trace(TRACE_IPC_RECV, (uint32_t) dstva, deadline);
 	curenv->env_ipc_recving = true;
+	curenv->env_ipc_want = 0;
 	curenv->env_ipc_dstva = dstva;
 	curenv->env_status = ENV_NOT_RUNNABLE;
 	curenv->env_ipc_from = 0;
@@ -395,6 +563,174 @@ sys_ipc_recv(void *dstva)
 	return 0;
 }
 
+// Block until the time (see sys_time_msec) reaches 'deadline'.
+//
+// Returns 0 once the deadline has passed or sys_env_set_status makes
+// the environment runnable again.  Errors are:
+//	-E_NO_MEM if there is no memory to keep track of the deadline.
+static int
+sys_sleep_until(uint32_t deadline)
+{
+	int r;
+
+	if ((int32_t) (deadline - time_msec()) <= 0)
+		return 0;
+	if ((r = env_set_timeout(curenv, deadline)) < 0)
+		return r;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
+// Find the physical address of the user-readable word at 'addr' in
+// the current environment, which is what futexes are keyed on.
+static int
+futex_key(uint32_t *addr, physaddr_t *key)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	if ((uintptr_t) addr % sizeof(uint32_t))
+		return -E_INVAL;
+	if (!(pp = page_lookup(curenv->env_pgdir, addr, &pte)) || !(*pte & PTE_U))
+		return -E_INVAL;
+	*key = page2pa(pp) + PGOFF(addr);
+	return 0;
+}
+
+// Block until another environment calls sys_futex_wake on the word at
+// 'addr', provided that word still holds 'val'.  The check and going
+// to sleep happen atomically with respect to sys_futex_wake.  'addr'
+// may be in any page the environment can read, including UENVS; if
+// the page is shared, the wakeup may come from any environment that
+// has it mapped.
+//
+// If 'deadline' is nonzero, give up when the time (see sys_time_msec)
+// reaches 'deadline'.
+//
+// Returns 0 when woken, or at once if *addr != val; callers recheck
+// whatever condition they are waiting for.  Errors are:
+//	-E_INVAL if addr is not 4-byte aligned or not mapped readable.
+//	-E_TIMEOUT if the deadline passes first.
+//	-E_NO_MEM if there is no memory to keep track of the deadline.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t val, uint32_t deadline)
+{
+	physaddr_t key;
+	int r;
+
+	if ((r = futex_key(addr, &key)) < 0)
+		return r;
+	if (*(uint32_t *) KADDR(key) != val)
+		return 0;
+	if (deadline) {
+		if ((int32_t) (deadline - time_msec()) <= 0)
+			return -E_TIMEOUT;
+		if ((r = env_set_timeout(curenv, deadline)) < 0)
+			return r;
+	}
+	futex_enqueue(curenv, key);
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
+// Wake up to 'n' environments blocked in sys_futex_wait on the word at
+// 'addr'.
+//
+// Returns the number of environments woken.  Errors are:
+//	-E_INVAL if addr is not 4-byte aligned or not mapped readable.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+	physaddr_t key;
+	int r;
+
+	if ((r = futex_key(addr, &key)) < 0)
+		return r;
+	return futex_wake(key, n);
+}
+
+// Notify environment envid (see env_notify): its sys_ipc_recv returns
+// -E_INTR, now if it is blocked there, or else the next time it calls
+// it.  This lets an env that shares memory with another tell it there
+// is work, without the other having to wait anywhere but in ipc_recv.
+// Any env may notify the network server, with which it shares its
+// sockets' buffers.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist, or is
+//		not the caller, its parent, one of its children or the
+//		network server.
+static int
+sys_env_notify(envid_t envid)
+{
+	struct Env *e;
+
+	if (envid2env(envid, &e, 0) < 0)
+		return -E_BAD_ENV;
+	if (e != curenv && e->env_parent_id != curenv->env_id
+	    && e->env_id != curenv->env_parent_id && e->env_type != ENV_TYPE_NS)
+		return -E_BAD_ENV;
+	env_notify(e);
+	return 0;
+}
+
+// Like sys_ipc_recv without a deadline, but only environment 'from'
+// can send; others get -E_IPC_NOT_RECV as if we were not receiving.
+// The value sent is returned instead of being stored, and the
+// env_ipc_* fields the environment sees are left alone.  The
+// demand-paging loader uses this to receive page-ins inside whatever
+// the program was doing, perhaps just after the program's own
+// sys_ipc_recv returned.
+//
+// Returns the value sent, which may look like an error, or < 0 on
+// error.  Errors are:
+//	-E_INVAL if from is 0, or dstva < UTOP but dstva is not
+//		page-aligned.
+//	-E_INTR if the environment is notified (see env_notify) before a
+//		value arrives, or was since it last received.
+static int
+sys_ipc_recv_from(envid_t from, void *dstva)
+{
+	if (from == 0 || (dstva < (void *)UTOP && PGOFF(dstva)))
+		return -E_INVAL;
+	if (curenv->env_notify_pending) {
+		curenv->env_notify_pending = false;
+		return -E_INTR;
+	}
+	trace(TRACE_IPC_RECV, (uint32_t) dstva, 0);
+	curenv->env_ipc_recving = true;
+	curenv->env_ipc_want = from;
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+}
+
+// Restrict envid to running on the CPUs in 'mask', bit i for CPU i.
+// Bits for CPUs that do not exist are ignored.  If envid is running on
+// a CPU that the mask excludes, it moves at its next reschedule.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if mask allows no CPU at all.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+	struct Env *env;
+	int r;
+
+	if (ncpu < 32)
+		mask &= (1U << ncpu) - 1;
+	if (!mask)
+		return -E_INVAL;
+	if ((r = envid2env(envid, &env, 1)) < 0)
+		return r;
+	env->env_affinity = mask;
+	return 0;
+}
+
 // Set env priority
 static int
 sys_env_set_priority(envid_t envid, int priority)
@@ -417,12 +753,276 @@ sys_time_msec(void)
 	return time_msec();
 }
 
-// Send network packet
+// Queue the packet made of the 'nfrags' pieces in 'frags', which the
+// kernel has already copied, for transmission.
+static int
+netpacket_send(const struct NetFrag *frags, int nfrags)
+{
+	struct e1000_seg segs[E1000_MAXSEGS];
+	const uint8_t *va;
+	size_t len, n, total, max, hdrlen;
+	int i, nsegs, offload, iphlen = 0;
+
+	max = frags[0].nf_flags & NETFRAG_TSO ? NETPACKET_TSO_MAX : NETPACKET_MAX;
+	total = 0;
+	for (i = 0; i < nfrags; i++) {
+		if (frags[i].nf_len > NETPACKET_MAX
+		    || frags[i].nf_len > max - total)
+			return -E_INVAL;
+		total += frags[i].nf_len;
+		// Only pages the env owns below UTOP may be pinned
+		if ((uintptr_t) frags[i].nf_va >= UTOP
+		    || frags[i].nf_len > UTOP - (uintptr_t) frags[i].nf_va)
+			return -E_INVAL;
+		user_mem_assert(curenv, frags[i].nf_va, frags[i].nf_len, PTE_U);
+	}
+	if (total == 0)
+		return -E_INVAL;
+
+	// Checksums the NIC is to fill in must lie within the packet, and
+	// the segments it is to cut the packet into within the MTU
+	offload = frags[0].nf_flags & ~NETFRAG_EOP;
+	if (offload & (NETFRAG_CSUM_IP | NETFRAG_CSUM_TCP)) {
+		iphlen = NETFRAG_IPHLEN_OF(offload);
+		if (iphlen < 20 || iphlen > 60 || iphlen % 4
+		    || total < ETH_HLEN + iphlen
+			       + (offload & NETFRAG_CSUM_TCP ? 20 : 0))
+			return -E_INVAL;
+	} else if (offload & NETFRAG_TSO)
+		return -E_INVAL;
+	else
+		offload = 0;
+	if (offload & NETFRAG_TSO) {
+		hdrlen = ETH_HLEN + iphlen + NETFRAG_TCPHLEN_OF(offload);
+		if (!(offload & NETFRAG_CSUM_IP) || !(offload & NETFRAG_CSUM_TCP)
+		    || NETFRAG_TCPHLEN_OF(offload) < 20
+		    || NETFRAG_MSS_OF(offload) == 0
+		    || hdrlen + NETFRAG_MSS_OF(offload) > ETH_HLEN + 1500
+		    || total <= hdrlen)
+			return -E_INVAL;
+	}
+
+	// Split the pieces at page boundaries.  A piece is shorter than a
+	// page, so it covers at most two.  Device memory (the bypass
+	// mapping) has no PageInfo to pin, so it cannot be sent from.
+	nsegs = 0;
+	for (i = 0; i < nfrags; i++) {
+		va = frags[i].nf_va;
+		len = frags[i].nf_len;
+		for (; len > 0; va += n, len -= n) {
+			n = MIN(len, PGSIZE - PGOFF(va));
+			segs[nsegs].pp = page_lookup(curenv->env_pgdir, (void *) va, NULL);
+			if (!segs[nsegs].pp)
+				return -E_INVAL;
+			segs[nsegs].off = PGOFF(va);
+			segs[nsegs].len = n;
+			nsegs++;
+		}
+	}
+	return e1000_transmit(segs, nsegs, offload, curenv->env_id);
+}
+
+// Queue a packet made of the 'nfrags' pieces in 'frags' for
+// transmission.  The NIC reads the pieces straight out of the caller's
+// pages, which stay allocated until it is done with them even if the
+// caller unmaps them.  The caller must not change the data until then:
+// each finished packet adds one to its env_tx_done, which
+// sys_netpacket_tx_reclaim brings up to date.
+//
+// The first piece's nf_flags may ask the NIC to fill in the IP and TCP
+// checksums (NETFRAG_CSUM_*), and to cut a large TCP segment into
+// MSS-sized ones (NETFRAG_TSO).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if nfrags is not between 1 and NETFRAG_MAX, the
+//		packet is empty or longer than NETPACKET_MAX (or
+//		NETPACKET_TSO_MAX), a piece is longer than NETPACKET_MAX
+//		or lies above UTOP or in device memory, or the offloads
+//		asked for do not fit the packet.
+//	-E_NO_MEM if the transmit ring is full; try again later.
+static int
+sys_netpacket_try_sendv(const struct NetFrag *frags, int nfrags)
+{
+	struct NetFrag kfrags[NETFRAG_MAX];
+
+	if (nfrags < 1 || nfrags > NETFRAG_MAX)
+		return -E_INVAL;
+	user_mem_assert(curenv, frags, nfrags * sizeof(struct NetFrag), PTE_U);
+	memcpy(kfrags, frags, nfrags * sizeof(struct NetFrag));
+	return netpacket_send(kfrags, nfrags);
+}
+
+// Queue several packets for transmission in one call.  'frags' holds
+// the pieces of the packets one after another, the last piece of each
+// marked with NETFRAG_EOP.  Each packet is sent as by
+// sys_netpacket_try_sendv.  Packets are queued in order until one does
+// not fit in the transmit ring; the caller retries the rest later.
+//
+// Returns the number of packets queued, or < 0 if the first one could
+// not be.  Errors are:
+//	-E_INVAL if nfrags is not between 1 and NETBATCH_MAXFRAGS, a
+//		packet has more than NETFRAG_MAX pieces, the last piece
+//		lacks NETFRAG_EOP, or as for sys_netpacket_try_sendv.
+//	-E_NO_MEM if the transmit ring is full.
+static int
+sys_netpacket_send_batch(const struct NetFrag *frags, int nfrags)
+{
+	struct NetFrag kfrags[NETBATCH_MAXFRAGS];
+	int i, start, npkts, r;
+
+	if (nfrags < 1 || nfrags > NETBATCH_MAXFRAGS)
+		return -E_INVAL;
+	user_mem_assert(curenv, frags, nfrags * sizeof(struct NetFrag), PTE_U);
+	memcpy(kfrags, frags, nfrags * sizeof(struct NetFrag));
+
+	npkts = 0;
+	for (start = 0; start < nfrags; start = i + 1) {
+		for (i = start; i < nfrags && !(kfrags[i].nf_flags & NETFRAG_EOP); i++)
+			/* find the packet's last piece */;
+		if (i == nfrags || i - start + 1 > NETFRAG_MAX)
+			r = -E_INVAL;
+		else
+			r = netpacket_send(&kfrags[start], i - start + 1);
+		if (r < 0)
+			return npkts ? npkts : r;
+		npkts++;
+	}
+	return npkts;
+}
+
+// Send a network packet held in one piece of the caller's memory.
+// Like sys_netpacket_try_sendv.
 static int
 sys_netpacket_try_send(void *addr, size_t len)
 {
-	user_mem_assert(curenv, addr, len, PTE_U);
-	return e1000_transmit(addr, len);
+	struct NetFrag frag = { addr, len };
+
+	return netpacket_send(&frag, 1);
+}
+
+// Receive a batch of network packets by page flipping, like
+// sys_netpacket_recv_page, into up to 'npages' pages at dstva,
+// dstva + PGSIZE, and so on.  Short frames are packed several to a
+// page, so each page holds struct jif_pkts one after another, aligned
+// to 4 bytes and ended by a zero jp_len or the end of the page.
+//
+// Returns the number of pages mapped, 0 if no frame was waiting, or
+// < 0 on error.  Errors are:
+//	-E_INVAL if npages is not between 1 and NETBATCH_MAXPAGES, or
+//		dstva is not page-aligned or the pages reach above UTOP.
+//	-E_NO_MEM if there is no memory for a page table; the frames
+//		that were to go in that page and after it are lost.
+static int
+sys_netpacket_recv_batch(void *dstva, int npages)
+{
+	struct PageInfo *pages[NETBATCH_MAXPAGES];
+	int i, n, mapped, r;
+
+	if (npages < 1 || npages > NETBATCH_MAXPAGES)
+		return -E_INVAL;
+	if (PGOFF(dstva) || (uintptr_t) dstva >= UTOP
+	    || npages > (UTOP - (uintptr_t) dstva) / PGSIZE)
+		return -E_INVAL;
+
+	n = e1000_receive_batch(pages, npages);
+	mapped = r = 0;
+	for (i = 0; i < n; i++) {
+		if (r == 0 && (r = page_insert(curenv->env_pgdir, pages[i],
+					       dstva + i * PGSIZE,
+					       PTE_P | PTE_U | PTE_W)) == 0)
+			mapped++;
+		page_decref(pages[i]);
+	}
+	return mapped ? mapped : r;
+}
+
+// Block until the NIC has a received frame (what == NETWAIT_RX) or
+// room to transmit (NETWAIT_TX), as told by its interrupts.  Like
+// sys_futex_wait, this only waits: callers then retry the receive or
+// send, which may still fail if another env got there first.
+//
+// If 'deadline' is nonzero, give up when the time (see sys_time_msec)
+// reaches 'deadline'.
+//
+// Returns 0 when woken, or at once if the NIC is ready.  Errors are:
+//	-E_INVAL if 'what' is unknown.
+//	-E_TIMEOUT if the deadline passes first.
+//	-E_NO_MEM if there is no memory to keep track of the deadline.
+static int
+sys_netpacket_wait(int what, uint32_t deadline)
+{
+	physaddr_t key;
+	int r;
+
+	if (what != NETWAIT_RX && what != NETWAIT_TX)
+		return -E_INVAL;
+	if (!(key = e1000_wait_key(what)))
+		return 0;
+	if (deadline) {
+		if ((int32_t) (deadline - time_msec()) <= 0)
+			return -E_TIMEOUT;
+		if ((r = env_set_timeout(curenv, deadline)) < 0)
+			return r;
+	}
+	futex_enqueue(curenv, key);
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
+// Release the pages of packets the NIC has sent, and update
+// env_tx_done for the envs that sent them.
+static int
+sys_netpacket_tx_reclaim(void)
+{
+	e1000_tx_reclaim();
+	return 0;
+}
+
+// Take over the NIC: map its registers, a pair of fresh rings and
+// their buffers at 'va', laid out as inc/e1000.h describes, and stop
+// the kernel sending or receiving on it.  The caller then drives the
+// card itself, through sys_net_bypass_push.  Each interrupt from the
+// card bumps the nb_intr counter (a futex) and makes the caller's
+// sys_ipc_recv return -E_INTR.  The card goes back to the kernel when
+// the caller exits.
+//
+// Only the network server may do this, and it is trusted as much as
+// the kernel: it sees and sends every frame on the machine, and the
+// card acts on whatever it puts in the descriptors besides their
+// addresses, which the kernel fills in (see e1000_bypass).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller is not the network server.
+//	-E_INVAL if va is not page-aligned or the mapping reaches above
+//		UTOP.
+//	-E_NOT_SUPP if there is no NIC, or it has already been taken.
+//	-E_NO_MEM if there is no memory for the rings, buffers or page
+//		tables.
+static int
+sys_net_bypass(void *va)
+{
+	if (curenv->env_type != ENV_TYPE_NS)
+		return -E_BAD_ENV;
+	if (PGOFF(va) || (uintptr_t) va >= UTOP
+	    || (uintptr_t) va + NB_SIZE > UTOP)
+		return -E_INVAL;
+	return e1000_bypass(curenv, (uintptr_t) va);
+}
+
+// Hand the card the transmit descriptors queued in the caller's bypass
+// mapping up to index 'tdt', and give back the receive descriptors up
+// to index 'rdt' (see sys_net_bypass).  This is the only way the
+// caller moves TDT and RDT.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller does not drive the card.
+//	-E_INVAL if tdt or rdt is out of range, or a queued descriptor
+//		is of an unknown type or does not fit its buffer.
+static int
+sys_net_bypass_push(uint32_t tdt, uint32_t rdt)
+{
+	return e1000_bypass_push(curenv, tdt, rdt);
 }
 
 // Receive network packet
@@ -433,6 +1033,33 @@ sys_netpacket_recv(void *addr, size_t buflen)
 	return e1000_receive(addr, buflen);
 }
 
+// Receive a network packet by page flipping: the page the NIC wrote the
+// next frame into is mapped at 'dstva' in the caller, replacing any
+// page there, and the NIC gets a fresh page in its place.  The page is
+// laid out like a struct jif_pkt: the frame's length as an int32_t,
+// the NETRX_* checksums the NIC verified as another, then the frame.
+// No data is copied.
+//
+// Returns the frame's length on success, < 0 on error.  Errors are:
+//	-E_INVAL if dstva >= UTOP or dstva is not page-aligned.
+//	-E_NO_MEM if no frame is waiting (try again later), or there is
+//		no memory to refill the ring or for a page table; the
+//		frame is lost in the last case.
+static int
+sys_netpacket_recv_page(void *dstva)
+{
+	struct PageInfo *pp;
+	int len, r;
+
+	if ((uintptr_t) dstva >= UTOP || PGOFF(dstva))
+		return -E_INVAL;
+	if ((len = e1000_receive_page(&pp)) < 0)
+		return len;
+	r = page_insert(curenv->env_pgdir, pp, dstva, PTE_P | PTE_U | PTE_W);
+	page_decref(pp);
+	return r < 0 ? r : len;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -470,7 +1097,7 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_ipc_try_send:
 			return sys_ipc_try_send(a1, a2, (void *)a3, a4);
 		case SYS_ipc_recv:
-			return sys_ipc_recv((void *)a1);
+			return sys_ipc_recv((void *)a1, a2);
 		case SYS_env_set_priority:
 			return sys_env_set_priority(a1, a2);
 		case SYS_env_set_trapframe:
@@ -481,6 +1108,36 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			return sys_netpacket_try_send((void *)a1, (size_t)a2);
 		case SYS_netpacket_recv:
 			return sys_netpacket_recv((void *)a1, (size_t)a2);
+		case SYS_netpacket_try_sendv:
+			return sys_netpacket_try_sendv((const struct NetFrag *)a1, a2);
+		case SYS_netpacket_tx_reclaim:
+			return sys_netpacket_tx_reclaim();
+		case SYS_netpacket_recv_page:
+			return sys_netpacket_recv_page((void *)a1);
+		case SYS_netpacket_wait:
+			return sys_netpacket_wait(a1, a2);
+		case SYS_netpacket_recv_batch:
+			return sys_netpacket_recv_batch((void *)a1, a2);
+		case SYS_netpacket_send_batch:
+			return sys_netpacket_send_batch((const struct NetFrag *)a1, a2);
+		case SYS_net_bypass:
+			return sys_net_bypass((void *)a1);
+		case SYS_net_bypass_push:
+			return sys_net_bypass_push(a1, a2);
+		case SYS_env_notify:
+			return sys_env_notify(a1);
+		case SYS_ipc_recv_from:
+			return sys_ipc_recv_from(a1, (void *)a2);
+		case SYS_page_map_batch:
+			return sys_page_map_batch((struct PageMapOp *)a1, a2);
+		case SYS_env_set_affinity:
+			return sys_env_set_affinity(a1, a2);
+		case SYS_futex_wait:
+			return sys_futex_wait((uint32_t *) a1, a2, a3);
+		case SYS_futex_wake:
+			return sys_futex_wake((uint32_t *) a1, a2);
+		case SYS_sleep_until:
+			return sys_sleep_until(a1);
 		default:
 			return -E_INVAL;
 	}
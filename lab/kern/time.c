@@ -1,26 +1,114 @@
-#include <kern/time.h>
+// Kernel clock, based on the TSC.
+//
+// time_init measures the TSC frequency against the 8254 PIT, whose
+// input clock is fixed, and publishes the result in the time page at
+// UTIME.  From then on the kernel and user environments turn a TSC
+// reading into nanoseconds since boot with timepage_nsec(), which needs
+// neither a system call nor a timer interrupt.  This assumes the TSCs
+// of all CPUs run at the same rate and were reset together.
+
+#include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/memlayout.h>
+#include <inc/time.h>
+#include <inc/env.h>
+
+#include <kern/time.h>
+#include <kern/pmap.h>
+
+// 8254 PIT.  Channel 2's gate and output are wired to the keyboard
+// controller's port B, so it can be polled without an interrupt.
+#define PIT_HZ		1193182
+#define PIT_CH2		0x42
+#define PIT_MODE	0x43
+#define PIT_PORTB	0x61
+#define	  PORTB_GATE2	  0x01		// Channel 2 counts
+#define	  PORTB_SPEAKER	  0x02		// Channel 2 drives the speaker
+#define	  PORTB_OUT2	  0x20		// Channel 2 output
+
+// Calibrate over this many milliseconds; longer is more precise.
+#define CALIBRATE_MS	10
 
-static unsigned int ticks;
+// Used if the PIT never counts down, e.g. on a machine without one.
+#define DEFAULT_TSC_KHZ	1000000
+
+static struct TimePage *timepage;
+
+// Measure the TSC frequency in kHz.  Returns 0 if the PIT does not
+// seem to work.
+static uint32_t
+calibrate_tsc(void)
+{
+	uint32_t count = PIT_HZ / 1000 * CALIBRATE_MS;
+	uint64_t start, end;
+	int i;
+
+	// Channel 2, mode 0 (output goes high at terminal count),
+	// binary, low then high byte of the count.
+	outb(PIT_PORTB, (inb(PIT_PORTB) & ~PORTB_SPEAKER) | PORTB_GATE2);
+	outb(PIT_MODE, 0xb0);
+	outb(PIT_CH2, count & 0xff);
+	outb(PIT_CH2, count >> 8);
+
+	start = read_tsc();
+	for (i = 0; !(inb(PIT_PORTB) & PORTB_OUT2); i++)
+		if (i == 10000000)
+			return 0;
+	end = read_tsc();
+	return (end - start) / CALIBRATE_MS;
+}
 
 void
 time_init(void)
 {
-	ticks = 0;
+	struct PageInfo *pp;
+	uint32_t khz;
+	uint64_t mult;
+
+	static_assert(UENVS + (NENV * sizeof(struct Env) + PGSIZE - 1) / PGSIZE * PGSIZE
+		      <= UTIME);
+
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		panic("time_init: out of memory");
+	if (page_insert(kern_pgdir, pp, (void *) UTIME, PTE_U) < 0)
+		panic("time_init: out of memory");
+	timepage = page2kva(pp);
+
+	if (!(khz = calibrate_tsc())) {
+		cprintf("time: cannot calibrate TSC, assuming %u kHz\n",
+			DEFAULT_TSC_KHZ);
+		khz = DEFAULT_TSC_KHZ;
+	}
+
+	// Pick the largest shift that keeps the multiplier in 32 bits;
+	// ns per cycle = 10^6 / khz.
+	timepage->tp_shift = 32;
+	while ((mult = (1000000ULL << timepage->tp_shift) / khz) > 0xffffffff)
+		timepage->tp_shift--;
+	timepage->tp_mult = mult;
+	timepage->tp_tsc_khz = khz;
+	timepage->tp_tsc_base = read_tsc();
+
+	cprintf("time: TSC runs at %u.%03u MHz\n", khz / 1000, khz % 1000);
+}
+
+// Nanoseconds since time_init.
+uint64_t
+time_nsec(void)
+{
+	return timepage_nsec(timepage, read_tsc());
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
-void
-time_tick(void)
+// TSC cycles per millisecond.
+uint32_t
+time_tsc_khz(void)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	return timepage->tp_tsc_khz;
 }
 
+// Milliseconds since time_init.
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return time_nsec() / 1000000;
 }
@@ -4,8 +4,11 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 void time_init(void);
-void time_tick(void);
+uint64_t time_nsec(void);
 unsigned int time_msec(void);
+uint32_t time_tsc_khz(void);
 
 #endif /* JOS_KERN_TIME_H */
@@ -0,0 +1,226 @@
+// Kernel timer wheel.
+//
+// Pending timers hang off a hierarchy of wheels, indexed by their expiry
+// time in milliseconds.  The first wheel has one slot for each of the
+// next TVR_SIZE milliseconds.  Each further wheel has TVN_SIZE slots,
+// each covering a whole turn of the wheel below it.  Adding and
+// removing a timer takes constant time.  Whenever the first wheel comes
+// round to slot 0, the timers in the current slot of the second wheel
+// are moved down ("cascaded"), and so on up the levels.
+//
+// The LAPIC timer is one-shot (see kern/sched.c), so nothing calls
+// timer_run once per millisecond.  It catches up on all the
+// milliseconds since its last call whenever it does run.  After a long
+// quiet stretch it rebuilds the wheels instead, which is cheaper than
+// stepping through every millisecond.
+
+#include <inc/assert.h>
+
+#include <kern/timer.h>
+#include <kern/time.h>
+
+#define TVR_BITS	8
+#define TVN_BITS	6
+#define TVR_SIZE	(1 << TVR_BITS)
+#define TVN_SIZE	(1 << TVN_BITS)
+#define TVR_MASK	(TVR_SIZE - 1)
+#define TVN_MASK	(TVN_SIZE - 1)
+#define TVN_LEVELS	3
+
+// Timers further out than this go in the last slot they can reach and
+// are cascaded down as time passes (about 18 hours).
+#define TIMER_MAXDELTA	((1 << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1)
+
+static struct Timer *tv1[TVR_SIZE];
+static struct Timer *tvn[TVN_LEVELS][TVN_SIZE];
+static uint32_t timer_jiffies;		// Next millisecond to process
+static int ntimers;			// Timers pending
+
+// Index of 'expires' in wheel 'level' of tvn
+#define TVN_INDEX(expires, level) \
+	(((expires) >> (TVR_BITS + (level) * TVN_BITS)) & TVN_MASK)
+
+static void
+timer_link(struct Timer **slot, struct Timer *t)
+{
+	t->t_next = *slot;
+	if (t->t_next)
+		t->t_next->t_pprev = &t->t_next;
+	*slot = t;
+	t->t_pprev = slot;
+}
+
+static void
+timer_unlink(struct Timer *t)
+{
+	*t->t_pprev = t->t_next;
+	if (t->t_next)
+		t->t_next->t_pprev = t->t_pprev;
+	t->t_next = NULL;
+	t->t_pprev = NULL;
+}
+
+// Put t in the slot that matches its expiry time.
+static void
+timer_insert(struct Timer *t)
+{
+	uint32_t expires = t->t_expires;
+	int32_t delta = expires - timer_jiffies;
+	int level;
+
+	// Already due: run it at the next timer_run.
+	if (delta < 0) {
+		timer_link(&tv1[timer_jiffies & TVR_MASK], t);
+		return;
+	}
+	if (delta < TVR_SIZE) {
+		timer_link(&tv1[expires & TVR_MASK], t);
+		return;
+	}
+	if (delta > TIMER_MAXDELTA)
+		expires = timer_jiffies + TIMER_MAXDELTA;
+	for (level = 0; level < TVN_LEVELS - 1; level++)
+		if (delta < (1 << (TVR_BITS + (level + 1) * TVN_BITS)))
+			break;
+	timer_link(&tvn[level][TVN_INDEX(expires, level)], t);
+}
+
+//
+// Arrange for t->t_func(t->t_arg) to be called once the time is
+// 'expires' ms since boot or later.  If t is already pending, it is
+// moved to the new time.
+//
+void
+timer_add(struct Timer *t, uint32_t expires)
+{
+	timer_del(t);
+	// With no timers pending, timer_run does not keep timer_jiffies
+	// up to date.
+	if (ntimers == 0)
+		timer_jiffies = time_msec();
+	t->t_expires = expires;
+	timer_insert(t);
+	ntimers++;
+}
+
+//
+// Cancel t if it is pending.
+//
+void
+timer_del(struct Timer *t)
+{
+	if (!t->t_pprev)
+		return;
+	timer_unlink(t);
+	ntimers--;
+}
+
+// Move the timers in one slot of wheel 'level' down to lower wheels.
+// Returns the slot index.
+static int
+timer_cascade(int level)
+{
+	int index = TVN_INDEX(timer_jiffies, level);
+	struct Timer *t;
+
+	while ((t = tvn[level][index])) {
+		timer_unlink(t);
+		timer_insert(t);
+	}
+	return index;
+}
+
+// Re-insert every pending timer relative to 'now'.  Timers that are
+// overdue end up in the current slot.
+static void
+timer_rehash(uint32_t now)
+{
+	struct Timer *list = NULL, *t;
+	int i, level;
+
+	for (i = 0; i < TVR_SIZE; i++)
+		while ((t = tv1[i])) {
+			timer_unlink(t);
+			t->t_next = list;
+			list = t;
+		}
+	for (level = 0; level < TVN_LEVELS; level++)
+		for (i = 0; i < TVN_SIZE; i++)
+			while ((t = tvn[level][i])) {
+				timer_unlink(t);
+				t->t_next = list;
+				list = t;
+			}
+
+	timer_jiffies = now;
+	while ((t = list)) {
+		list = t->t_next;
+		timer_insert(t);
+	}
+}
+
+//
+// Call the functions of all timers that have expired.
+//
+void
+timer_run(void)
+{
+	uint32_t now = time_msec();
+	struct Timer *t;
+	int index, level;
+
+	if (ntimers > 0 && (int32_t) (now - timer_jiffies) >= TVR_SIZE)
+		timer_rehash(now);
+	while (ntimers > 0 && (int32_t) (now - timer_jiffies) >= 0) {
+		index = timer_jiffies & TVR_MASK;
+		for (level = 0; index == 0 && level < TVN_LEVELS; level++)
+			if (timer_cascade(level) != 0)
+				break;
+		while ((t = tv1[index])) {
+			timer_unlink(t);
+			ntimers--;
+			t->t_func(t->t_arg);
+		}
+		timer_jiffies++;
+	}
+}
+
+static uint32_t
+timer_earlier(uint32_t a, uint32_t b)
+{
+	if (a == TIMER_NEVER || (int32_t) (b - a) < 0)
+		return b;
+	return a;
+}
+
+//
+// Return the expiry time of the earliest pending timer, or TIMER_NEVER.
+//
+uint32_t
+timer_next(void)
+{
+	uint32_t next = TIMER_NEVER;
+	struct Timer *t;
+	int i, level;
+
+	if (ntimers == 0)
+		return TIMER_NEVER;
+
+	// The first non-empty slot of the first wheel holds the earliest
+	// timers there.  They all expire at the same time, except that
+	// overdue timers also sit in the current slot.
+	for (i = 0; i < TVR_SIZE; i++)
+		if ((t = tv1[(timer_jiffies + i) & TVR_MASK])) {
+			for (; t; t = t->t_next)
+				next = timer_earlier(next, t->t_expires);
+			break;
+		}
+
+	// The higher wheels are not sorted by slot, so look at all of
+	// their timers.  There are few of them.
+	for (level = 0; level < TVN_LEVELS; level++)
+		for (i = 0; i < TVN_SIZE; i++)
+			for (t = tvn[level][i]; t; t = t->t_next)
+				next = timer_earlier(next, t->t_expires);
+	return next;
+}
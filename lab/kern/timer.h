@@ -0,0 +1,27 @@
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// timer_next() when no timer is pending
+#define TIMER_NEVER	((uint32_t) ~0)
+
+// A kernel timeout.  When the clock (time_msec) reaches t_expires,
+// timer_run calls t_func(t_arg), with the big kernel lock held.
+struct Timer {
+	uint32_t t_expires;		// Expiry time, in ms since boot
+	void (*t_func)(void *arg);
+	void *t_arg;
+	struct Timer *t_next;		// Links in a wheel slot
+	struct Timer **t_pprev;		//   (t_pprev == NULL: not pending)
+};
+
+void	timer_add(struct Timer *t, uint32_t expires);
+void	timer_del(struct Timer *t);
+void	timer_run(void);
+uint32_t timer_next(void);
+
+#endif	// !JOS_KERN_TIMER_H
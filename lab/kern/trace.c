@@ -0,0 +1,156 @@
+// Kernel event tracing.
+//
+// Each CPU appends timestamped events to its own ring, which keeps the
+// latest TRACE_NEVENTS of them.  Only the CPU itself writes its ring,
+// with interrupts disabled, so recording takes no lock and costs a
+// rdtsc and a few stores.  The kind of events recorded are chosen at
+// run time with trace_mask (the monitor's 'trace' command).
+//
+// trace_dump merges the rings in timestamp order.  Following the envs
+// on the TRACE_IPC_SEND and TRACE_ENV_RUN lines shows how long a
+// request took to get from a client to a server and back.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+#include <inc/time.h>
+
+#include <kern/trace.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/time.h>
+
+#define TRACE_NEVENTS	2048		// Events kept per CPU
+
+struct TraceCpu {
+	uint32_t tc_n;			// Events recorded since trace_clear
+	struct TraceEvent tc_events[TRACE_NEVENTS];
+};
+
+static const char * const trace_names[NTRACE] = {
+	[TRACE_SYSCALL] = "syscall",
+	[TRACE_SYSRET] = "sysret",
+	[TRACE_ENV_RUN] = "run",
+	[TRACE_IPC_SEND] = "send",
+	[TRACE_IPC_RECV] = "recv",
+	[TRACE_PGFAULT] = "pgfault",
+	[TRACE_IRQ] = "irq",
+};
+
+uint32_t trace_mask;
+static struct TraceCpu trace_cpus[NCPU];
+
+void
+trace_record(int type, uint32_t a, uint32_t b)
+{
+	struct TraceCpu *tc = &trace_cpus[cpunum()];
+	struct TraceEvent *te = &tc->tc_events[tc->tc_n++ % TRACE_NEVENTS];
+
+	te->te_tsc = read_tsc();
+	te->te_type = type;
+	te->te_cpu = cpunum();
+	te->te_env = curenv ? curenv->env_id : 0;
+	te->te_a = a;
+	te->te_b = b;
+}
+
+// Return the TRACE_* type called 'name', or -1.
+int
+trace_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NTRACE; i++)
+		if (strcmp(name, trace_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+void
+trace_clear(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		trace_cpus[i].tc_n = 0;
+}
+
+// Index of CPU i's oldest event still in its ring.
+static uint32_t
+trace_first(int i)
+{
+	uint32_t n = trace_cpus[i].tc_n;
+
+	return n > TRACE_NEVENTS ? n - TRACE_NEVENTS : 0;
+}
+
+// Return the oldest event not yet visited across all CPUs, advancing
+// the per-CPU positions in 'next', or NULL if there are none left.
+static struct TraceEvent *
+trace_next(uint32_t *next)
+{
+	struct TraceEvent *te, *best = NULL;
+	int i, besti = 0;
+
+	for (i = 0; i < ncpu; i++) {
+		if (next[i] == trace_cpus[i].tc_n)
+			continue;
+		te = &trace_cpus[i].tc_events[next[i] % TRACE_NEVENTS];
+		if (!best || te->te_tsc < best->te_tsc) {
+			best = te;
+			besti = i;
+		}
+	}
+	if (best)
+		next[besti]++;
+	return best;
+}
+
+// Print the last n events (all of them if n <= 0), oldest first, with
+// times in microseconds since boot.
+void
+trace_dump(int n)
+{
+	const struct TimePage *tp = (const struct TimePage *) UTIME;
+	uint32_t next[NCPU], total = 0;
+	struct TraceEvent *te;
+	uint64_t us;
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		next[i] = trace_first(i);
+		total += trace_cpus[i].tc_n - next[i];
+	}
+	for (; n > 0 && total > n; total--)
+		trace_next(next);
+
+	while ((te = trace_next(next))) {
+		us = timepage_nsec(tp, te->te_tsc) / 1000;
+		cprintf("%10llu.%03llu %d %08x %-8s %08x %08x\n",
+			us / 1000, us % 1000, te->te_cpu, te->te_env,
+			trace_names[te->te_type], te->te_a, te->te_b);
+	}
+}
+
+// Print every event as a line of hex, the bytes of its struct
+// TraceEvent in memory order, between marker lines.  On the host,
+// 'sed -n "/^trace-begin/,/^trace-end/p" | grep -v trace- | xxd -r -p'
+// turns the output back into an array of struct TraceEvent.
+void
+trace_dump_raw(void)
+{
+	uint32_t next[NCPU];
+	struct TraceEvent *te;
+	uint8_t *p;
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		next[i] = trace_first(i);
+	cprintf("trace-begin %u %u\n", sizeof(struct TraceEvent), time_tsc_khz());
+	while ((te = trace_next(next))) {
+		for (p = (uint8_t *) te, i = 0; i < sizeof(*te); i++)
+			cprintf("%02x", p[i]);
+		cprintf("\n");
+	}
+	cprintf("trace-end\n");
+}
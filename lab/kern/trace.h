@@ -0,0 +1,50 @@
+#ifndef JOS_KERN_TRACE_H
+#define JOS_KERN_TRACE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Kinds of trace event, and what te_a and te_b hold for each
+enum {
+	TRACE_SYSCALL,		// System call entry: number, first argument
+	TRACE_SYSRET,		// System call return: number, return value
+	TRACE_ENV_RUN,		// Context switch: new env, previous env or 0
+	TRACE_IPC_SEND,		// IPC delivered: receiver, value
+	TRACE_IPC_RECV,		// Blocked in sys_ipc_recv: dstva, deadline
+	TRACE_PGFAULT,		// User page fault: fault va, eip
+	TRACE_IRQ,		// Interrupt: IRQ number, interrupted eip
+	NTRACE
+};
+
+// One event.  'trace raw' dumps these as they are in memory, in hex,
+// so the layout is part of the interface: all fields little-endian,
+// 24 bytes per event.
+struct TraceEvent {
+	uint64_t te_tsc;	// TSC when recorded
+	uint16_t te_type;	// TRACE_*
+	uint16_t te_cpu;	// CPU that recorded it
+	uint32_t te_env;	// curenv's env_id on that CPU, or 0
+	uint32_t te_a;
+	uint32_t te_b;
+};
+
+// Bit (1 << type) is set for each kind of event being recorded
+extern uint32_t trace_mask;
+
+void	trace_record(int type, uint32_t a, uint32_t b);
+int	trace_parse(const char *name);
+void	trace_clear(void);
+void	trace_dump(int n);
+void	trace_dump_raw(void);
+
+// Record an event if events of its type are switched on.
+static inline void
+trace(int type, uint32_t a, uint32_t b)
+{
+	if (trace_mask & (1 << type))
+		trace_record(type, a, b);
+}
+
+#endif	// !JOS_KERN_TRACE_H
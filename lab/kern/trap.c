@@ -9,11 +9,15 @@
 #include <kern/env.h>
 #include <kern/syscall.h>
 #include <kern/sched.h>
+#include <kern/prof.h>
+#include <kern/trace.h>
+#include <kern/timer.h>
 #include <kern/kclock.h>
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/e1000.h>
 
 static struct Taskstate ts;
 
@@ -65,6 +69,7 @@ void irq12_entry();
 void irq13_entry();
 void irq14_entry();
 void irq15_entry();
+void resched_entry();
 void syscall_entry();
 
 static const char *trapname(int trapno)
@@ -98,6 +103,8 @@ static const char *trapname(int trapno)
 		return "System call";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
+	if (trapno == IRQ_OFFSET + IRQ_RESCHED)
+		return "Reschedule IPI";
 	return "(unknown trap)";
 }
 
@@ -210,16 +217,23 @@ static void
 trap_dispatch(struct Trapframe *tf)
 {
 	int32_t ret_code;
+
+	if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno != T_SYSCALL)
+		trace(TRACE_IRQ, tf->tf_trapno - IRQ_OFFSET, tf->tf_eip);
+
 	// Handle processor exceptions.
 	// LAB 3: Your code here.
 	switch (tf->tf_trapno) {
 		case T_PGFLT:
+			trace(TRACE_PGFAULT, rcr2(), tf->tf_eip);
 			page_fault_handler(tf);
 			return;
 		case T_BRKPT:
 			monitor(tf);
 			return;
 		case T_SYSCALL:
+			curenv->env_syscalls++;
+			trace(TRACE_SYSCALL, tf->tf_regs.reg_eax, tf->tf_regs.reg_edx);
 			ret_code = syscall(
 				tf->tf_regs.reg_eax,
 				tf->tf_regs.reg_edx,
@@ -227,6 +241,8 @@ trap_dispatch(struct Trapframe *tf)
 				tf->tf_regs.reg_ebx,
 				tf->tf_regs.reg_edi,
 				tf->tf_regs.reg_esi);
+			// Blocking calls return through env_run instead
+			trace(TRACE_SYSRET, tf->tf_regs.reg_eax, ret_code);
 			tf->tf_regs.reg_eax = ret_code;
 		       	return;	
 	}
@@ -245,11 +261,25 @@ trap_dispatch(struct Trapframe *tf)
 	// LAB 4: Your code here.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 		lapic_eoi();
-		time_tick();
+		timer_run();
 		sched_yield();
 		return;
 	}
 
+	// Another CPU made an environment runnable while we were
+	// halted.  trap() finds no current environment and calls the
+	// scheduler; if we were running one after all, it just resumes.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED) {
+		lapic_eoi();
+		return;
+	}
+
+	// Network card interrupts
+	if (e1000_irq >= 0 && tf->tf_trapno == IRQ_OFFSET + e1000_irq) {
+		e1000_intr();
+		return;
+	}
+
 	// Add time tick increment to clock interrupts.
 	// Be careful! In multiprocessors, clock interrupts are
 	// triggered on every CPU.
@@ -287,6 +317,11 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// Profiler samples are taken before the kernel lock, to see
+	// who holds it.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER)
+		prof_tick(tf);
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -303,6 +338,7 @@ trap(struct Trapframe *tf)
 		// LAB 4: Your code here.
 		lock_kernel();
 		assert(curenv);
+		sched_account();
 		
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
@@ -2,6 +2,7 @@
 
 #include <inc/string.h>
 #include <inc/lib.h>
+#include <inc/loader.h>
 
 // PTE_COW marks copy-on-write page table entries.
 // It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
@@ -34,18 +35,22 @@ pgfault(struct UTrapframe *utf)
 	//   You should make three system calls.
 
 	// LAB 4: Your code here.
-	envid_t envid = sys_getenvid();
-	if ((r = sys_page_alloc(envid, (void *)PFTEMP, PTE_P | PTE_W | PTE_U)) < 0)
+	struct PageMapOp ops[2];
+
+	if ((r = sys_page_alloc(0, (void *)PFTEMP, PTE_P | PTE_W | PTE_U)) < 0)
 		panic("pgfault: page allocation failed %e", r);
 
 	addr = ROUNDDOWN(addr, PGSIZE);
 	memmove(PFTEMP, addr, PGSIZE);
-	if ((r = sys_page_unmap(envid, addr)) < 0)
-		panic("pgfault: page unmap failed %e", r);
-	if ((r = sys_page_map(envid, PFTEMP, envid, addr, PTE_P | PTE_W |PTE_U)) < 0)
+
+	// Move the copy over the old page and drop the temporary mapping
+	// in one system call.  Mapping over addr replaces the old page.
+	// Keep malloc's PTE_CONTINUED mark on the copy.
+	ops[0] = (struct PageMapOp) { PGMAP_MAP, PFTEMP, 0, addr,
+		PTE_P | PTE_W | PTE_U | (uvpt[PGNUM(addr)] & PTE_CONTINUED), 1 };
+	ops[1] = (struct PageMapOp) { PGMAP_UNMAP, 0, 0, PFTEMP, 0, 1 };
+	if ((r = sys_page_map_batch(ops, 2)) < 0)
 		panic("pgfault: page map failed %e", r);
-	if ((r = sys_page_unmap(envid, PFTEMP)) < 0)
-		panic("pgfault: page unmap failed %e", r);
 	//panic("pgfault not implemented");
 }
 
@@ -57,11 +62,14 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
+// The mappings are queued in 'b' and take effect when it is flushed,
+// so fork pays one system call per batch rather than two per page.
+//
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
 static int
-duppage(envid_t envid, unsigned pn)
+duppage(struct PageMapBatch *b, envid_t envid, unsigned pn)
 {
 	int r;
 	
@@ -73,21 +81,21 @@ duppage(envid_t envid, unsigned pn)
 	addr = (void *)((uint32_t)pn * PGSIZE);
 	pte = uvpt[pn];
 	if (pte & PTE_SHARE) {
-		if ((r = sys_page_map(sys_getenvid(), addr, envid, addr, pte & PTE_SYSCALL)) < 0) {
+		if ((r = pgmap_add(b, PGMAP_MAP, addr, envid, addr, pte & PTE_SYSCALL, 1)) < 0) {
 			panic("duppage: page mapping failed %e", r);
 			return r;
 		}
 	}
 	else {
-		perm = PTE_P | PTE_U;
+		perm = PTE_P | PTE_U | (pte & PTE_CONTINUED);
 		if ((pte & PTE_W) || (pte & PTE_COW)) 
 			perm |= PTE_COW;
-		if ((r = sys_page_map(thisenv->env_id, addr, envid, addr, perm)) < 0) {
+		if ((r = pgmap_add(b, PGMAP_MAP, addr, envid, addr, perm, 1)) < 0) {
 			panic("duppage: page remapping failed %e", r);
 			return r;
 		}
 		if (perm & PTE_COW) {
-			if ((r = sys_page_map(thisenv->env_id, addr, thisenv->env_id, addr, perm)) < 0) {
+			if ((r = pgmap_add(b, PGMAP_MAP, addr, 0, addr, perm, 1)) < 0) {
 				panic("duppage: page remapping failed %e", r);
 				return r;
 			}
@@ -99,6 +107,24 @@ duppage(envid_t envid, unsigned pn)
 	return 0;
 }
 
+//
+// If our program is paged in on demand, give the child the loader's
+// segment table and program file too: they live below UTEXT, so the
+// loops in fork and sfork do not copy them.  The loader's request page
+// is per-environment and gets allocated again on first use.
+//
+static int
+duploader(struct PageMapBatch *b, envid_t envid)
+{
+	int r;
+
+	if (!loader_active())
+		return 0;
+	if ((r = pgmap_add(b, PGMAP_MAP, (void *) ULOADINFO, envid, (void *) ULOADINFO, PTE_P | PTE_U, 1)) < 0)
+		return r;
+	return pgmap_add(b, PGMAP_MAP, (void *) ULOADFD, envid, (void *) ULOADFD, uvpt[PGNUM(ULOADFD)] & PTE_SYSCALL, 1);
+}
+
 //
 // User-level fork with copy-on-write.
 // Set up our page fault handler appropriately.
@@ -122,6 +148,7 @@ fork(void)
 	envid_t envid;
 	uint32_t addr;
 	int i, j, pn, r;
+	struct PageMapBatch batch;
 	extern void _pgfault_upcall(void);
 
 	set_pgfault_handler(pgfault);
@@ -134,6 +161,7 @@ fork(void)
 		return 0;
 	}
 
+	pgmap_init(&batch);
 	for (i = PDX(UTEXT); i < PDX(UXSTACKTOP); i++) {
 		if (uvpd[i] & PTE_P) {
 			for (j = 0; j < NPTENTRIES; j++) {
@@ -141,25 +169,19 @@ fork(void)
 				if (pn == PGNUM(UXSTACKTOP - PGSIZE))
 					break;
 				if (uvpt[pn] & PTE_P)
-					duppage(envid, pn);
+					duppage(&batch, envid, pn);
 			}
 		}
 	
 	}
 	
-	if ((r = sys_page_alloc(envid, (void *)(UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0) {
-		panic("fork: page alloc failed %e", r);
-		return r;
-	}
-	if ((r = sys_page_map(envid, (void *)(UXSTACKTOP - PGSIZE), thisenv->env_id, PFTEMP, PTE_P | PTE_U | PTE_W)) < 0) {
+	// The child gets a fresh, zeroed exception stack.
+	if ((r = duploader(&batch, envid)) < 0
+	    || (r = pgmap_add(&batch, PGMAP_ALLOC, 0, envid, (void *)(UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W, 1)) < 0
+	    || (r = pgmap_flush(&batch)) < 0) {
 		panic("fork: page map failed %e", r);
 		return r;
 	}
-	memmove((void *)(UXSTACKTOP - PGSIZE), PFTEMP, PGSIZE);
-	if ((r = sys_page_unmap(thisenv->env_id, PFTEMP)) < 0) {
-		panic("fork: page unmap failed %e", r);
-		return r;
-	}
 	sys_env_set_pgfault_upcall(envid, _pgfault_upcall);
 	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0) {
 		panic("fork: set child env status failed %e", r);
@@ -177,6 +199,7 @@ sfork(void)
 	envid_t envid;
 	uint32_t addr;
 	int i, j, pn, r;
+	struct PageMapBatch batch;
 	extern void _pgfault_upcall(void);
 
 	set_pgfault_handler(pgfault);
@@ -189,6 +212,7 @@ sfork(void)
 		return 0;
 	}
 
+	pgmap_init(&batch);
 	for (i = PDX(UTEXT); i < PDX(UXSTACKTOP); i++) {
 		if (uvpd[i] & PTE_P) {
 			for (j = 0; j < NPTENTRIES; j++) {
@@ -196,11 +220,11 @@ sfork(void)
 				if (pn == PGNUM(UXSTACKTOP - PGSIZE))
 					break;
 				if (pn == PGNUM(USTACKTOP - PGSIZE)) {
-					duppage(envid, pn);
+					duppage(&batch, envid, pn);
 					continue;
 				}
 				if (uvpt[pn] & PTE_P) {
-					if ((r = sys_page_map(thisenv->env_id, (void *)PGADDR(i, j, 0), envid, (void *)PGADDR(i, j, 0), uvpt[pn] & 0xFFF)) < 0) {
+					if ((r = pgmap_add(&batch, PGMAP_MAP, (void *)PGADDR(i, j, 0), envid, (void *)PGADDR(i, j, 0), uvpt[pn] & PTE_SYSCALL, 1)) < 0) {
 						panic("fork: page map failed %e", r);
 						return r;
 					}	
@@ -210,19 +234,12 @@ sfork(void)
 	
 	}
 	
-	if ((r = sys_page_alloc(envid, (void *)(UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0) {
-		panic("fork: page alloc failed %e", r);
-		return r;
-	}
-	if ((r = sys_page_map(envid, (void *)(UXSTACKTOP - PGSIZE), thisenv->env_id, PFTEMP, PTE_P | PTE_U | PTE_W)) < 0) {
+	if ((r = duploader(&batch, envid)) < 0
+	    || (r = pgmap_add(&batch, PGMAP_ALLOC, 0, envid, (void *)(UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W, 1)) < 0
+	    || (r = pgmap_flush(&batch)) < 0) {
 		panic("fork: page map failed %e", r);
 		return r;
 	}
-	memmove((void *)(UXSTACKTOP - PGSIZE), PFTEMP, PGSIZE);
-	if ((r = sys_page_unmap(thisenv->env_id, PFTEMP)) < 0) {
-		panic("fork: page unmap failed %e", r);
-		return r;
-	}
 	sys_env_set_pgfault_upcall(envid, _pgfault_upcall);
 	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0) {
 		panic("fork: set child env status failed %e", r);
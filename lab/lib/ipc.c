@@ -19,16 +19,33 @@
 //   If 'pg' is null, pass sys_ipc_recv a value that it will understand
 //   as meaning "no page".  (Zero is not the right value, since that's
 //   a perfectly valid place to map a page.)
+//
+// Notifications (see sys_env_notify) are not for ipc_recv's callers,
+// which expect a message: it goes on waiting through them.
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	int32_t r;
+
+	while ((r = ipc_recv_until(from_env_store, pg, perm_store, 0)) == -E_INTR)
+		/* wait for a message */;
+	return r;
+}
+
+// Like ipc_recv, but if 'deadline' is nonzero, give up and return
+// -E_TIMEOUT once sys_time_msec() reaches 'deadline'.  Returns -E_INTR
+// if the environment is notified meanwhile (see sys_env_notify).
+int32_t
+ipc_recv_until(envid_t *from_env_store, void *pg, int *perm_store,
+	       unsigned int deadline)
 {
 	// LAB 4: Your code here.
 	int r;
 
 	if (pg == NULL)
-		r = sys_ipc_recv((void *)UTOP);
+		r = sys_ipc_recv_until((void *)UTOP, deadline);
 	else
-		r = sys_ipc_recv(pg);
+		r = sys_ipc_recv_until(pg, deadline);
 	if (from_env_store != NULL)
 		*from_env_store = r < 0 ? 0 : thisenv->env_ipc_from;
 	if (perm_store != NULL)
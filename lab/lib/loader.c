@@ -0,0 +1,191 @@
+// Demand-paging loader for spawned programs.
+//
+// spawn() does not read the read-only segments of a program (its text
+// and rodata) into the child.  Instead it describes them in a struct
+// LoadInfo at ULOADINFO and points the child's page fault upcall at
+// this loader.  The first touch of such a page faults, and
+// loader_fault() asks the file server for the page (FSREQ_PAGEIN)
+// and maps it, so pages the program never uses are never read.
+//
+// The loader is linked at ULOADER and the kernel maps it read-only into
+// every environment.  It therefore has to be self-contained: it cannot
+// call into libjos, which sits at a different address in every program,
+// and it must not have any writable data.
+
+#include <inc/lib.h>
+#include <inc/loader.h>
+
+#define luvpt	((const volatile pte_t *) UVPT)
+#define luvpd	((const volatile pde_t *) (UVPT + (UVPT >> 12) * 4))
+
+static inline int32_t
+lsyscall(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	int32_t ret;
+
+	// Same calling convention as syscall() in lib/syscall.c.
+	asm volatile("int %1\n"
+		: "=a" (ret)
+		: "i" (T_SYSCALL),
+		  "a" (num),
+		  "d" (a1),
+		  "c" (a2),
+		  "b" (a3),
+		  "D" (a4),
+		  "S" (a5)
+		: "cc", "memory");
+	return ret;
+}
+
+static bool
+is_mapped(uintptr_t va)
+{
+	return (luvpd[PDX(va)] & PTE_P) && (luvpt[PGNUM(va)] & PTE_P);
+}
+
+static void
+lputs(const char *s)
+{
+	size_t n;
+
+	for (n = 0; s[n]; n++)
+		/* do nothing */;
+	lsyscall(SYS_cputs, (uint32_t) s, n, 0, 0, 0);
+}
+
+static void
+lputhex(uint32_t x)
+{
+	static const char digits[] = "0123456789abcdef";
+	char buf[9];
+	int i;
+
+	for (i = 7; i >= 0; i--, x >>= 4)
+		buf[i] = digits[x & 0xf];
+	buf[8] = 0;
+	lputs(buf);
+}
+
+// Kill the current environment after a fault the loader cannot resolve.
+static void __attribute__((noreturn))
+loader_die(const char *what, struct UTrapframe *utf)
+{
+	lputs("[");
+	lputhex(lsyscall(SYS_getenvid, 0, 0, 0, 0, 0));
+	lputs("] ");
+	lputs(what);
+	lputs(" va ");
+	lputhex(utf->utf_fault_va);
+	lputs(" ip ");
+	lputhex(utf->utf_eip);
+	lputs("\n");
+	lsyscall(SYS_env_destroy, 0, 0, 0, 0, 0);
+	for (;;)
+		/* not reached */;
+}
+
+// Send request 'type' in the page at ULOADBUF to the file server and
+// receive the page it returns, if any, at 'dstva'.
+// The fault may have hit anywhere in the program, even just after its
+// own sys_ipc_recv returned, so the reply is received with
+// sys_ipc_recv_from: that leaves the results of the program's receive
+// alone, and other senders keep retrying until the program receives
+// again.  A notification that interrupts the receive is passed on to
+// the program's next one.
+static int
+loader_fsipc(envid_t fsenv, int type, uintptr_t dstva)
+{
+	bool notified = 0;
+	int r;
+
+	while ((r = lsyscall(SYS_ipc_try_send, fsenv, type, ULOADBUF,
+			     PTE_P | PTE_W | PTE_U, 0)) == -E_IPC_NOT_RECV)
+		lsyscall(SYS_yield, 0, 0, 0, 0, 0);
+	if (r < 0)
+		return r;
+	while ((r = lsyscall(SYS_ipc_recv_from, fsenv, dstva,
+			     0, 0, 0)) == -E_INTR)
+		notified = 1;
+	if (r >= 0 && !is_mapped(dstva))
+		r = -E_INVAL;
+
+	if (notified)
+		lsyscall(SYS_env_notify, 0, 0, 0, 0, 0);
+	return r;
+}
+
+// Bring in the page at 'va' of segment 'ls'.
+static int
+load_page(const struct LoadInfo *li, const struct LoadSeg *ls, uintptr_t va)
+{
+	struct Fsreq_pagein *req = (struct Fsreq_pagein *) ULOADBUF;
+	uintptr_t fileend = ls->ls_va + ls->ls_filesz;
+	char *p;
+	int r;
+
+	// Pages entirely past the file data are just zero.
+	if (va >= fileend)
+		return lsyscall(SYS_page_alloc, 0, va, ls->ls_perm, 0, 0);
+
+	// The request page is not shared with fork children, so
+	// allocate it the first time this environment needs it.
+	if (!is_mapped(ULOADBUF)
+	    && (r = lsyscall(SYS_page_alloc, 0, ULOADBUF,
+			     PTE_P | PTE_W | PTE_U, 0, 0)) < 0)
+		return r;
+	req->req_fileid = li->li_fileid;
+	req->req_offset = ls->ls_offset + (va - ls->ls_va);
+
+	// Read-only pages that hold nothing but file data can be shared
+	// with every other environment running the same program.
+	// Otherwise ask for a copy of our own.
+	req->req_private = (ls->ls_perm & PTE_W)
+		|| fileend < MIN(va + PGSIZE, ls->ls_va + ls->ls_memsz);
+	if ((r = loader_fsipc(li->li_fsenv, FSREQ_PAGEIN, va)) < 0)
+		return r;
+	if (!req->req_private)
+		return 0;
+
+	// The page we got is our own writable copy: clear whatever
+	// follows the segment's file data, then drop the write
+	// permission if the segment does not have it.
+	for (p = (char *) MAX(fileend, va); p < (char *) va + PGSIZE; p++)
+		*p = 0;
+	if (!(ls->ls_perm & PTE_W))
+		return lsyscall(SYS_page_map, 0, va, 0, va, ls->ls_perm);
+	return 0;
+}
+
+// Resolve a fault on a page of a lazily loaded segment that has not
+// been brought in yet.  Returns 1 if the page is now mapped, 0 if the
+// fault has nothing to do with the loader.  Destroys the environment
+// if the page cannot be read.
+int
+loader_fault(struct UTrapframe *utf)
+{
+	const struct LoadInfo *li = (const struct LoadInfo *) ULOADINFO;
+	const struct LoadSeg *ls, *els;
+	uintptr_t va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+
+	if (!loader_active() || is_mapped(va))
+		return 0;
+	els = li->li_segs + MIN(li->li_nsegs, LOADINFO_MAXSEGS);
+	for (ls = li->li_segs; ls < els; ls++)
+		if (va >= ls->ls_va && va - ls->ls_va < ls->ls_memsz)
+			break;
+	if (ls == els)
+		return 0;
+	if (load_page(li, ls, va) < 0)
+		loader_die("loader: cannot page in", utf);
+	return 1;
+}
+
+// Called from loader_upcall when the loader is the environment's only
+// page fault handler, which is the case until the program installs its
+// own with set_pgfault_handler().
+void
+loader_handler(struct UTrapframe *utf)
+{
+	if (!loader_fault(utf))
+		loader_die("user fault", utf);
+}
@@ -2,30 +2,67 @@
 #include <inc/lib.h>
 
 /*
- * Simple malloc/free.
+ * Size-class malloc/free.
  *
- * Uses the address space to do most of the hard work.
- * The address space from mbegin to mend is scanned
- * in order.  Pages are allocated, used to fill successive
- * malloc requests, and then left alone.  Free decrements
- * a ref count maintained in the page; the page is freed
- * when the ref count hits zero.
+ * The heap lives between mbegin and mend.  Requests of up to
+ * SMALLMAX bytes are served from one of a few size classes.  Each
+ * class carves whole pages ("slab pages") into equal chunks; a small
+ * header at the start of the page holds the page's own free list and
+ * a count of chunks in use, and pages with free chunks are kept on a
+ * per-class list.  Freed chunks are reused right away, and a page that
+ * empties out is unmapped, except for one kept per class so that
+ * alternating malloc/free does not map and unmap the same page.
  *
- * If we need to allocate a large amount (more than a page)
- * we can't put a ref count at the end of each page,
- * so we mark the pte entry with the bit PTE_CONTINUED.
+ * Larger requests get whole pages of their own, which makes them
+ * page-aligned.  That alignment is how free tells them from small
+ * chunks, which never are.  As in the original JOS malloc, all but the
+ * last page of a large block are marked with PTE_CONTINUED so free can
+ * find its end.  Freed large blocks of up to LCACHEPAGES pages are kept
+ * mapped, and later requests of the same size reuse them.  lwIP's
+ * per-connection thread stacks are one such case.
+ *
+ * Fresh address space is handed out in order from mbegin.  Only when
+ * that runs out do we search the heap for an unmapped hole, probing
+ * uvpt a page at a time.  All pages of a large block are mapped with a
+ * single batched system call.
  */
 enum
 {
-	MAXMALLOC = 1024*1024	/* max size of one allocated chunk */
+	MAXMALLOC = 1024*1024,	/* max size of one allocated chunk */
+	SMALLMAX = 2040,	/* largest request served from a size class */
+	LCACHE = 16,		/* freed large blocks kept for reuse */
+	LCACHEPAGES = 8		/* largest block kept for reuse, in pages */
+};
+
+/* Header at the start of each slab page; chunks follow it. */
+struct mpage {
+	uint16_t mp_class;		/* index into sizes[] */
+	uint16_t mp_inuse;		/* chunks handed out */
+	void *mp_free;			/* free chunks, linked by first word */
+	struct mpage *mp_next;		/* pages of this class with free chunks */
+	struct mpage *mp_prev;
 };
 
-#define PTE_CONTINUED 0x200
+#define MPAGE_HDRSIZE	ROUNDUP(sizeof(struct mpage), 8)
+
+/* Chunk sizes: multiples of 8 chosen to waste little of a slab page. */
+static const uint16_t sizes[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 336, 504, 680, 1016, SMALLMAX
+};
+#define NSIZES	(sizeof(sizes) / sizeof(sizes[0]))
 
 static uint8_t *mbegin = (uint8_t*) 0x08000000;
 static uint8_t *mend   = (uint8_t*) 0x10000000;
 static uint8_t *mptr;
 
+static struct mpage *partial[NSIZES];	/* slab pages with free chunks */
+
+static struct lblock {
+	void *lb_va;
+	int lb_npages;
+} lcache[LCACHE];
+static int nlcache;
+
 static int
 isfree(void *v, size_t n)
 {
@@ -38,103 +75,181 @@ isfree(void *v, size_t n)
 	return 1;
 }
 
-void*
-malloc(size_t n)
+static void
+unmap_pages(void *v, int npages)
 {
-	int i, cont;
+	struct PageMapBatch b;
+
+	pgmap_init(&b);
+	pgmap_add(&b, PGMAP_UNMAP, 0, 0, v, 0, npages);
+	pgmap_flush(&b);
+}
+
+/*
+ * Find npages of unused heap address space and map fresh pages there.
+ * Returns NULL if out of address space or physical memory.
+ */
+static void *
+map_pages(int npages)
+{
+	struct PageMapBatch b;
+	size_t n = npages * PGSIZE;
+	uint8_t *v;
 	int nwrap;
-	uint32_t *ref;
-	void *v;
 
 	if (mptr == 0)
 		mptr = mbegin;
 
-	n = ROUNDUP(n, 4);
-
-	if (n >= MAXMALLOC)
-		return 0;
-
-	if ((uintptr_t) mptr % PGSIZE){
-		/*
-		 * we're in the middle of a partially
-		 * allocated page - can we add this chunk?
-		 * the +4 below is for the ref count.
-		 */
-		ref = (uint32_t*) (ROUNDUP(mptr, PGSIZE) - 4);
-		if ((uintptr_t) mptr / PGSIZE == (uintptr_t) (mptr + n - 1 + 4) / PGSIZE) {
-			(*ref)++;
-			v = mptr;
-			mptr += n;
-			return v;
-		}
-		/*
-		 * stop working on this page and move on.
-		 */
-		free(mptr);	/* drop reference to this page */
-		mptr = ROUNDDOWN(mptr + PGSIZE, PGSIZE);
-	}
-
-	/*
-	 * now we need to find some address space for this chunk.
-	 * if it's less than a page we leave it open for allocation.
-	 * runs of more than a page can't have ref counts so we
-	 * flag the PTE entries instead.
-	 */
 	nwrap = 0;
-	while (1) {
-		if (isfree(mptr, n + 4))
-			break;
+	while (!isfree(mptr, n)) {
 		mptr += PGSIZE;
-		if (mptr == mend) {
+		if (mptr + n > mend) {
 			mptr = mbegin;
 			if (++nwrap == 2)
 				return 0;	/* out of address space */
 		}
 	}
+	v = mptr;
+	mptr += n;
+
+	pgmap_init(&b);
+	if (npages > 1)
+		pgmap_add(&b, PGMAP_ALLOC, 0, 0, v, PTE_P|PTE_U|PTE_W|PTE_CONTINUED, npages - 1);
+	pgmap_add(&b, PGMAP_ALLOC, 0, 0, v + n - PGSIZE, PTE_P|PTE_U|PTE_W, 1);
+	if (pgmap_flush(&b) < 0) {
+		unmap_pages(v, npages);
+		return 0;	/* out of physical memory */
+	}
+	return v;
+}
+
+static void
+partial_push(struct mpage *p)
+{
+	p->mp_prev = 0;
+	p->mp_next = partial[p->mp_class];
+	if (p->mp_next)
+		p->mp_next->mp_prev = p;
+	partial[p->mp_class] = p;
+}
 
-	/*
-	 * allocate at mptr - the +4 makes sure we allocate a ref count.
-	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
+static void
+partial_remove(struct mpage *p)
+{
+	if (p->mp_prev)
+		p->mp_prev->mp_next = p->mp_next;
+	else
+		partial[p->mp_class] = p->mp_next;
+	if (p->mp_next)
+		p->mp_next->mp_prev = p->mp_prev;
+}
+
+static void *
+malloc_small(int c)
+{
+	struct mpage *p;
+	uint8_t *chunk;
+	void *v;
+
+	if (!(p = partial[c])) {
+		if (!(p = map_pages(1)))
+			return 0;
+		p->mp_class = c;
+		p->mp_inuse = 0;
+		p->mp_free = 0;
+		for (chunk = (uint8_t*) p + PGSIZE - sizes[c];
+		     chunk >= (uint8_t*) p + MPAGE_HDRSIZE; chunk -= sizes[c]) {
+			*(void**) chunk = p->mp_free;
+			p->mp_free = chunk;
 		}
+		partial_push(p);
 	}
 
-	ref = (uint32_t*) (mptr + i - 4);
-	*ref = 2;	/* reference for mptr, reference for returned block */
-	v = mptr;
-	mptr += n;
+	v = p->mp_free;
+	p->mp_free = *(void**) v;
+	p->mp_inuse++;
+	if (!p->mp_free)
+		partial_remove(p);
 	return v;
 }
 
-void
-free(void *v)
+static void
+free_small(void *v)
+{
+	struct mpage *p = ROUNDDOWN(v, PGSIZE);
+
+	assert(p->mp_class < NSIZES && p->mp_inuse > 0);
+	if (!p->mp_free)
+		partial_push(p);
+	*(void**) v = p->mp_free;
+	p->mp_free = v;
+
+	/* Unmap the page once it is empty, unless it is all we have. */
+	if (--p->mp_inuse == 0 && (p->mp_prev || p->mp_next)) {
+		partial_remove(p);
+		unmap_pages(p, 1);
+	}
+}
+
+static void *
+malloc_large(int npages)
 {
-	uint8_t *c;
-	uint32_t *ref;
+	int i;
+	void *v;
 
-	if (v == 0)
-		return;
-	assert(mbegin <= (uint8_t*) v && (uint8_t*) v < mend);
+	for (i = 0; i < nlcache; i++)
+		if (lcache[i].lb_npages == npages) {
+			v = lcache[i].lb_va;
+			lcache[i] = lcache[--nlcache];
+			return v;
+		}
+	return map_pages(npages);
+}
 
-	c = ROUNDDOWN(v, PGSIZE);
+static void
+free_large(void *v)
+{
+	uint8_t *c = v;
+	int npages = 1;
 
 	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
 		c += PGSIZE;
+		npages++;
 		assert(mbegin <= c && c < mend);
 	}
 
-	/*
-	 * c is just a piece of this page, so dec the ref count
-	 * and maybe free the page.
-	 */
-	ref = (uint32_t*) (c + PGSIZE - 4);
-	if (--(*ref) == 0)
-		sys_page_unmap(0, c);
+	if (npages <= LCACHEPAGES && nlcache < LCACHE) {
+		lcache[nlcache].lb_va = v;
+		lcache[nlcache].lb_npages = npages;
+		nlcache++;
+	} else
+		unmap_pages(v, npages);
+}
+
+void*
+malloc(size_t n)
+{
+	int c;
+
+	if (n >= MAXMALLOC)
+		return 0;
+	if (n > SMALLMAX)
+		return malloc_large(ROUNDUP(n, PGSIZE) / PGSIZE);
+
+	for (c = 0; sizes[c] < n; c++)
+		/* find the size class */;
+	return malloc_small(c);
 }
 
+void
+free(void *v)
+{
+	if (v == 0)
+		return;
+	assert(mbegin <= (uint8_t*) v && (uint8_t*) v < mend);
+
+	if (PGOFF(v) == 0)
+		free_large(v);
+	else
+		free_small(v);
+}
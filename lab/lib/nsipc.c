@@ -8,27 +8,39 @@
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
-// Send an IP request to the network server, and wait for a reply.
-// The request body should be in nsipcbuf, and parts of the response
-// may be written back to nsipcbuf.
-// type: request code, passed as the simple integer IPC value.
-// Returns 0 if successful, < 0 on failure.
-static int
-nsipc(unsigned type)
+static envid_t
+nsipc_env(void)
 {
 	static envid_t nsenv;
 	if (nsenv == 0)
 		nsenv = ipc_find_env(ENV_TYPE_NS);
+	return nsenv;
+}
 
-	static_assert(sizeof(nsipcbuf) == PGSIZE);
-
+// Send an IP request to the network server, and wait for a reply.
+// The request body should be in page pg, and parts of the response
+// may be written back to it.
+// type: request code, passed as the simple integer IPC value.
+// Returns 0 if successful, < 0 on failure.
+static int
+nsipc_page(unsigned type, void *pg)
+{
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+	ipc_send(nsipc_env(), type, pg, PTE_P|PTE_W|PTE_U);
 	return ipc_recv(NULL, NULL, NULL);
 }
 
+// Send a request whose body is in nsipcbuf.
+static int
+nsipc(unsigned type)
+{
+	static_assert(sizeof(nsipcbuf) == PGSIZE);
+
+	return nsipc_page(type, &nsipcbuf);
+}
+
 int
 nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
@@ -121,3 +133,20 @@ nsipc_socket(int domain, int type, int protocol)
 	nsipcbuf.socket.req_protocol = protocol;
 	return nsipc(NSREQ_SOCKET);
 }
+
+// Hand the network server the buffers of socket sb->sb_s.  sb must be
+// a page of its own, mapped PTE_SHARE so that children keep sharing it.
+int
+nsipc_sockbuf(struct Sockbuf *sb)
+{
+	static_assert(sizeof(struct Sockbuf) <= PGSIZE);
+
+	return nsipc_page(NSREQ_SOCKBUF, sb);
+}
+
+// Tell the network server there is work in a Sockbuf it waits on.
+void
+nsipc_notify(void)
+{
+	sys_env_notify(nsipc_env());
+}
@@ -5,6 +5,7 @@
 // function.
 
 #include <inc/lib.h>
+#include <inc/loader.h>
 
 
 // Assembly language pgfault entrypoint defined in lib/pfentry.S.
@@ -13,6 +14,10 @@ extern void _pgfault_upcall(void);
 // Pointer to currently installed C-language pgfault handler.
 void (*_pgfault_handler)(struct UTrapframe *utf);
 
+// The demand-paging loader's fault routine, if it manages part of our
+// address space; _pgfault_upcall tries it before _pgfault_handler.
+int (*_pgfault_loader)(struct UTrapframe *utf);
+
 //
 // Set the page fault handler function.
 // If there isn't one yet, _pgfault_handler will be 0.
@@ -31,6 +36,14 @@ set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
 		// LAB 4: Your code here.
 		if ((r = sys_page_alloc(thisenv->env_id, (void *)(UXSTACKTOP - PGSIZE), PTE_P | PTE_W | PTE_U)) < 0)
 			panic("set_pgfault_handler: %e", r);
+		// If our program is paged in on demand, the upcall must
+		// already be resident when the kernel jumps to it.
+		// Touching it now lets the loader, which is still our
+		// upcall, bring it in.
+		if (loader_active()) {
+			_pgfault_loader = loadervec->lv_fault;
+			(void) *(volatile uint8_t *) _pgfault_upcall;
+		}
 		sys_env_set_pgfault_upcall(thisenv->env_id, _pgfault_upcall);
 
 		//panic("set_pgfault_handler not implemented");
@@ -0,0 +1,117 @@
+// Batching of page mapping system calls.
+//
+// Callers queue page map, alloc and unmap operations in a PageMapBatch
+// and they are handed to the kernel in one sys_page_map_batch() call
+// when the batch fills up (PGMAP_BATCH operations or PGMAP_MAXPAGES
+// pages) or is flushed explicitly.
+
+#include <inc/lib.h>
+
+// Does the destination range of 'op' overlap [va, va + npages*PGSIZE)?
+static bool
+pgmap_overlaps(struct PageMapOp *op, void *va, int npages)
+{
+	return op->dstva < va + npages * PGSIZE
+		&& va < op->dstva + op->npages * PGSIZE;
+}
+
+// Can the operation be appended to the range already covered by 'op'?
+static bool
+pgmap_extends(struct PageMapOp *op, int type, void *srcva,
+	      envid_t dstenv, void *dstva, int perm)
+{
+	if (op->op != type || op->dstenv != dstenv || op->perm != perm)
+		return false;
+	if (op->dstva + op->npages * PGSIZE != dstva)
+		return false;
+	return (type != PGMAP_MAP && type != PGMAP_GET)
+		|| op->srcva + op->npages * PGSIZE == srcva;
+}
+
+void
+pgmap_init(struct PageMapBatch *b)
+{
+	b->n = 0;
+	b->npages = 0;
+}
+
+// Queue an operation on 'npages' consecutive pages.
+// Contiguous pages are merged into the last or second to last queued
+// operation, so callers that interleave two streams (like fork, which
+// maps each page into the child and then remaps it in the parent) still
+// end up with one operation per contiguous run.  Merging into the
+// second to last operation is skipped when the last one touches the
+// same pages, so the order of overlapping operations is preserved.
+//
+// Returns 0 on success, < 0 if flushing a full batch failed.
+static int
+pgmap_queue(struct PageMapBatch *b, int type, void *srcva,
+	    envid_t dstenv, void *dstva, int perm, int npages)
+{
+	struct PageMapOp *op;
+	int r;
+
+	if (b->n > 0 && pgmap_extends(&b->ops[b->n - 1], type, srcva,
+				      dstenv, dstva, perm)) {
+		b->ops[b->n - 1].npages += npages;
+		return 0;
+	}
+	if (b->n > 1 && pgmap_extends(&b->ops[b->n - 2], type, srcva,
+				      dstenv, dstva, perm)
+	    && !pgmap_overlaps(&b->ops[b->n - 1], dstva, npages)
+	    && (type != PGMAP_MAP || !pgmap_overlaps(&b->ops[b->n - 1], srcva, npages))) {
+		b->ops[b->n - 2].npages += npages;
+		return 0;
+	}
+
+	if (b->n == PGMAP_BATCH && (r = pgmap_flush(b)) < 0)
+		return r;
+	op = &b->ops[b->n++];
+	op->op = type;
+	op->srcva = srcva;
+	op->dstenv = dstenv;
+	op->dstva = dstva;
+	op->perm = perm;
+	op->npages = npages;
+	return 0;
+}
+
+// Queue an operation on 'npages' consecutive pages, splitting it so no
+// batch covers more than the kernel takes in one call.
+// Returns 0 on success, < 0 if flushing a full batch failed.
+int
+pgmap_add(struct PageMapBatch *b, int type, void *srcva,
+	  envid_t dstenv, void *dstva, int perm, int npages)
+{
+	int n, r;
+
+	while (npages > 0) {
+		n = MIN(npages, PGMAP_MAXPAGES);
+		if (b->npages + n > PGMAP_MAXPAGES
+		    && (r = pgmap_flush(b)) < 0)
+			return r;
+		if ((r = pgmap_queue(b, type, srcva, dstenv, dstva,
+				     perm, n)) < 0)
+			return r;
+		b->npages += n;
+		srcva += n * PGSIZE;
+		dstva += n * PGSIZE;
+		npages -= n;
+	}
+	return 0;
+}
+
+// Hand all queued operations to the kernel and empty the batch.
+// Returns 0 on success, < 0 on error.
+int
+pgmap_flush(struct PageMapBatch *b)
+{
+	int r;
+
+	if (b->n == 0)
+		return 0;
+	r = sys_page_map_batch(b->ops, b->n);
+	b->n = 0;
+	b->npages = 0;
+	return r;
+}
@@ -1,4 +1,5 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
@@ -19,9 +20,18 @@ struct Dev devpipe =
 
 #define PIPEBUFSIZ 32		// small to provoke races
 
+// How long a blocked reader or writer sleeps before checking again
+// whether the other end has gone away.  An end that closes wakes its
+// peers, but it can only do so before its mapping of the pipe is gone,
+// and an environment that is destroyed does not get to do even that.
+#define PIPE_RECHECK_MS	50
+
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	uint32_t p_rwait;	// a reader is (about to be) asleep on p_wpos
+	uint32_t p_wwait;	// a writer is (about to be) asleep on p_rpos
+	volatile uint32_t p_closed;	// the last fd of one end has been closed
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
@@ -31,21 +41,24 @@ pipe(int pfd[2])
 	int r;
 	struct Fd *fd0, *fd1;
 	void *va;
+	struct PageMapBatch batch;
 
 	// allocate the file descriptor table entries
 	if ((r = fd_alloc(&fd0)) < 0
 	    || (r = sys_page_alloc(0, fd0, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
 		goto err;
 
-	if ((r = fd_alloc(&fd1)) < 0
-	    || (r = sys_page_alloc(0, fd1, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+	if ((r = fd_alloc(&fd1)) < 0)
 		goto err1;
 
-	// allocate the pipe structure as first data page in both
+	// allocate the second fd page and the pipe structure, which is the
+	// first data page in both, with a single system call
 	va = fd2data(fd0);
-	if ((r = sys_page_alloc(0, va, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
-		goto err2;
-	if ((r = sys_page_map(0, va, 0, fd2data(fd1), PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+	pgmap_init(&batch);
+	pgmap_add(&batch, PGMAP_ALLOC, 0, 0, fd1, PTE_P|PTE_W|PTE_U|PTE_SHARE, 1);
+	pgmap_add(&batch, PGMAP_ALLOC, 0, 0, va, PTE_P|PTE_W|PTE_U|PTE_SHARE, 1);
+	pgmap_add(&batch, PGMAP_MAP, va, 0, fd2data(fd1), PTE_P|PTE_W|PTE_U|PTE_SHARE, 1);
+	if ((r = pgmap_flush(&batch)) < 0)
 		goto err3;
 
 	// set up fd structures
@@ -64,7 +77,6 @@ pipe(int pfd[2])
 
     err3:
 	sys_page_unmap(0, va);
-    err2:
 	sys_page_unmap(0, fd1);
     err1:
 	sys_page_unmap(0, fd0);
@@ -77,6 +89,8 @@ _pipeisclosed(struct Fd *fd, struct Pipe *p)
 {
 	int n, nn, ret;
 
+	if (p->p_closed)
+		return 1;
 	while (1) {
 		n = thisenv->env_runs;
 		ret = pageref(fd) == pageref(p);
@@ -101,6 +115,29 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Sleep until *pos moves on from 'pos0', the other end wakes us or
+// closes, or PIPE_RECHECK_MS pass.  *waiting tells the other end to
+// wake us; the xchg that sets it also orders it before the recheck of
+// *pos and p_closed, which pairs with the xchg in pipe_wakeup.
+static void
+pipe_sleep(struct Pipe *p, volatile off_t *pos, off_t pos0,
+	   volatile uint32_t *waiting)
+{
+	xchg(waiting, 1);
+	if (*pos == pos0 && !p->p_closed)
+		sys_futex_wait((const volatile uint32_t *) pos, pos0,
+			       sys_time_msec() + PIPE_RECHECK_MS);
+}
+
+// Wake anyone sleeping in pipe_sleep on *pos, which we have just
+// changed.  Costs a system call only if someone is waiting.
+static void
+pipe_wakeup(volatile off_t *pos, volatile uint32_t *waiting)
+{
+	if (xchg(waiting, 0))
+		sys_futex_wake((volatile uint32_t *) pos, NENV);
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
@@ -119,20 +156,23 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
-				return i;
+				goto out;
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer adds something
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read sleep\n");
+			pipe_sleep(p, &p->p_wpos, p->p_rpos, &p->p_rwait);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+out:
+	// there's room now; let any blocked writer go on
+	pipe_wakeup(&p->p_rpos, &p->p_wwait);
 	return i;
 }
 
@@ -157,10 +197,13 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let the readers drain what we wrote so far,
+			// and sleep until they do
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write sleep\n");
+			pipe_wakeup(&p->p_wpos, &p->p_rwait);
+			pipe_sleep(p, &p->p_rpos, p->p_wpos - sizeof(p->p_buf),
+				   &p->p_wwait);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -168,6 +211,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wakeup(&p->p_wpos, &p->p_rwait);
 	return i;
 }
 
@@ -185,7 +229,18 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+
+	// If this is the last fd of its end, say so before waking our
+	// peers, so that they see it at once rather than waiting for
+	// pageref to catch up with the unmaps.  Ends closed together
+	// may each miss being last; their peers then notice within
+	// PIPE_RECHECK_MS.
+	if (pageref(fd) == 1)
+		p->p_closed = 1;
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	pipe_wakeup(&p->p_wpos, &p->p_rwait);
+	pipe_wakeup(&p->p_rpos, &p->p_wwait);
+	return sys_page_unmap(0, p);
 }
 
@@ -1,3 +1,4 @@
+#include <inc/x86.h>
 #include <inc/lib.h>
 #include <lwip/sockets.h>
 
@@ -29,10 +30,15 @@ fd2sockid(int fd)
 	return sfd->fd_sock.sockid;
 }
 
+// Allocate a file descriptor for socket sockid.  The data of stream
+// sockets moves through buffers in its data page, which the network
+// server maps too; datagrams go one per nsipc request, so that they
+// keep their boundaries.
 static int
-alloc_sockfd(int sockid)
+alloc_sockfd(int sockid, int type)
 {
 	struct Fd *sfd;
+	struct Sockbuf *sb;
 	int r;
 
 	if ((r = fd_alloc(&sfd)) < 0
@@ -41,10 +47,26 @@ alloc_sockfd(int sockid)
 		return r;
 	}
 
+	sb = (struct Sockbuf *) fd2data(sfd);
+	if (type == SOCK_STREAM) {
+		if ((r = sys_page_alloc(0, sb, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			goto err;
+		sb->sb_s = sockid;
+		if ((r = nsipc_sockbuf(sb)) < 0)
+			goto err;
+	}
+
+	sfd->fd_sock.sockbuf = (type == SOCK_STREAM);
 	sfd->fd_dev_id = devsock.dev_id;
 	sfd->fd_omode = O_RDWR;
 	sfd->fd_sock.sockid = sockid;
 	return fd2num(sfd);
+
+err:
+	sys_page_unmap(0, sb);
+	sys_page_unmap(0, sfd);
+	nsipc_close(sockid);
+	return r;
 }
 
 int
@@ -55,7 +77,7 @@ accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 		return r;
 	if ((r = nsipc_accept(r, addr, addrlen)) < 0)
 		return r;
-	return alloc_sockfd(r);
+	return alloc_sockfd(r, SOCK_STREAM);
 }
 
 int
@@ -79,6 +101,10 @@ shutdown(int s, int how)
 static int
 devsock_close(struct Fd *fd)
 {
+	// The server keeps its own mapping of the buffers, and sends
+	// what is left in them before it closes the socket.
+	if (fd->fd_sock.sockbuf)
+		sys_page_unmap(0, fd2data(fd));
 	if (pageref(fd) == 1)
 		return nsipc_close(fd->fd_sock.sockid);
 	else
@@ -103,16 +129,81 @@ listen(int s, int backlog)
 	return nsipc_listen(r, backlog);
 }
 
+// Wake the server if it waits for the client to fill or drain a ring.
+// The xchg pairs with the one the server sets sb_srvwait with.
+static void
+sockbuf_wakeup(struct Sockbuf *sb)
+{
+	if (xchg(&sb->sb_srvwait, 0))
+		nsipc_notify();
+}
+
 static ssize_t
-devsock_read(struct Fd *fd, void *buf, size_t n)
+devsock_read(struct Fd *fd, void *vbuf, size_t n)
 {
-	return nsipc_recv(fd->fd_sock.sockid, buf, n, 0);
+	struct Sockbuf *sb = (struct Sockbuf *) fd2data(fd);
+	uint32_t rpos = sb->sb_rxrpos, off, m, c;
+	uint32_t done;
+
+	if (!fd->fd_sock.sockbuf)
+		return nsipc_recv(fd->fd_sock.sockid, vbuf, n, 0);
+
+	// Wait for data.  The server sets sb_rxdone after putting the
+	// last data in, so reading it first means sb_rxwpos is final.
+	for (;;) {
+		done = sb->sb_rxdone;
+		if (sb->sb_rxwpos != rpos)
+			break;
+		if (done)
+			return sb->sb_rxerr;
+		// The xchg orders the flag before the recheck,
+		// pairing with the one in the server.
+		xchg(&sb->sb_rxwait, 1);
+		if (sb->sb_rxwpos == rpos && !sb->sb_rxdone)
+			sys_futex_wait(&sb->sb_rxwpos, rpos, 0);
+	}
+
+	// Copy out what there is, in at most two pieces
+	m = MIN(n, sockbuf_used(sb->sb_rxwpos, rpos));
+	off = rpos % SOCKBUF_RINGSIZ;
+	c = MIN(m, SOCKBUF_RINGSIZ - off);
+	memmove(vbuf, &sb->sb_rxbuf[off], c);
+	memmove((char *) vbuf + c, sb->sb_rxbuf, m - c);
+	sb->sb_rxrpos = sockbuf_advance(rpos, m);
+	sockbuf_wakeup(sb);
+	return m;
 }
 
 static ssize_t
-devsock_write(struct Fd *fd, const void *buf, size_t n)
+devsock_write(struct Fd *fd, const void *vbuf, size_t n)
 {
-	return nsipc_send(fd->fd_sock.sockid, buf, n, 0);
+	struct Sockbuf *sb = (struct Sockbuf *) fd2data(fd);
+	uint32_t wpos = sb->sb_txwpos, rpos, off, m, c;
+	const char *buf = vbuf;
+	size_t i;
+
+	if (!fd->fd_sock.sockbuf)
+		return nsipc_send(fd->fd_sock.sockid, vbuf, n, 0);
+
+	for (i = 0; i < n; i += m) {
+		if (sb->sb_txerr)
+			return i ? i : sb->sb_txerr;
+		rpos = sb->sb_txrpos;
+		if ((m = MIN(n - i, SOCKBUF_RINGSIZ - sockbuf_used(wpos, rpos))) == 0) {
+			// Full: wait for the server to send some
+			xchg(&sb->sb_txwait, 1);
+			if (sb->sb_txrpos == rpos && !sb->sb_txerr)
+				sys_futex_wait(&sb->sb_txrpos, rpos, 0);
+			continue;
+		}
+		off = wpos % SOCKBUF_RINGSIZ;
+		c = MIN(m, SOCKBUF_RINGSIZ - off);
+		memmove(&sb->sb_txbuf[off], buf + i, c);
+		memmove(sb->sb_txbuf, buf + i + c, m - c);
+		sb->sb_txwpos = wpos = sockbuf_advance(wpos, m);
+		sockbuf_wakeup(sb);
+	}
+	return n;
 }
 
 static int
@@ -128,5 +219,5 @@ socket(int domain, int type, int protocol)
 	int r;
 	if ((r = nsipc_socket(domain, type, protocol)) < 0)
 		return r;
-	return alloc_sockfd(r);
+	return alloc_sockfd(r, type);
 }
@@ -1,15 +1,26 @@
 #include <inc/lib.h>
 #include <inc/elf.h>
+#include <inc/loader.h>
 
 #define UTEMP2USTACK(addr)	((void*) (addr) + (USTACKTOP - PGSIZE) - UTEMP)
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Number of pages map_segment stages at UTEMP per batch of file reads.
+#define UTEMPPAGES		32
+
+// Leave read-only segments (text and rodata) to be paged in on demand
+// by the loader (lib/loader.c) rather than reading them at spawn time.
+// Writable segments are always loaded eagerly, so the kernel never
+// finds a not-yet-loaded page behind a buffer passed to a system call.
+#define SPAWN_LAZY		1
+
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
 		       int fd, size_t filesz, off_t fileoffset, int perm);
 static int copy_shared_pages(envid_t child);
+static int setup_loader(envid_t child, int fd, struct LoadInfo *li);
 
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
@@ -27,6 +38,9 @@ spawn(const char *prog, const char **argv)
 	struct Elf *elf;
 	struct Proghdr *ph;
 	int perm;
+	bool lazy;
+	struct LoadInfo li;
+	struct LoadSeg *ls;
 
 	// This code follows this procedure:
 	//
@@ -111,6 +125,8 @@ spawn(const char *prog, const char **argv)
 		return r;
 
 	// Set up program segments as defined in ELF header.
+	lazy = SPAWN_LAZY && loader_present();
+	li.li_nsegs = 0;
 	ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
 	for (i = 0; i < elf->e_phnum; i++, ph++) {
 		if (ph->p_type != ELF_PROG_LOAD)
@@ -118,10 +134,21 @@ spawn(const char *prog, const char **argv)
 		perm = PTE_P | PTE_U;
 		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
 			perm |= PTE_W;
+		if (lazy && !(perm & PTE_W) && li.li_nsegs < LOADINFO_MAXSEGS) {
+			ls = &li.li_segs[li.li_nsegs++];
+			ls->ls_va = ROUNDDOWN(ph->p_va, PGSIZE);
+			ls->ls_memsz = ph->p_memsz + PGOFF(ph->p_va);
+			ls->ls_filesz = ph->p_filesz + PGOFF(ph->p_va);
+			ls->ls_offset = ph->p_offset - PGOFF(ph->p_va);
+			ls->ls_perm = perm;
+			continue;
+		}
 		if ((r = map_segment(child, ph->p_va, ph->p_memsz,
 				     fd, ph->p_filesz, ph->p_offset, perm)) < 0)
 			goto error;
 	}
+	if (li.li_nsegs > 0 && (r = setup_loader(child, fd, &li)) < 0)
+		goto error;
 	close(fd);
 	fd = -1;
 
@@ -189,6 +216,7 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 	int argc, i, r;
 	char *string_store;
 	uintptr_t *argv_store;
+	struct PageMapBatch batch;
 
 	// Count the number of arguments (argc)
 	// and the total amount of space needed for strings (string_size).
@@ -247,9 +275,10 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 
 	// After completing the stack, map it into the child's address space
 	// and unmap it from ours!
-	if ((r = sys_page_map(0, UTEMP, child, (void*) (USTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
-		goto error;
-	if ((r = sys_page_unmap(0, UTEMP)) < 0)
+	pgmap_init(&batch);
+	pgmap_add(&batch, PGMAP_MAP, UTEMP, child, (void*) (USTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W, 1);
+	pgmap_add(&batch, PGMAP_UNMAP, 0, 0, UTEMP, 0, 1);
+	if ((r = pgmap_flush(&batch)) < 0)
 		goto error;
 
 	return 0;
@@ -259,12 +288,17 @@ error:
 	return r;
 }
 
+// Map [va, va+memsz) of the child, filling the first filesz bytes
+// from fd at fileoffset and zeroing the rest.
+// File-backed pages are read UTEMPPAGES at a time into a window at
+// UTEMP and then moved into the child, so each window costs one
+// seek, one readn and a couple of batched page mapping calls.
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
-	void *blk;
+	int i, n, r;
+	struct PageMapBatch batch;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -275,25 +309,62 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
+	pgmap_init(&batch);
+	for (i = 0; i < memsz; i += n * PGSIZE) {
 		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
+			// allocate the remaining blank pages
+			n = ROUNDUP(memsz - i, PGSIZE) / PGSIZE;
+			if ((r = pgmap_add(&batch, PGMAP_ALLOC, 0, child, (void*) (va + i), perm, n)) < 0)
 				return r;
 		} else {
 			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			n = MIN(ROUNDUP(filesz - i, PGSIZE) / PGSIZE, UTEMPPAGES);
+			if ((r = pgmap_add(&batch, PGMAP_ALLOC, 0, 0, UTEMP, PTE_P|PTE_U|PTE_W, n)) < 0
+			    || (r = pgmap_flush(&batch)) < 0)
 				return r;
 			if ((r = seek(fd, fileoffset + i)) < 0)
 				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
+			if ((r = readn(fd, UTEMP, MIN(n * PGSIZE, filesz-i))) < 0)
 				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
+			pgmap_add(&batch, PGMAP_MAP, UTEMP, child, (void*) (va + i), perm, n);
+			pgmap_add(&batch, PGMAP_UNMAP, 0, 0, UTEMP, 0, n);
+			if ((r = pgmap_flush(&batch)) < 0)
 				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
 		}
 	}
-	return 0;
+	return pgmap_flush(&batch);
+}
+
+// Let the child page in the segments in 'li' on demand from the open
+// program file 'fd': give it the segment table at ULOADINFO and the
+// file's Fd page at ULOADFD, which keeps the file open for as long as
+// the child needs it, and make the loader its page fault upcall.
+static int
+setup_loader(envid_t child, int fd, struct LoadInfo *li)
+{
+	struct PageMapBatch batch;
+	struct Fd *fdp;
+	int r;
+
+	if ((r = fd_lookup(fd, &fdp)) < 0)
+		return r;
+	li->li_fsenv = ipc_find_env(ENV_TYPE_FS);
+	li->li_fileid = fdp->fd_file.id;
+
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	memmove(UTEMP, li, sizeof(*li));
+
+	pgmap_init(&batch);
+	pgmap_add(&batch, PGMAP_MAP, UTEMP, child, (void*) ULOADINFO, PTE_P|PTE_U, 1);
+	pgmap_add(&batch, PGMAP_UNMAP, 0, 0, UTEMP, 0, 1);
+	pgmap_add(&batch, PGMAP_MAP, fdp, child, (void*) ULOADFD, uvpt[PGNUM(fdp)] & PTE_SYSCALL, 1);
+	pgmap_add(&batch, PGMAP_ALLOC, 0, child, (void*) (UXSTACKTOP - PGSIZE), PTE_P|PTE_U|PTE_W, 1);
+	if ((r = pgmap_flush(&batch)) < 0) {
+		sys_page_unmap(0, UTEMP);
+		return r;
+	}
+	return sys_env_set_pgfault_upcall(child, loadervec->lv_upcall);
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -302,7 +373,9 @@ copy_shared_pages(envid_t child)
 {
 	// LAB 5: Your code here.
 	int i, j, pn, r;
+	struct PageMapBatch batch;
 
+	pgmap_init(&batch);
 	for (i = PDX(UTEXT); i < PDX(UXSTACKTOP); i++) {		
 		if (uvpd[i] & PTE_P) {
 			for (j = 0; j < NPTENTRIES; j++) {
@@ -310,12 +383,11 @@ copy_shared_pages(envid_t child)
 				if (pn == PGNUM(UXSTACKTOP - PGSIZE))
 					break;
 				if ((uvpt[pn] & PTE_P) && (uvpt[pn] & PTE_SHARE)) {
-					if ((r = sys_page_map(0, (void *)PGADDR(i, j, 0), child, (void *)PGADDR(i, j, 0), uvpt[pn] & PTE_SYSCALL)) < 0)
+					if ((r = pgmap_add(&batch, PGMAP_MAP, (void *)PGADDR(i, j, 0), child, (void *)PGADDR(i, j, 0), uvpt[pn] & PTE_SYSCALL, 1)) < 0)
 						return r;
 				}
 			}
 		}
 	}
-	return 0;
+	return pgmap_flush(&batch);
 }
-
@@ -117,10 +117,42 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_until(void *dstva, unsigned int deadline)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, deadline, 0, 0, 0);
+}
+
+int
+sys_sleep_until(unsigned int deadline)
+{
+	return syscall(SYS_sleep_until, 1, deadline, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, mask, 0, 0, 0);
+}
+
+int
+sys_futex_wait(const volatile uint32_t *addr, uint32_t val, unsigned int deadline)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, val, deadline, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+// Kept for compatibility: reads the time page like time_nsec()
+// instead of making the SYS_time_msec system call.
 unsigned int
 sys_time_msec(void)
 {
-	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
+	return time_nsec() / 1000000;
 }
 
 int
@@ -138,3 +170,69 @@ int sys_netpacket_recv(void *addr, size_t buflen)
 {
 	return syscall(SYS_netpacket_recv, 0, (uint32_t)addr, buflen, 0, 0, 0);
 }
+
+int
+sys_netpacket_try_sendv(const struct NetFrag *frags, int nfrags)
+{
+	return syscall(SYS_netpacket_try_sendv, 0, (uint32_t) frags, nfrags, 0, 0, 0);
+}
+
+int
+sys_netpacket_tx_reclaim(void)
+{
+	return syscall(SYS_netpacket_tx_reclaim, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_netpacket_recv_page(void *dstva)
+{
+	return syscall(SYS_netpacket_recv_page, 0, (uint32_t) dstva, 0, 0, 0, 0);
+}
+
+int
+sys_netpacket_wait(int what, unsigned int deadline)
+{
+	return syscall(SYS_netpacket_wait, 0, what, deadline, 0, 0, 0);
+}
+
+int
+sys_netpacket_recv_batch(void *dstva, int npages)
+{
+	return syscall(SYS_netpacket_recv_batch, 0, (uint32_t) dstva, npages, 0, 0, 0);
+}
+
+int
+sys_netpacket_send_batch(const struct NetFrag *frags, int nfrags)
+{
+	return syscall(SYS_netpacket_send_batch, 0, (uint32_t) frags, nfrags, 0, 0, 0);
+}
+
+int
+sys_net_bypass(void *va)
+{
+	return syscall(SYS_net_bypass, 1, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_net_bypass_push(uint32_t tdt, uint32_t rdt)
+{
+	return syscall(SYS_net_bypass_push, 0, tdt, rdt, 0, 0, 0);
+}
+
+int
+sys_env_notify(envid_t envid)
+{
+	return syscall(SYS_env_notify, 1, envid, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_recv_from(envid_t from, void *dstva)
+{
+	return syscall(SYS_ipc_recv_from, 0, from, (uint32_t) dstva, 0, 0, 0);
+}
+
+int
+sys_page_map_batch(struct PageMapOp *ops, int nops)
+{
+	return syscall(SYS_page_map_batch, 1, (uint32_t) ops, nops, 0, 0, 0);
+}
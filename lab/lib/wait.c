@@ -1,13 +1,21 @@
 #include <inc/lib.h>
 
 // Waits until 'envid' exits.
+// Only env_free wakes futex waiters on env_status, once the
+// environment is ENV_FREE; nothing wakes them as it exits or is
+// destroyed before that.  A status change between our read and
+// sys_futex_wait makes the call return at once, and we look again.
+// (Pipes do not rely on this: exit() closes an environment's pipe
+// ends, which wakes their peers, and the peers of one destroyed
+// without exiting notice within PIPE_RECHECK_MS.)
 void
 wait(envid_t envid)
 {
 	const volatile struct Env *e;
+	unsigned status;
 
 	assert(envid != 0);
 	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	while (e->env_id == envid && (status = e->env_status) != ENV_FREE)
+		sys_futex_wait(&e->env_status, status, 0);
 }
@@ -1,8 +1,34 @@
+#include <inc/x86.h>
+
 #include "ns.h"
 
 extern union Nsipc nsipcbuf;
 
-static struct jif_pkt *pkt = (struct jif_pkt *)REQVA;
+// Pages of received packets to take from the driver at once
+#define INPUT_BATCH	8
+
+static struct input_ring *ring = (struct input_ring *)INPUT_RINGVA;
+
+// Which of the server's INPUT_NBUF buffers hold a page
+static bool inbuf_used[INPUT_NBUF];
+
+// Address of ring slot i, in the input environment
+static void *
+input_slot(uint32_t i)
+{
+	return (void *)(INPUT_SLOTVA + (i % INPUT_RING_LEN) * PGSIZE);
+}
+
+// Set up the ring the input environment will share with the server.
+// Call before forking the input environment.
+void
+input_ring_init(void)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, ring, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("input_ring_init: %e", r);
+}
 
 void
 input(envid_t ns_envid)
@@ -15,25 +41,104 @@ input(envid_t ns_envid)
 	// Hint: When you IPC a page to the network server, it will be
 	// reading from it for a while, so don't immediately receive
 	// another packet in to the same physical page.
-	int i, r;
-	int32_t length;
-	struct jif_pkt *cpkt = pkt;
-	
-	for(i = 0; i < 10; i++)
-		if ((r = sys_page_alloc(0, (void*)((uintptr_t)pkt + i * PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
-			panic("sys_page_alloc: %e", r);
-	
-	i = 0;
+	//
+	// sys_netpacket_recv_batch maps the pages the card wrote frames
+	// into, short frames packed several to a page, already laid out
+	// as pages of packets, straight into free ring slots.  They are
+	// different pages each time, so a slot can be refilled as soon
+	// as the server has mapped its page.  The network server may
+	// write to the pages (to turn an ARP request into a reply, for
+	// one), so it gets them writable.
+	uint32_t head, room;
+	int n;
+
 	while(1) {
-		while((length = sys_netpacket_recv((void*)((uintptr_t)cpkt + sizeof(cpkt->jp_len)), PGSIZE - sizeof(cpkt->jp_len))) < 0) {
-			// cprintf("len: %d\n", length);
-			sys_yield();
+		head = ring->ir_head;
+		while ((room = INPUT_RING_LEN - (head - ring->ir_tail)) == 0) {
+			// The xchg orders the flag before the recheck,
+			// pairing with the one in input_take.
+			xchg(&ring->ir_inwait, 1);
+			if (ring->ir_tail == head - INPUT_RING_LEN)
+				sys_futex_wait(&ring->ir_tail,
+					       head - INPUT_RING_LEN, 0);
 		}
+		// Stop at the end of the ring: the pages go in one run
+		room = MIN(room, INPUT_RING_LEN - head % INPUT_RING_LEN);
+		while((n = sys_netpacket_recv_batch(input_slot(head),
+						    MIN(room, INPUT_BATCH))) <= 0)
+			sys_netpacket_wait(NETWAIT_RX, 0);
+
+		ring->ir_head = head + n;
+		if (xchg(&ring->ir_srvwait, 0))
+			sys_env_notify(ns_envid);
+	}
+}
+
+// Map up to npages pages from the ring into free buffers, in order,
+// storing their addresses in pages[].  Each stays the caller's until
+// it passes it to input_release.  Returns the number of pages taken,
+// which is 0 if the ring is empty or no buffer is free.  If mapping
+// fails (for want of memory, say), the pages stay in the ring for the
+// next call and this also returns 0.
+int
+input_take(envid_t input_envid, void **pages, int npages)
+{
+	struct PageMapOp ops[INPUT_RING_LEN];
+	uint32_t tail = ring->ir_tail;
+	int i, j, n, r;
+
+	n = MIN(ring->ir_head - tail, (uint32_t) MIN(npages, INPUT_RING_LEN));
+	for (i = j = 0; i < n; i++, j++) {
+		for (; j < INPUT_NBUF && inbuf_used[j]; j++)
+			/* find a free buffer */;
+		if (j == INPUT_NBUF)
+			break;
+		inbuf_used[j] = 1;
+		pages[i] = (void *)(INPUT_BUFVA + j * PGSIZE);
+		ops[i] = (struct PageMapOp) { PGMAP_GET, input_slot(tail + i),
+					      input_envid, pages[i],
+					      PTE_P|PTE_U|PTE_W, 1 };
+	}
+	if ((n = i) == 0)
+		return 0;
+	if ((r = sys_page_map_batch(ops, n)) < 0) {
+		for (i = 0; i < n; i++)
+			input_release(pages[i]);
+		return 0;
+	}
+
+	ring->ir_tail = tail + n;
+	if (xchg(&ring->ir_inwait, 0))
+		sys_futex_wake(&ring->ir_tail, 1);
+	return n;
+}
+
+// Give back a buffer input_take filled.
+void
+input_release(void *va)
+{
+	inbuf_used[((uint32_t)va - INPUT_BUFVA) / PGSIZE] = 0;
+	sys_page_unmap(0, va);
+}
+
+// Ask the input environment to notify us (see sys_env_notify) when it
+// next puts pages in the ring, before blocking in ipc_recv.  Returns
+// false if input_take would take pages already, so the caller should
+// not block after all.
+bool
+input_sleep(void)
+{
+	int j;
 
-		cpkt->jp_len = length;
-		ipc_send(ns_envid, NSREQ_INPUT, cpkt, PTE_P | PTE_U);
-		i = (i + 1) % 10;
-		cpkt = (struct jif_pkt*)((uintptr_t)pkt + i * PGSIZE);
-		sys_yield();
-	}	
+	// The xchg orders the flag before the check of ir_head, pairing
+	// with the one in input.
+	xchg(&ring->ir_srvwait, 1);
+	if (ring->ir_head == ring->ir_tail)
+		return true;
+	// Pages are waiting, but with every buffer held only
+	// input_release can make room for them
+	for (j = 0; j < INPUT_NBUF; j++)
+		if (!inbuf_used[j])
+			return false;
+	return true;
 }
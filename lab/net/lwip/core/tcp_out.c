@@ -599,6 +599,13 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   u16_t len;
   struct netif *netif;
 
+  /* The netif driver may still be sending this segment out of its pbuf
+     (see jif's low_level_output()); rewriting the headers now would
+     corrupt that copy.  Leave it to the retransmission timer. */
+  if (seg->p->ref != 1) {
+    return;
+  }
+
   /** @bug Exclude retransmitted segments from this count. */
   snmp_inc_tcpoutsegs();
 
@@ -60,6 +60,14 @@ typedef enum {
 
 /** indicates this packet's data should be immediately passed to the application */
 #define PBUF_FLAG_PUSH 0x01U
+/** indicates this is a custom pbuf: pbuf_free calls
+    pbuf_custom->custom_free_function instead of freeing it itself */
+#define PBUF_FLAG_IS_CUSTOM 0x02U
+/** set by the netif on a received packet whose IP header checksum
+    the hardware verified: ip_input skips checking it */
+#define PBUF_FLAG_CSUM_IP_OK 0x04U
+/** likewise for the TCP or UDP checksum, for unfragmented packets */
+#define PBUF_FLAG_CSUM_L4_OK 0x08U
 
 struct pbuf {
   /** next pbuf in singly linked pbuf chain */
@@ -95,6 +103,22 @@ struct pbuf {
   
 };
 
+#if LWIP_SUPPORT_CUSTOM_PBUF
+/** Prototype for a function to free a custom pbuf */
+typedef void (*pbuf_free_custom_fn)(struct pbuf *p);
+
+/** A custom pbuf: like a pbuf, but following a function pointer to free it. */
+struct pbuf_custom {
+  /** The actual pbuf */
+  struct pbuf pbuf;
+  /** This function is called when pbuf_free deallocates this pbuf(_custom) */
+  pbuf_free_custom_fn custom_free_function;
+  /** The memory the payload lies in; pbuf_header may move the payload
+      back as far as its start */
+  void *custom_mem;
+};
+#endif /* LWIP_SUPPORT_CUSTOM_PBUF */
+
 /* Initializes the pbuf module. This call is empty for now, but may not be in future. */
 #define pbuf_init()
 
@@ -110,6 +134,11 @@ void pbuf_chain(struct pbuf *head, struct pbuf *tail);
 struct pbuf *pbuf_dechain(struct pbuf *p);
 err_t pbuf_copy(struct pbuf *p_to, struct pbuf *p_from);
 u16_t pbuf_copy_partial(struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+#if LWIP_SUPPORT_CUSTOM_PBUF
+struct pbuf *pbuf_alloced_custom(pbuf_layer l, u16_t length, pbuf_type type,
+                                 struct pbuf_custom *p, void *payload_mem,
+                                 u16_t payload_mem_len);
+#endif /* LWIP_SUPPORT_CUSTOM_PBUF */
 
 #ifdef __cplusplus
 }
@@ -35,9 +35,12 @@ void
 thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
     uint32_t s = sys_time_msec();
     uint32_t p = s;
+    uint32_t d;
 
     cur_tc->tc_wait_addr = addr;
     cur_tc->tc_wakeup = 0;
+    cur_tc->tc_waiting = 1;
+    cur_tc->tc_wait_until = msec;
 
     while (p < msec) {
 	if (p < s)
@@ -47,12 +50,26 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 	if (cur_tc->tc_wakeup)
 	    break;
 
-	thread_yield();
+	// If no other thread can run before some deadline, nothing in
+	// this environment can change *addr until then either, so block
+	// in the kernel rather than spin through thread_yield.
+	d = thread_wakeup_deadline();
+	p = sys_time_msec();
+	if (d > p) {
+	    if (msec < d)
+		d = msec;
+	    if (addr)
+		sys_futex_wait(addr, val, d == (uint32_t) ~0 ? 0 : d);
+	    else
+		sys_sleep_until(d);
+	} else
+	    thread_yield();
 	p = sys_time_msec();
     }
 
     cur_tc->tc_wait_addr = 0;
     cur_tc->tc_wakeup = 0;
+    cur_tc->tc_waiting = 0;
 }
 
 int
@@ -68,6 +85,25 @@ thread_wakeups_pending(void)
     return n;
 }
 
+// Return the time (as from sys_time_msec) by which some other thread
+// needs to run: now if one is runnable or has been woken up, otherwise
+// the earliest thread_wait deadline.  Returns ~0 if all other threads
+// wait without a deadline.
+uint32_t
+thread_wakeup_deadline(void)
+{
+    struct thread_context *tc = thread_queue.tq_first;
+    uint32_t deadline = ~0;
+    while (tc) {
+	if (!tc->tc_waiting || tc->tc_wakeup)
+	    return sys_time_msec();
+	if (tc->tc_wait_until < deadline)
+	    deadline = tc->tc_wait_until;
+	tc = tc->tc_queue_link;
+    }
+    return deadline;
+}
+
 int
 thread_onhalt(void (*fun)(thread_id_t)) {
     if (cur_tc->tc_nonhalt >= THREAD_NUM_ONHALT)
@@ -25,6 +25,8 @@ struct thread_context {
     struct jos_jmp_buf	tc_jb;
     volatile uint32_t	*tc_wait_addr;
     volatile char	tc_wakeup;
+    char		tc_waiting;	// in thread_wait
+    uint32_t		tc_wait_until;	// thread_wait's deadline
     void		(*tc_onhalt[THREAD_NUM_ONHALT])(thread_id_t);
     int			tc_nonhalt;
     struct thread_context *tc_queue_link;
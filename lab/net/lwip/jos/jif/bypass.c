@@ -0,0 +1,232 @@
+/*
+ * Kernel-bypass e1000 driver.
+ *
+ * After sys_net_bypass, the network server drives the card itself
+ * through a pair of rings mapped into its address space (see
+ * <inc/e1000.h>), so that sending and receiving take one system call
+ * per batch rather than a page map per packet.  Outgoing packets are
+ * copied into the transmit buffers the kernel set aside and described
+ * in the transmit queue; sys_net_bypass_push copies the descriptors
+ * into the ring, pointed at those buffers.  Received frames are read
+ * where the card put them, and their descriptors go back to the card
+ * with one sys_net_bypass_push per batch.
+ */
+
+#include <inc/lib.h>
+#include <inc/e1000.h>
+
+#include <jif/jif.h>
+
+// Where the network server maps the card
+#define BYPASS_VA	0xE0000000
+
+static const struct NetBypass *info;
+static const volatile struct tx_desc *tx_ring;
+static const volatile struct rx_desc *rx_ring;
+static struct tx_desc *tx_queue;
+static uint8_t *tx_buf;
+static const uint8_t *rx_buf;
+
+// Descriptors tx_clean up to tx_tail are the card's; the buffer of
+// descriptor i is the i'th.  tx_ctx_iphlen is as in kern/e1000.c.
+static uint32_t tx_clean, tx_tail;
+static uint8_t tx_ctx_iphlen;
+// The next receive descriptor the card will fill, and the card's RDT
+static uint32_t rx_next, rx_tail = RXRING_LEN - 1;
+
+/*
+ * Take the card over from the kernel.  Returns 0 on success, or the
+ * error from sys_net_bypass.
+ */
+int
+bypass_attach(void)
+{
+    int r;
+
+    if ((r = sys_net_bypass((void *) BYPASS_VA)) < 0)
+	return r;
+    tx_ring = (const volatile struct tx_desc *) (BYPASS_VA + NB_TXRING);
+    rx_ring = (const volatile struct rx_desc *) (BYPASS_VA + NB_RXRING);
+    tx_queue = (struct tx_desc *) (BYPASS_VA + NB_TXQUEUE);
+    tx_buf = (uint8_t *) (BYPASS_VA + NB_TXBUF);
+    rx_buf = (const uint8_t *) (BYPASS_VA + NB_RXBUF);
+    info = (const struct NetBypass *) (BYPASS_VA + NB_INFO);
+    return 0;
+}
+
+int
+bypass_attached(void)
+{
+    return info != NULL;
+}
+
+/*
+ * Return the number of free transmit descriptors, after taking back
+ * the ones the card is done with.
+ */
+static uint32_t
+bypass_tx_room(void)
+{
+    while (tx_clean != tx_tail && (tx_ring[tx_clean].status & TXD_STAT_DD))
+	tx_clean = (tx_clean + 1) % TXRING_LEN;
+    return (tx_clean + TXRING_LEN - tx_tail - 1) % TXRING_LEN;
+}
+
+/*
+ * Queue descriptor i for the first len bytes of its buffer.  The
+ * kernel fills in the address when it copies the descriptor to the
+ * ring.
+ */
+static void
+bypass_tx_desc(uint32_t i, uint16_t len, int eop, uint8_t popts, uint8_t dcmd)
+{
+    struct tx_desc *d = &tx_queue[i];
+    struct tx_data_desc *dd = (struct tx_data_desc *) d;
+
+    d->addr = 0;
+    d->length = len;
+    d->cmd = TXD_CMD_RS | (eop ? TXD_CMD_EOP : 0);
+    d->status = 0;
+    d->cso = d->css = d->special = 0;
+    if (popts) {
+	dd->dtyp = TXD_DTYP_DATA;
+	dd->dcmd |= TXD_CMD_DEXT | dcmd;
+	dd->popts = popts;
+    }
+}
+
+/*
+ * Copy the packet made of the nfrags pieces in frags into the
+ * transmit buffers after tx_tail, filling each buffer before going on
+ * to the next, and queue descriptors for it as e1000_transmit would.
+ * The card does not see it until bypass_send_batch pushes them.
+ */
+static int
+bypass_tx_queue(const struct NetFrag *frags, int nfrags)
+{
+    int offload = frags[0].nf_flags & ~NETFRAG_EOP;
+    uint8_t iphlen = 0, popts = 0, dcmd = 0;
+    uint32_t len, done, fill, left, n, tail;
+    const uint8_t *src;
+    int i, newctx;
+
+    for (len = 0, i = 0; i < nfrags; i++)
+	len += frags[i].nf_len;
+    if (len == 0
+	|| len > (offload & NETFRAG_TSO ? NETPACKET_TSO_MAX : NETPACKET_MAX))
+	return -E_INVAL;
+
+    if (offload & (NETFRAG_CSUM_IP | NETFRAG_CSUM_TCP)) {
+	iphlen = NETFRAG_IPHLEN_OF(offload);
+	popts = (offload & NETFRAG_CSUM_IP ? TXD_POPTS_IXSM : 0)
+	    | (offload & NETFRAG_CSUM_TCP ? TXD_POPTS_TXSM : 0);
+    }
+    if (offload & NETFRAG_TSO)
+	dcmd = TXD_CMD_TSE;
+    newctx = popts && (dcmd || iphlen != tx_ctx_iphlen);
+
+    if (ROUNDUP(len, TBUFFSIZE) / TBUFFSIZE + newctx > bypass_tx_room())
+	return -E_NO_MEM;
+
+    tail = tx_tail;
+    if (newctx) {
+	e1000_tx_ctx((struct tx_ctx_desc *) &tx_queue[tail], iphlen, offload,
+		     len - (ETH_HLEN + iphlen + NETFRAG_TCPHLEN_OF(offload)));
+	tx_ctx_iphlen = dcmd ? 0 : iphlen;
+	tail = (tail + 1) % TXRING_LEN;
+    }
+    for (done = fill = 0, i = 0; i < nfrags; i++)
+	for (src = frags[i].nf_va, left = frags[i].nf_len; left > 0;
+	     src += n, left -= n) {
+	    n = MIN(left, TBUFFSIZE - fill);
+	    memcpy(tx_buf + tail * TBUFFSIZE + fill, src, n);
+	    fill += n;
+	    done += n;
+	    if (fill == TBUFFSIZE || done == len) {
+		bypass_tx_desc(tail, fill, done == len, popts, dcmd);
+		tail = (tail + 1) % TXRING_LEN;
+		fill = 0;
+	    }
+	}
+    tx_tail = tail;
+    return 0;
+}
+
+/*
+ * Send a batch of packets, with the same arguments and results as
+ * sys_netpacket_send_batch.  The data is copied, so the caller may
+ * reuse it as soon as this returns.
+ */
+int
+bypass_send_batch(const struct NetFrag *frags, int nfrags)
+{
+    int start, end, npkts = 0, r = 0;
+
+    for (start = 0; start < nfrags; start = end + 1) {
+	for (end = start; end < nfrags && !(frags[end].nf_flags & NETFRAG_EOP);
+	     end++)
+	    /* find the packet's last piece */;
+	if (end == nfrags || end - start + 1 > NETFRAG_MAX) {
+	    r = -E_INVAL;
+	    break;
+	}
+	if ((r = bypass_tx_queue(&frags[start], end - start + 1)) < 0)
+	    break;
+	npkts++;
+    }
+    if (npkts == 0)
+	return r;
+
+    if ((r = sys_net_bypass_push(tx_tail, rx_tail)) < 0)
+	return r;
+    return npkts;
+}
+
+/*
+ * Block until half the transmit ring is free, like
+ * sys_netpacket_wait(NETWAIT_TX, 0).
+ */
+void
+bypass_tx_wait(void)
+{
+    uint32_t intr;
+
+    for (;;) {
+	intr = info->nb_intr;
+	if (bypass_tx_room() >= TXRING_LEN / 2)
+	    return;
+	sys_futex_wait(&info->nb_intr, intr, 0);
+    }
+}
+
+/*
+ * Return the length of the next received frame, storing its address
+ * in *frame and the NETRX_* checksums the card verified in *flags, or
+ * -1 if none has arrived.  The frame stays where it is until
+ * bypass_recv_done.
+ */
+int
+bypass_recv(const void **frame, int *flags)
+{
+    const volatile struct rx_desc *d = &rx_ring[rx_next];
+    int len;
+
+    if (!(d->status & RXD_STAT_DD))
+	return -1;
+    *frame = rx_buf + rx_next * RBUFFSIZE;
+    *flags = e1000_rx_csum((const struct rx_desc *) d);
+    len = d->length;
+    rx_next = (rx_next + 1) % RXRING_LEN;
+    return len;
+}
+
+/*
+ * Give the buffers of the frames bypass_recv returned back to the card.
+ * The kernel clears their status as it does.
+ */
+void
+bypass_recv_done(void)
+{
+    rx_tail = (rx_next + RXRING_LEN - 1) % RXRING_LEN;
+    sys_net_bypass_push(tx_tail, rx_tail);
+}
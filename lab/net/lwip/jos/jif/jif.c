@@ -41,14 +41,13 @@
 #include "lwip/pbuf.h"
 #include "lwip/sys.h"
 #include <lwip/stats.h>
+#include "lwip/ip.h"
+#include "lwip/tcp.h"
 
 #include <netif/etharp.h>
 
-#define PKTMAP		0x10000000
-
 struct jif {
     struct eth_addr *ethaddr;
-    envid_t envid;
 };
 
 static void
@@ -69,6 +68,303 @@ low_level_init(struct netif *netif)
     netif->hwaddr[5] = 0x56;
 }
 
+/*
+ * Transmit completion.
+ *
+ * The NIC sends straight out of our pbufs, so each packet keeps a
+ * reference to its pbuf chains until the kernel reports, through
+ * thisenv->env_tx_done, that the NIC is done with it.  Packets finish
+ * in the order they were queued.  A packet may be made of several
+ * chains (see TCP segmentation below); tx_pending_eop marks the last
+ * chain of each.
+ */
+static struct pbuf *tx_pending[JIF_TXQ];
+static uint8_t tx_pending_eop[JIF_TXQ];
+static uint32_t tx_queued;	/* chains handed to the NIC */
+static uint32_t tx_freed;	/* ... of which we released */
+static uint32_t tx_done;	/* packets whose chains we released */
+
+void
+jif_tx_reclaim(void)
+{
+    int eop;
+
+    /* With the card bypassing the kernel, only packets the kernel had
+     * queued before are left to finish here (see jif_tx_flush). */
+    if (!bypass_attached())
+	sys_netpacket_tx_reclaim();
+    while ((int32_t) (thisenv->env_tx_done - tx_done) > 0) {
+	do {
+	    eop = tx_pending_eop[tx_freed % JIF_TXQ];
+	    pbuf_free(tx_pending[tx_freed % JIF_TXQ]);
+	    tx_pending[tx_freed % JIF_TXQ] = NULL;
+	    tx_freed++;
+	} while (!eop);
+	tx_done++;
+    }
+}
+
+/*
+ * Transmit batching.
+ *
+ * Outgoing packets collect in tx_frags, each ended by a NETFRAG_EOP
+ * piece, and go to the kernel in one sys_netpacket_send_batch when the
+ * batch is full or jif_tx_flush is called.  The server flushes before
+ * it blocks, so a packet waits at most until lwIP is out of work.
+ * When the server drives the card itself (see bypass.c), the batch
+ * goes to bypass_send_batch instead, which copies the data, so the
+ * chains are freed at once rather than left pending.
+ * Every chain adds at least one piece, so tx_chains cannot fill up
+ * before tx_frags.
+ */
+static struct NetFrag tx_frags[NETBATCH_MAXFRAGS];
+static int tx_nfrags;
+static struct pbuf *tx_chains[NETBATCH_MAXFRAGS];
+static int tx_nchains;
+static struct {
+    int nfrags;
+    int nchains;
+} tx_batch[JIF_TXBATCH];
+static int tx_npkts;
+
+/*
+ * TCP segmentation offload.
+ *
+ * lwIP cuts a bulk send into MSS-sized segments, and tcp_output sends
+ * as many of them in a row as the window allows.  Such a run goes to
+ * the NIC as a single NETFRAG_TSO packet, made of the first segment's
+ * headers and every segment's payload, and the NIC cuts it up again.
+ * Only segments with no TCP options and no flag but ACK are merged,
+ * which leaves SYN, FIN and PSH on segments of their own, and all but
+ * the last must carry the first one's payload length, which the NIC
+ * uses as the MSS.  tx_run describes the batch's last packet.
+ */
+static struct {
+    int open;			/* it can take another segment */
+    struct ip_hdr *iphdr;	/* its first segment's headers */
+    struct tcp_hdr *tcphdr;
+    u16_t mss;
+    u32_t nextseq;		/* sequence number of a segment to follow */
+    u32_t len;			/* bytes in the packet */
+} tx_run;
+
+static void
+jif_tx_wait(void)
+{
+    if (bypass_attached())
+	bypass_tx_wait();
+    else
+	sys_netpacket_wait(NETWAIT_TX, 0);
+}
+
+void
+jif_tx_flush(void)
+{
+    int i, j, r, sent, chains;
+
+    tx_run.open = 0;
+    while (tx_npkts > 0) {
+	/* Wait for room to remember the chains, then in the NIC's ring. */
+	while (JIF_TXQ - (tx_queued - tx_freed) < tx_nchains) {
+	    jif_tx_reclaim();
+	    if (JIF_TXQ - (tx_queued - tx_freed) < tx_nchains)
+		sys_netpacket_wait(NETWAIT_TX, 0);
+	}
+	if (bypass_attached())
+	    r = bypass_send_batch(tx_frags, tx_nfrags);
+	else
+	    r = sys_netpacket_send_batch(tx_frags, tx_nfrags);
+	if (r == -E_NO_MEM) {
+	    jif_tx_wait();
+	    continue;
+	}
+	if (r < 0)
+	    panic("jif: sending a batch: %e", r);
+
+	/* Move the chains of the packets that went out to tx_pending. */
+	for (sent = chains = 0, i = 0; i < r; i++) {
+	    for (j = 0; j < tx_batch[i].nchains; j++, chains++) {
+		if (bypass_attached()) {
+		    pbuf_free(tx_chains[chains]);
+		    continue;
+		}
+		tx_pending[tx_queued % JIF_TXQ] = tx_chains[chains];
+		tx_pending_eop[tx_queued % JIF_TXQ] = (j == tx_batch[i].nchains - 1);
+		tx_queued++;
+	    }
+	    sent += tx_batch[i].nfrags;
+	}
+	memmove(tx_frags, tx_frags + sent,
+		(tx_nfrags - sent) * sizeof(tx_frags[0]));
+	memmove(tx_chains, tx_chains + chains,
+		(tx_nchains - chains) * sizeof(tx_chains[0]));
+	memmove(tx_batch, tx_batch + r, (tx_npkts - r) * sizeof(tx_batch[0]));
+	tx_nfrags -= sent;
+	tx_nchains -= chains;
+	tx_npkts -= r;
+    }
+}
+
+/*
+ * Checksum offload.
+ *
+ * lwIP leaves the IP and TCP checksums of outgoing packets to us
+ * (CHECKSUM_GEN_IP and CHECKSUM_GEN_TCP are 0), and the e1000 fills
+ * them in.  Zero the IP checksum, seed the TCP one with the
+ * pseudo-header sum as the card expects, and return the NetFrag flags
+ * asking for both.  lwIP builds the headers in the chain's first pbuf,
+ * and never fragments TCP segments.
+ */
+static u16_t
+jif_tcp_pseudo_sum(struct ip_hdr *iphdr, u16_t len)
+{
+    u32_t sum;
+
+    /* len is 0 for segmentation: the NIC adds each segment's own. */
+    sum = (iphdr->src.addr & 0xffff) + (iphdr->src.addr >> 16)
+	+ (iphdr->dest.addr & 0xffff) + (iphdr->dest.addr >> 16)
+	+ htons(IP_PROTO_TCP) + htons(len);
+    while (sum >> 16)
+	sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+static int
+jif_tx_csum(struct pbuf *p)
+{
+    struct eth_hdr *ethhdr = p->payload;
+    struct ip_hdr *iphdr = (struct ip_hdr *)(ethhdr + 1);
+    struct tcp_hdr *tcphdr;
+    u16_t hlen;
+    int flags;
+
+    if (p->len < sizeof(*ethhdr) + IP_HLEN || htons(ethhdr->type) != ETHTYPE_IP)
+	return 0;
+    hlen = IPH_HL(iphdr) * 4;
+    if (IPH_V(iphdr) != 4 || hlen < IP_HLEN || p->len < sizeof(*ethhdr) + hlen)
+	return 0;
+
+    IPH_CHKSUM_SET(iphdr, 0);
+    flags = NETFRAG_CSUM_IP | NETFRAG_IPHLEN(hlen);
+
+    if (IPH_PROTO(iphdr) == IP_PROTO_TCP
+	&& !(IPH_OFFSET(iphdr) & htons(IP_MF | IP_OFFMASK))
+	&& p->len >= sizeof(*ethhdr) + hlen + TCP_HLEN) {
+	tcphdr = (struct tcp_hdr *)((u8_t *)iphdr + hlen);
+	tcphdr->chksum = jif_tcp_pseudo_sum(iphdr, ntohs(IPH_LEN(iphdr)) - hlen);
+	flags |= NETFRAG_CSUM_TCP;
+    }
+    return flags;
+}
+
+/*
+ * Add the pieces of chain p from byte off of its first pbuf on to the
+ * batch, as part of its last packet.
+ */
+static void
+jif_tx_add(struct pbuf *p, u16_t off)
+{
+    struct pbuf *q;
+
+    tx_chains[tx_nchains++] = p;
+    tx_batch[tx_npkts - 1].nchains++;
+    for (q = p; q != NULL; q = q->next, off = 0)
+	if (q->len > off) {
+	    tx_frags[tx_nfrags].nf_va = (u8_t *)q->payload + off;
+	    tx_frags[tx_nfrags].nf_len = q->len - off;
+	    tx_frags[tx_nfrags].nf_flags = 0;
+	    tx_nfrags++;
+	    tx_batch[tx_npkts - 1].nfrags++;
+	}
+}
+
+/*
+ * Return the TCP header of p, whose NetFrag flags are offload, if p is
+ * a segment that may be part of a TSO packet, or NULL.
+ */
+static struct tcp_hdr *
+jif_tx_tso_seg(struct pbuf *p, int offload)
+{
+    struct ip_hdr *iphdr = (struct ip_hdr *)((struct eth_hdr *)p->payload + 1);
+    struct tcp_hdr *tcphdr = (struct tcp_hdr *)((u8_t *)iphdr
+						+ NETFRAG_IPHLEN_OF(offload));
+
+    if (!(offload & NETFRAG_CSUM_TCP) || TCPH_HDRLEN(tcphdr) != 5
+	|| TCPH_FLAGS(tcphdr) != TCP_ACK
+	|| p->tot_len == (u8_t *)tcphdr + TCP_HLEN - (u8_t *)p->payload)
+	return NULL;
+    return tcphdr;
+}
+
+/*
+ * If p can follow the segments of the batch's last packet, add it
+ * there and return 1; otherwise return 0.
+ */
+static int
+jif_tx_tso_merge(struct pbuf *p, int offload)
+{
+    struct tcp_hdr *tcphdr = jif_tx_tso_seg(p, offload);
+    struct ip_hdr *iphdr = (struct ip_hdr *)((struct eth_hdr *)p->payload + 1);
+    struct NetFrag *first;
+    struct pbuf *q;
+    u16_t hdrlen, paylen;
+    int n;
+
+    if (!tx_run.open || tcphdr == NULL)
+	return 0;
+    hdrlen = (u8_t *)tcphdr + TCP_HLEN - (u8_t *)p->payload;
+    paylen = p->tot_len - hdrlen;
+    n = 0;
+    for (q = p; q != NULL; q = q->next)
+	n += (q->len > (q == p ? hdrlen : 0));
+    if (paylen > tx_run.mss
+	|| iphdr->src.addr != tx_run.iphdr->src.addr
+	|| iphdr->dest.addr != tx_run.iphdr->dest.addr
+	|| IPH_HL(iphdr) != IPH_HL(tx_run.iphdr)
+	|| tcphdr->src != tx_run.tcphdr->src
+	|| tcphdr->dest != tx_run.tcphdr->dest
+	|| ntohl(tcphdr->seqno) != tx_run.nextseq
+	|| tcphdr->ackno != tx_run.tcphdr->ackno
+	|| tcphdr->wnd != tx_run.tcphdr->wnd
+	|| tx_run.len + paylen > NETPACKET_TSO_MAX
+	|| tx_batch[tx_npkts - 1].nfrags + n > NETFRAG_MAX
+	|| tx_nfrags + n > NETBATCH_MAXFRAGS)
+	return 0;
+
+    first = &tx_frags[tx_nfrags - tx_batch[tx_npkts - 1].nfrags];
+    if (!(first->nf_flags & NETFRAG_TSO)) {
+	first->nf_flags |= NETFRAG_TSO | NETFRAG_TCPHLEN(TCP_HLEN)
+	    | NETFRAG_MSS(tx_run.mss);
+	tx_run.tcphdr->chksum = jif_tcp_pseudo_sum(tx_run.iphdr, 0);
+    }
+    tx_frags[tx_nfrags - 1].nf_flags &= ~NETFRAG_EOP;
+    jif_tx_add(p, hdrlen);
+    tx_frags[tx_nfrags - 1].nf_flags |= NETFRAG_EOP;
+    tx_run.nextseq += paylen;
+    tx_run.len += paylen;
+    tx_run.open = (paylen == tx_run.mss);
+    return 1;
+}
+
+/*
+ * p has just become the batch's last packet: let it start a run if
+ * it can.
+ */
+static void
+jif_tx_tso_start(struct pbuf *p, int offload)
+{
+    struct tcp_hdr *tcphdr = jif_tx_tso_seg(p, offload);
+
+    tx_run.open = (tcphdr != NULL);
+    if (!tx_run.open)
+	return;
+    tx_run.iphdr = (struct ip_hdr *)((struct eth_hdr *)p->payload + 1);
+    tx_run.tcphdr = tcphdr;
+    tx_run.mss = p->tot_len - ((u8_t *)tcphdr + TCP_HLEN - (u8_t *)p->payload);
+    tx_run.nextseq = ntohl(tcphdr->seqno) + tx_run.mss;
+    tx_run.len = p->tot_len;
+}
+
 /*
  * low_level_output():
  *
@@ -76,38 +372,102 @@ low_level_init(struct netif *netif)
  * contained in the pbuf that is passed to the function. This pbuf
  * might be chained.
  *
+ * The chain goes to the NIC as it is, one piece per pbuf.  Holding a
+ * reference keeps the data of PBUF_RAM and PBUF_POOL pbufs intact, but
+ * not the memory PBUF_REF and PBUF_ROM pbufs point to (IP fragments
+ * live in a static buffer, for one), so a chain with those, or with
+ * more than NETFRAG_MAX pieces, is first copied into a single pbuf.
  */
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
-    int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
-    if (r < 0)
-	panic("jif: could not allocate page of memory");
-    struct jif_pkt *pkt = (struct jif_pkt *)PKTMAP;
+    struct pbuf *q;
+    int n, owned, offload;
 
-    struct jif *jif;
-    jif = netif->state;
+    if (p->tot_len > NETPACKET_MAX)
+	panic("oversized packet, txsize %d\n", p->tot_len);
 
-    char *txbuf = pkt->jp_data;
-    int txsize = 0;
-    struct pbuf *q;
+    n = 0;
+    owned = 1;
     for (q = p; q != NULL; q = q->next) {
-	/* Send the data from the pbuf to the interface, one pbuf at a
-	   time. The size of the data in each pbuf is kept in the ->len
-	   variable. */
-
-	if (txsize + q->len > 2000)
-	    panic("oversized packet, fragment %d txsize %d\n", q->len, txsize);
-	memcpy(&txbuf[txsize], q->payload, q->len);
-	txsize += q->len;
+	n += (q->len > 0);
+	if (q->type != PBUF_RAM && q->type != PBUF_POOL)
+	    owned = 0;
     }
+    if (n > NETFRAG_MAX || !owned) {
+	if ((q = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM)) == NULL)
+	    return ERR_MEM;
+	pbuf_copy(q, p);
+	p = q;
+	n = 1;
+    } else
+	pbuf_ref(p);
+
+    /* The headers are ours to change now: held or copied. */
+    offload = jif_tx_csum(p);
+    if (jif_tx_tso_merge(p, offload))
+	return ERR_OK;
+
+    if (tx_npkts == JIF_TXBATCH || tx_nfrags + n > NETBATCH_MAXFRAGS)
+	jif_tx_flush();
+    tx_batch[tx_npkts].nfrags = 0;
+    tx_batch[tx_npkts].nchains = 0;
+    tx_npkts++;
+    jif_tx_add(p, 0);
+    tx_frags[tx_nfrags - n].nf_flags |= offload;
+    tx_frags[tx_nfrags - 1].nf_flags |= NETFRAG_EOP;
+    jif_tx_tso_start(p, offload);
+    return ERR_OK;
+}
+
+/*
+ * Receive pages.
+ *
+ * A page holding a single received frame is handed to lwIP where it
+ * lies, wrapped in a custom PBUF_REF pbuf.  When lwIP frees the pbuf,
+ * the page goes back to whoever passed it to jif_input.  At most
+ * JIF_RXHOLD pages are held at a time; once that many are, frames are
+ * copied into PBUF_POOL pbufs as before, so that data nobody reads
+ * cannot tie up all of the server's request pages.  Pages of several
+ * frames are always copied: the kernel only packs short frames.
+ */
+struct jif_rxpage {
+    struct pbuf_custom pc;
+    void *va;
+    void (*release)(void *va);
+    struct jif_rxpage *next;	/* in rx_free */
+};
 
-    pkt->jp_len = txsize;
+static struct jif_rxpage rx_pages[JIF_RXHOLD];
+static struct jif_rxpage *rx_free;
 
-    ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
-    sys_page_unmap(0, (void *)pkt);
+static void
+jif_rxpage_free(struct pbuf *p)
+{
+    struct jif_rxpage *rp = (struct jif_rxpage *)p;
 
-    return ERR_OK;
+    rp->release(rp->va);
+    rp->next = rx_free;
+    rx_free = rp;
+}
+
+/*
+ * Wrap the frame in the page at va, its only one, in a pbuf without
+ * copying it.  The caller has checked that rx_free is not empty.
+ */
+static struct pbuf *
+low_level_wrap(void *va, void (*release)(void *va))
+{
+    struct jif_pkt *pkt = (struct jif_pkt *)va;
+    struct jif_rxpage *rp;
+
+    rp = rx_free;
+    rx_free = rp->next;
+    rp->va = va;
+    rp->release = release;
+    rp->pc.custom_free_function = jif_rxpage_free;
+    return pbuf_alloced_custom(PBUF_RAW, pkt->jp_len, PBUF_REF, &rp->pc,
+			       pkt->jp_data, PGSIZE - sizeof(struct jif_pkt));
 }
 
 /*
@@ -118,18 +478,15 @@ low_level_output(struct netif *netif, struct pbuf *p)
  *
  */
 static struct pbuf *
-low_level_input(void *va)
+low_level_input(const void *frame, s16_t len)
 {
-    struct jif_pkt *pkt = (struct jif_pkt *)va;
-    s16_t len = pkt->jp_len;
-
     struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
     if (p == 0)
 	return 0;
 
     /* We iterate over the pbuf chain until we have read the entire
      * packet into the pbuf. */
-    void *rxbuf = (void *) pkt->jp_data;
+    const char *rxbuf = frame;
     int copied = 0;
     struct pbuf *q;
     for (q = p; q != NULL; q = q->next) {
@@ -163,26 +520,37 @@ jif_output(struct netif *netif, struct pbuf *p,
 }
 
 /*
- * jif_input():
- *
- * This function should be called when a packet is ready to be read
- * from the interface. It uses the function low_level_input() that
- * should handle the actual reception of bytes from the network
- * interface.
- *
+ * Tell lwIP which checksums of the len-byte frame the e1000 verified,
+ * as the NETRX_* flags say, so it need not.  The card checks TCP and
+ * UDP checksums of fragments on their own, which says nothing of the
+ * reassembled datagram.
  */
+static void
+jif_rx_csum(struct pbuf *p, const void *frame, int len, int flags)
+{
+    const struct eth_hdr *ethhdr = frame;
+    const struct ip_hdr *iphdr = (const struct ip_hdr *)(ethhdr + 1);
+
+    if (p == NULL || len < sizeof(*ethhdr) + IP_HLEN
+	|| htons(ethhdr->type) != ETHTYPE_IP)
+	return;
+    if (flags & NETRX_CSUM_IP)
+	p->flags |= PBUF_FLAG_CSUM_IP_OK;
+    if ((flags & NETRX_CSUM_L4)
+	&& !(IPH_OFFSET(iphdr) & htons(IP_MF | IP_OFFMASK)))
+	p->flags |= PBUF_FLAG_CSUM_L4_OK;
+}
 
-void
-jif_input(struct netif *netif, void *va)
+/*
+ * Pass a received frame to lwIP.
+ */
+static void
+jif_input_pbuf(struct netif *netif, struct pbuf *p)
 {
     struct jif *jif;
     struct eth_hdr *ethhdr;
-    struct pbuf *p;
 
     jif = netif->state;
-  
-    /* move received packet into a new pbuf */
-    p = low_level_input(va);
 
     /* no packet could be read, silently ignore this */
     if (p == NULL) return;
@@ -209,6 +577,65 @@ jif_input(struct netif *netif, void *va)
     }
 }
 
+/*
+ * jif_input():
+ *
+ * This function should be called when a packet is ready to be read
+ * from the interface. It uses the function low_level_input() that
+ * should handle the actual reception of bytes from the network
+ * interface.
+ *
+ * The page at va, a page of packets (see <inc/ns.h>), belongs to jif
+ * from then on; release(va) is called once lwIP is done with it.
+ */
+
+void
+jif_input(struct netif *netif, void *va, void (*release)(void *va))
+{
+    struct jif_pkt *pkt = (struct jif_pkt *)va;
+    struct pbuf *p;
+
+    if (jif_pkt_valid(va, pkt) && !jif_pkt_valid(va, jif_pkt_next(pkt))
+	&& rx_free != NULL) {
+	p = low_level_wrap(va, release);
+	jif_rx_csum(p, pkt->jp_data, pkt->jp_len, pkt->jp_flags);
+	jif_input_pbuf(netif, p);
+	return;
+    }
+
+    for (; jif_pkt_valid(va, pkt); pkt = jif_pkt_next(pkt)) {
+	p = low_level_input(pkt->jp_data, pkt->jp_len);
+	jif_rx_csum(p, pkt->jp_data, pkt->jp_len, pkt->jp_flags);
+	jif_input_pbuf(netif, p);
+    }
+    release(va);
+}
+
+/*
+ * jif_poll():
+ *
+ * With the server driving the card itself (see bypass.c), pass the
+ * frames waiting in its receive ring to lwIP.  They are copied, so
+ * that the card gets the buffers back at once.  Returns the number
+ * of frames.
+ */
+int
+jif_poll(struct netif *netif)
+{
+    const void *frame;
+    struct pbuf *p;
+    int len, flags, n;
+
+    for (n = 0; (len = bypass_recv(&frame, &flags)) >= 0; n++) {
+	p = low_level_input(frame, len);
+	jif_rx_csum(p, frame, len, flags);
+	jif_input_pbuf(netif, p);
+    }
+    if (n > 0)
+	bypass_recv_done();
+    return n;
+}
+
 /*
  * jif_init():
  *
@@ -222,7 +649,7 @@ err_t
 jif_init(struct netif *netif)
 {
     struct jif *jif;
-    envid_t *output_envid; 
+    int i;
 
     jif = mem_malloc(sizeof(struct jif));
 
@@ -231,15 +658,17 @@ jif_init(struct netif *netif)
 	return ERR_MEM;
     }
 
-    output_envid = (envid_t *)netif->state;
-
     netif->state = jif;
     netif->output = jif_output;
     netif->linkoutput = low_level_output;
     memcpy(&netif->name[0], "en", 2);
 
     jif->ethaddr = (struct eth_addr *)&(netif->hwaddr[0]);
-    jif->envid = *output_envid; 
+
+    for (i = 0; i < JIF_RXHOLD; i++) {
+	rx_pages[i].next = rx_free;
+	rx_free = &rx_pages[i];
+    }
 
     low_level_init(netif);
 
@@ -1,4 +1,25 @@
 #include <lwip/netif.h>
 
-void	jif_input(struct netif *netif, void *va);
+// Pbuf chains that may wait for the NIC to finish sending them; a
+// TSO packet holds several
+#define JIF_TXQ			256
+// Packets batched into one send system call
+#define JIF_TXBATCH		16
+// Received pages lwIP may hold on to at once
+#define JIF_RXHOLD		32
+// How often to release the pbufs of sent packets, in milliseconds
+#define JIF_RECLAIM_INTERVAL	100
+
+void	jif_input(struct netif *netif, void *va, void (*release)(void *va));
 err_t	jif_init(struct netif *netif);
+void	jif_tx_reclaim(void);
+void	jif_tx_flush(void);
+int	jif_poll(struct netif *netif);
+
+/* bypass.c */
+int	bypass_attach(void);
+int	bypass_attached(void);
+int	bypass_send_batch(const struct NetFrag *frags, int nfrags);
+void	bypass_tx_wait(void);
+int	bypass_recv(const void **frame, int *flags);
+void	bypass_recv_done(void);
@@ -36,6 +36,15 @@ void *memcpy(void *dst, const void *src, size_t n);
 
 #define PBUF_POOL_SIZE		512
 #define PBUF_POOL_BUFSIZE	2000
+// jif hands received pages to lwIP as custom pbufs
+#define LWIP_SUPPORT_CUSTOM_PBUF	1
+
+// jif has the e1000 fill in IP and TCP checksums, and lwIP skips
+// checking those the e1000 verified.  UDP datagrams may go out in IP
+// fragments, which the card cannot checksum as a whole, so lwIP still
+// computes UDP checksums itself.
+#define CHECKSUM_GEN_IP		0
+#define CHECKSUM_GEN_TCP	0
 
 #define TCP_MSS			1460
 #define TCP_WND			24000
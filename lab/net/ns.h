@@ -5,17 +5,51 @@
 #define MASK "255.255.255.0"
 #define DEFAULT "10.0.2.2"
 
-#define TIMER_INTERVAL 250
+// Whether the server takes the NIC over and drives it itself, rather
+// than through the kernel and an input environment (see jif/bypass.c)
+#ifndef NS_BYPASS
+#define NS_BYPASS	0
+#endif
 
 // Virtual address at which to receive page mappings containing client requests.
-#define QUEUE_SIZE	20
+#define QUEUE_SIZE	64
 #define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
 
-/* timer.c */
-void timer(envid_t ns_envid, uint32_t initial_to);
+// Received pages go from the input environment to the server through
+// a ring in a page the two share, at INPUT_RINGVA.  Page i goes in
+// slot i % INPUT_RING_LEN, at INPUT_SLOTVA in the input environment,
+// and the server maps it from there into one of its INPUT_NBUF
+// buffers at INPUT_BUFVA, where it stays while lwIP holds the packet
+// (see JIF_RXHOLD).  Neither side makes a system call per page.
+#define INPUT_RING_LEN	32
+#define INPUT_NBUF	64
+#define INPUT_RINGVA	(REQVA - PGSIZE)
+#define INPUT_SLOTVA	(INPUT_RINGVA - INPUT_RING_LEN * PGSIZE)
+#define INPUT_BUFVA	(INPUT_SLOTVA - INPUT_NBUF * PGSIZE)
+
+// The server maps the struct Sockbuf of socket s at
+// SOCKBUF_VA + s * PGSIZE, for up to SOCKBUF_MAX sockets.
+#define SOCKBUF_MAX	32
+#define SOCKBUF_VA	(INPUT_BUFVA - SOCKBUF_MAX * PGSIZE)
+
+struct input_ring {
+	// Pages put in the ring by the input environment, and of those
+	// taken out by the server.  Each side only writes its own.
+	volatile uint32_t ir_head;
+	volatile uint32_t ir_tail;
+	// Set by the server when it is about to block, and by the input
+	// environment when it is about to wait for room: the other side
+	// then wakes it.
+	volatile uint32_t ir_srvwait;
+	volatile uint32_t ir_inwait;
+};
 
 /* input.c */
 void input(envid_t ns_envid);
+void input_ring_init(void);
+int input_take(envid_t input_envid, void **pages, int npages);
+void input_release(void *va);
+bool input_sleep(void);
 
 /* output.c */
 void output(envid_t ns_envid);
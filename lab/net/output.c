@@ -10,13 +10,37 @@ output(envid_t ns_envid)
 	// LAB 6: Your code here:
 	// 	- read a packet from the network server
 	//	- send the packet to the device driver
-	int perm;
+	//
+	// Each request page is a page of packets; all of them go to the
+	// driver in as few system calls as the transmit ring allows.
+	struct NetFrag frags[NETBATCH_MAXFRAGS];
+	struct jif_pkt *pkt;
+	int perm, n, sent, r;
 	envid_t eid;
 
 	while(1) {
 		if (ipc_recv(&eid, &nsipcbuf, &perm) != NSREQ_OUTPUT)
 			continue;
-		while(sys_netpacket_try_send(nsipcbuf.pkt.jp_data, nsipcbuf.pkt.jp_len) < 0)
-			sys_yield();
+
+		pkt = &nsipcbuf.pkt;
+		while (jif_pkt_valid(&nsipcbuf, pkt)) {
+			for (n = 0; n < NETBATCH_MAXFRAGS
+				     && jif_pkt_valid(&nsipcbuf, pkt);
+			     n++, pkt = jif_pkt_next(pkt)) {
+				frags[n].nf_va = pkt->jp_data;
+				frags[n].nf_len = pkt->jp_len;
+				frags[n].nf_flags = NETFRAG_EOP;
+			}
+			for (sent = 0; sent < n; sent += r) {
+				r = sys_netpacket_send_batch(&frags[sent], n - sent);
+				if (r == -E_NO_MEM) {
+					sys_netpacket_wait(NETWAIT_TX, 0);
+					r = 0;
+				} else if (r < 0) {
+					cprintf("ns_output: dropping packet: %e\n", r);
+					r = 1;
+				}
+			}
+		}
 	}
 }
@@ -42,12 +42,13 @@ struct timer_thread {
 static struct timer_thread t_arp;
 static struct timer_thread t_tcpf;
 static struct timer_thread t_tcps;
+static struct timer_thread t_jif;
 
-static envid_t timer_envid;
 static envid_t input_envid;
-static envid_t output_envid;
 
 static bool buse[QUEUE_SIZE];
+// Bumped, and waiters woken, each time a buffer is given back
+static uint32_t buse_released;
 static int next_i(int i) { return (i+1) % QUEUE_SIZE; }
 static int prev_i(int i) { return (i ? i-1 : QUEUE_SIZE-1); }
 
@@ -59,10 +60,8 @@ get_buffer(void) {
 	for (i = 0; i < QUEUE_SIZE; i++)
 		if (!buse[i]) break;
 
-	if (i == QUEUE_SIZE) {
-		panic("NS: buffer overflow");
-		return 0;
-	}
+	if (i == QUEUE_SIZE)
+		return NULL;
 
 	va = (void *)(REQVA + i * PGSIZE);
 	buse[i] = 1;
@@ -74,6 +73,251 @@ static void
 put_buffer(void *va) {
 	int i = ((uint32_t)va - REQVA) / PGSIZE;
 	buse[i] = 0;
+	buse_released++;
+	thread_wakeup(&buse_released);
+}
+
+// Give back a request page.
+static void
+release_buffer(void *va)
+{
+	put_buffer(va);
+	sys_page_unmap(0, va);
+}
+
+// Pass the pages of packets the input environment put in the ring
+// to lwIP.  jif keeps a page while lwIP holds its packet.  Returns the
+// number of pages.
+static int
+serve_input(void)
+{
+	void *pages[INPUT_RING_LEN];
+	int i, n, total = 0;
+
+	while ((n = input_take(input_envid, pages, INPUT_RING_LEN)) > 0)
+		for (i = 0; i < n; i++, total++)
+			jif_input(&nif, pages[i], input_release);
+	return total;
+}
+
+// How long a connected socket's thread with nothing to do sleeps
+// before looking again, in case lwIP has news for it (a connection
+// that timed out, say) that no packet brought.  Other sockets' threads
+// have nothing to look for until serve wakes them.
+#define SOCKBUF_RECHECK_MS	100
+
+// The server's side of the sockets' shared buffers (see struct
+// Sockbuf).  A thread per socket with buffers moves data between
+// them and lwIP; serve wakes them all when packets come in or a
+// client notifies it.
+struct sockbuf_srv {
+	struct Sockbuf *sb;	// At SOCKBUF_VA, or NULL if none
+	bool connected;		// Receive into sb (not while listening)
+	bool closing;		// Send what is left in sb, then close
+};
+
+static struct sockbuf_srv sockbufs[SOCKBUF_MAX];
+
+// The -E_* code for lwIP's errno, for clients of the buffers, which
+// see the socket as a file.
+static int
+sockbuf_errno(void)
+{
+	switch (errno) {
+	case ENOMEM:
+	case ENOBUFS:
+		return -E_NO_MEM;
+	case ETIMEDOUT:
+		return -E_TIMEOUT;
+	case ECONNRESET:
+	case ECONNABORTED:
+	case ENOTCONN:
+	case EPIPE:
+		return -E_EOF;
+	default:
+		return -E_UNSPECIFIED;
+	}
+}
+
+// Send what the client put in the transmit ring, waiting in lwIP
+// until it has all been taken.  Returns whether there was any.
+static bool
+sockbuf_send(int s, struct Sockbuf *sb)
+{
+	uint32_t rpos = sb->sb_txrpos, off, n;
+	int r;
+
+	if (sb->sb_txerr || (n = sockbuf_used(sb->sb_txwpos, rpos)) == 0)
+		return 0;
+	off = rpos % SOCKBUF_RINGSIZ;
+	n = MIN(n, SOCKBUF_RINGSIZ - off);
+	if ((r = lwip_send(s, &sb->sb_txbuf[off], n, 0)) < 0)
+		sb->sb_txerr = sockbuf_errno();
+	else
+		sb->sb_txrpos = sockbuf_advance(rpos, r);
+	// The xchg pairs with the one in devsock_write.
+	if (xchg(&sb->sb_txwait, 0))
+		sys_futex_wake(&sb->sb_txrpos, 1);
+	return 1;
+}
+
+// Move what lwIP has received into the receive ring.  This does not
+// wait for more, so that the thread is free to stop when the socket
+// is closed.  Returns whether anything changed.
+static bool
+sockbuf_recv(int s, struct Sockbuf *sb)
+{
+	uint32_t wpos = sb->sb_rxwpos, off, n;
+	int r;
+
+	if (sb->sb_rxdone
+	    || (n = SOCKBUF_RINGSIZ - sockbuf_used(wpos, sb->sb_rxrpos)) == 0)
+		return 0;
+	off = wpos % SOCKBUF_RINGSIZ;
+	n = MIN(n, SOCKBUF_RINGSIZ - off);
+	r = lwip_recv(s, &sb->sb_rxbuf[off], n, MSG_DONTWAIT);
+	if (r < 0 && errno == EWOULDBLOCK)
+		return 0;
+	if (r > 0)
+		sb->sb_rxwpos = sockbuf_advance(wpos, r);
+	else {
+		// End of file, or an error: the data is all in
+		sb->sb_rxerr = r < 0 ? sockbuf_errno() : 0;
+		sb->sb_rxdone = 1;
+	}
+	// The xchg pairs with the one in devsock_read.
+	if (xchg(&sb->sb_rxwait, 0))
+		sys_futex_wake(&sb->sb_rxwpos, 1);
+	return 1;
+}
+
+// Let go of socket s's buffers, telling a client still using them
+// that no more is coming and no more can go.
+static void
+sockbuf_release(int s)
+{
+	struct sockbuf_srv *ss = &sockbufs[s];
+	struct Sockbuf *sb = ss->sb;
+
+	if (!sb->sb_txerr) {
+		sb->sb_txerr = -E_EOF;
+		if (xchg(&sb->sb_txwait, 0))
+			sys_futex_wake(&sb->sb_txrpos, 1);
+	}
+	if (!sb->sb_rxdone) {
+		sb->sb_rxerr = 0;
+		sb->sb_rxdone = 1;
+		if (xchg(&sb->sb_rxwait, 0))
+			sys_futex_wake(&sb->sb_rxwpos, 1);
+	}
+	sys_page_unmap(0, sb);
+	ss->sb = NULL;
+	ss->connected = 0;
+	ss->closing = 0;
+}
+
+static void
+sockbuf_thread(uint32_t arg)
+{
+	int s = arg;
+	struct sockbuf_srv *ss = &sockbufs[s];
+	struct Sockbuf *sb = ss->sb;
+	bool busy;
+
+	for (;;) {
+		busy = sockbuf_send(s, sb);
+		if (ss->connected)
+			busy |= sockbuf_recv(s, sb);
+		if (busy) {
+			thread_yield();
+			continue;
+		}
+		if (ss->closing)
+			break;
+		// Have the client notify us when it fills or drains a
+		// ring, and look once more before sleeping.  The xchg
+		// orders the flag before that look, pairing with the one
+		// in sockbuf_wakeup.
+		if (!sb->sb_srvwait) {
+			xchg(&sb->sb_srvwait, 1);
+			continue;
+		}
+		thread_wait(&sb->sb_txwpos, sb->sb_txwpos,
+			    ss->connected
+			    ? sys_time_msec() + SOCKBUF_RECHECK_MS
+			    : (uint32_t) ~0);
+	}
+
+	// The buffers go first: lwIP does not reuse s before lwip_close
+	// returns.
+	sockbuf_release(s);
+	if (lwip_close(s) < 0)
+		perror("ns sockbuf close");
+}
+
+// Wake every socket's thread to look for work.
+static void
+sockbuf_kick(void)
+{
+	int s;
+
+	for (s = 0; s < SOCKBUF_MAX; s++)
+		if (sockbufs[s].sb)
+			thread_wakeup(&sockbufs[s].sb->sb_txwpos);
+}
+
+// Take the page at va, a struct Sockbuf, as socket s's buffers.
+static int
+sockbuf_attach(int s, void *va)
+{
+	struct sockbuf_srv *ss;
+	int r;
+
+	static_assert(SOCKBUF_MAX >= MEMP_NUM_NETCONN);
+
+	if (s < 0 || s >= SOCKBUF_MAX || sockbufs[s].sb)
+		return -E_INVAL;
+	ss = &sockbufs[s];
+	ss->sb = (struct Sockbuf *) (SOCKBUF_VA + s * PGSIZE);
+	ss->closing = 0;
+	if ((r = sys_page_map(0, va, 0, ss->sb, PTE_P|PTE_U|PTE_W)) < 0
+	    || (r = thread_create(0, "sockbuf", sockbuf_thread, s)) < 0) {
+		sys_page_unmap(0, ss->sb);
+		ss->sb = NULL;
+		return r;
+	}
+	return 0;
+}
+
+// Socket s has a peer now: its thread may receive.
+static void
+sockbuf_connected(int s)
+{
+	if (s < 0 || s >= SOCKBUF_MAX)
+		return;
+	sockbufs[s].connected = 1;
+	if (sockbufs[s].sb)
+		thread_wakeup(&sockbufs[s].sb->sb_txwpos);
+}
+
+// Close socket s.  If it has buffers, their thread closes it once it
+// has sent what the client left in them, and this returns at once, so
+// that closing never waits on the network.
+static int
+sockbuf_close(int s)
+{
+	struct sockbuf_srv *ss;
+
+	if (s < 0 || s >= SOCKBUF_MAX)
+		return lwip_close(s);
+	ss = &sockbufs[s];
+	if (ss->sb) {
+		ss->closing = 1;
+		thread_wakeup(&ss->sb->sb_txwpos);
+		return 0;
+	}
+	ss->connected = 0;
+	return lwip_close(s);
 }
 
 static void
@@ -142,11 +386,12 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 	thread_wait(&done, 0, (uint32_t)~0);
 	lwip_core_lock();
 
-	lwip_init(&nif, &output_envid, ipaddr, netmask, gw);
+	lwip_init(&nif, 0, ipaddr, netmask, gw);
 
 	start_timer(&t_arp, &etharp_tmr, "arp timer", ARP_TMR_INTERVAL);
 	start_timer(&t_tcpf, &tcp_fasttmr, "tcp f timer", TCP_FAST_INTERVAL);
 	start_timer(&t_tcps, &tcp_slowtmr, "tcp s timer", TCP_SLOW_INTERVAL);
+	start_timer(&t_jif, &jif_tx_reclaim, "jif timer", JIF_RECLAIM_INTERVAL);
 
 	struct in_addr ia = {ipaddr};
 	cprintf("ns: %02x:%02x:%02x:%02x:%02x:%02x"
@@ -160,32 +405,25 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 	cprintf("NS: TCP/IP initialized.\n");
 }
 
-static void
-process_timer(envid_t envid) {
-	uint32_t start, now, to;
-
-	if (envid != timer_envid) {
-		cprintf("NS: received timer interrupt from envid %x not timer env\n", envid);
-		return;
-	}
-
-	start = sys_time_msec();
-	thread_yield();
-	now = sys_time_msec();
-
-	to = TIMER_INTERVAL - (now - start);
-	ipc_send(envid, to, 0, 0);
-}
-
 struct st_args {
 	int32_t reqno;
 	uint32_t whom;
 	union Nsipc *req;
 };
 
+// Requests that may block in lwIP wait in st_queue for a pool of
+// threads that serve them one after another.  Each holds one of the
+// QUEUE_SIZE request buffers, so the queue never fills, and the pool
+// grows only while every thread in it is busy, to at most one per
+// buffer.
+static struct st_args st_queue[QUEUE_SIZE];
+static volatile uint32_t st_head, st_tail;
+static int st_nthreads, st_nidle;
+
+// Serve one request, reply, and give back its buffer.
 static void
-serve_thread(uint32_t a) {
-	struct st_args *args = (struct st_args *)a;
+serve_request(struct st_args *args)
+{
 	union Nsipc *req = args->req;
 	int r;
 
@@ -196,6 +434,8 @@ serve_thread(uint32_t a) {
 		ret.ret_addrlen = req->accept.req_addrlen;
 		r = lwip_accept(req->accept.req_s, &ret.ret_addr,
 				&ret.ret_addrlen);
+		if (r >= 0)
+			sockbuf_connected(r);
 		memmove(req, &ret, sizeof ret);
 		break;
 	}
@@ -204,14 +444,17 @@ serve_thread(uint32_t a) {
 			      req->bind.req_namelen);
 		break;
 	case NSREQ_SHUTDOWN:
-		r = lwip_shutdown(req->shutdown.req_s, req->shutdown.req_how);
+		// lwIP's shutdown closes the socket, whatever 'how'
+		r = sockbuf_close(req->shutdown.req_s);
 		break;
 	case NSREQ_CLOSE:
-		r = lwip_close(req->close.req_s);
+		r = sockbuf_close(req->close.req_s);
 		break;
 	case NSREQ_CONNECT:
 		r = lwip_connect(req->connect.req_s, &req->connect.req_name,
 				 req->connect.req_namelen);
+		if (r == 0)
+			sockbuf_connected(req->connect.req_s);
 		break;
 	case NSREQ_LISTEN:
 		r = lwip_listen(req->listen.req_s, req->listen.req_backlog);
@@ -230,9 +473,9 @@ serve_thread(uint32_t a) {
 		r = lwip_socket(req->socket.req_domain, req->socket.req_type,
 				req->socket.req_protocol);
 		break;
-	case NSREQ_INPUT:
-		jif_input(&nif, (void *)&req->pkt);
-		r = 0;
+	case NSREQ_SOCKBUF:
+		// Keeps its own mapping of the request page
+		r = sockbuf_attach(((struct Sockbuf *) req)->sb_s, req);
 		break;
 	default:
 		cprintf("Invalid request code %d from %08x\n", args->whom, args->req);
@@ -246,19 +489,68 @@ serve_thread(uint32_t a) {
 		perror(buf);
 	}
 
-	if (args->reqno != NSREQ_INPUT)
-		ipc_send(args->whom, r, 0, 0);
+	ipc_send(args->whom, r, 0, 0);
+
+	release_buffer(args->req);
+}
+
+static void __attribute__((noreturn))
+serve_thread(uint32_t arg)
+{
+	struct st_args args;
+
+	for (;;) {
+		st_nidle++;
+		while (st_tail == st_head)
+			thread_wait(&st_head, st_head, (uint32_t) ~0);
+		st_nidle--;
+		args = st_queue[st_tail++ % QUEUE_SIZE];
+		serve_request(&args);
+	}
+}
 
-	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
-	free(args);
+// Does request reqno never wait on the network or on other clients?
+// Those are served in serve itself, without a thread switch of their
+// own.  Close only queues the socket's last data (see sockbuf_close).
+static bool
+serve_inline(int32_t reqno)
+{
+	switch (reqno) {
+	case NSREQ_BIND:
+	case NSREQ_CLOSE:
+	case NSREQ_SHUTDOWN:
+	case NSREQ_LISTEN:
+	case NSREQ_SOCKET:
+	case NSREQ_SOCKBUF:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// Queue a request for the pool, adding a thread if none is free.
+static void
+serve_queue(struct st_args *args)
+{
+	int r;
+
+	st_queue[st_head % QUEUE_SIZE] = *args;
+	if (st_head - st_tail >= st_nidle && st_nthreads < QUEUE_SIZE) {
+		if ((r = thread_create(0, "serve_thread", serve_thread, 0)) < 0) {
+			if (st_nthreads == 0)
+				panic("cannot create serve thread: %e", r);
+		} else
+			st_nthreads++;
+	}
+	st_head++;
+	thread_wakeup(&st_head);
 }
 
 void
 serve(void) {
 	int32_t reqno;
-	uint32_t whom;
-	int i, perm;
+	uint32_t whom, deadline;
+	int i, n, perm;
 	void *va;
 
 	while (1) {
@@ -268,38 +560,80 @@ serve(void) {
 		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
 			thread_yield();
 
-		perm = 0;
-		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
-		if (debug) {
-			cprintf("ns req %d from %08x\n", reqno, whom);
+		// Take in the frames received meanwhile, and hand the
+		// packets lwIP queued to the NIC.
+		lwip_core_lock();
+		if (bypass_attached())
+			n = jif_poll(&nif);
+		else
+			n = serve_input();
+		jif_tx_flush();
+		lwip_core_unlock();
+
+		// Have the sockets' threads move what came in to their
+		// clients' buffers before we block.
+		if (n > 0) {
+			sockbuf_kick();
+			continue;
 		}
 
-		// first take care of requests that do not contain an argument page
-		if (reqno == NSREQ_TIMER) {
-			process_timer(whom);
+		// With every buffer holding a request still being served,
+		// let those requests' threads run until one gives its
+		// buffer back.  They may be waiting for packets only this
+		// loop takes in, so come round again by the next thread
+		// timeout regardless.
+		if ((va = get_buffer()) == NULL) {
+			thread_yield();
+			thread_wait(&buse_released, buse_released,
+				    thread_wakeup_deadline());
+			continue;
+		}
+		// Have the input environment wake us if it queues more
+		// pages while we block, unless it already has.
+		if (!bypass_attached() && !input_sleep()) {
 			put_buffer(va);
 			continue;
 		}
 
-		// All remaining requests must contain an argument page
+		// Wait for a request, but no longer than until some
+		// thread's timeout (lwIP's timers, for one) is due.
+		deadline = thread_wakeup_deadline();
+		perm = 0;
+		reqno = ipc_recv_until((int32_t *) &whom, (void *) va, &perm,
+				       deadline == ~0 ? 0 : deadline);
+		if (reqno == -E_TIMEOUT) {
+			put_buffer(va);
+			thread_yield();
+			continue;
+		}
+		// The NIC or the input environment has packets for us, or
+		// a client has filled or drained a socket's buffers: go
+		// round again to take the packets in and let the sockets'
+		// threads look.
+		if (reqno == -E_INTR) {
+			put_buffer(va);
+			sockbuf_kick();
+			continue;
+		}
+		if (debug) {
+			cprintf("ns req %d from %08x\n", reqno, whom);
+		}
+
+		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n", whom);
 			continue; // just leave it hanging...
 		}
 
-		// Since some lwIP socket calls will block, create a thread and
-		// process the rest of the request in the thread.
-		struct st_args *args = malloc(sizeof(struct st_args));
-		if (!args)
-			panic("could not allocate thread args structure");
-
-		args->reqno = reqno;
-		args->whom = whom;
-		args->req = va;
-
-		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
-		thread_yield(); // let the thread created run
+		// Since some lwIP socket calls will block, hand those to
+		// the pool of serve threads.
+		struct st_args args = { reqno, whom, va };
+		if (serve_inline(reqno))
+			serve_request(&args);
+		else {
+			serve_queue(&args);
+			thread_yield(); // let a serve thread take it
+		}
 	}
 }
 
@@ -315,37 +649,30 @@ void
 umain(int argc, char **argv)
 {
 	envid_t ns_envid = sys_getenvid();
+	int r;
 
 	binaryname = "ns";
 
-	// fork off the timer thread which will send us periodic messages
-	timer_envid = fork();
-	if (timer_envid < 0)
-		panic("error forking");
-	else if (timer_envid == 0) {
-		timer(ns_envid, TIMER_INTERVAL);
-		return;
-	}
+	// Drive the NIC ourselves if asked to.  There is then no input
+	// environment: serve polls the receive ring.
+	if (NS_BYPASS && (r = bypass_attach()) < 0)
+		cprintf("ns: cannot bypass the kernel: %e\n", r);
 
 	// fork off the input thread which will poll the NIC driver for input
-	// packets
-	input_envid = fork();
-	if (input_envid < 0)
-		panic("error forking");
-	else if (input_envid == 0) {
-		input(ns_envid);
-		return;
+	// packets, and pass them to us through a ring in shared memory
+	if (!bypass_attached()) {
+		input_ring_init();
+		input_envid = fork();
+		if (input_envid < 0)
+			panic("error forking");
+		else if (input_envid == 0) {
+			input(ns_envid);
+			return;
+		}
 	}
 
-	// fork off the output thread that will send the packets to the NIC
-	// driver
-	output_envid = fork();
-	if (output_envid < 0)
-		panic("error forking");
-	else if (output_envid == 0) {
-		output(ns_envid);
-		return;
-	}
+	// There is no output environment: jif hands packets to the NIC
+	// itself, straight out of lwIP's pbufs.
 
 	// lwIP requires a user threading library; start the library and jump
 	// into a thread to continue initialization.
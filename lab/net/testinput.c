@@ -69,6 +69,8 @@ umain(int argc, char **argv)
 {
 	envid_t ns_envid = sys_getenvid();
 	int i, r, first = 1;
+	struct jif_pkt *p;
+	void *va;
 
 	binaryname = "testinput";
 
@@ -80,6 +82,7 @@ umain(int argc, char **argv)
 		return;
 	}
 
+	input_ring_init();
 	input_envid = fork();
 	if (input_envid < 0)
 		panic("error forking");
@@ -92,24 +95,24 @@ umain(int argc, char **argv)
 	announce();
 
 	while (1) {
-		envid_t whom;
-		int perm;
-
-		int32_t req = ipc_recv((int32_t *)&whom, pkt, &perm);
-		if (req < 0)
-			panic("ipc_recv: %e", req);
-		if (whom != input_envid)
-			panic("IPC from unexpected environment %08x", whom);
-		if (req != NSREQ_INPUT)
-			panic("Unexpected IPC %d", req);
-
-		hexdump("input: ", pkt->jp_data, pkt->jp_len);
-		cprintf("\n");
-
-		// Only indicate that we're waiting for packets once
-		// we've received the ARP reply
-		if (first)
-			cprintf("Waiting for packets...\n");
-		first = 0;
+		// The input environment notifies us when it queues pages
+		if (input_take(input_envid, &va, 1) == 0) {
+			if (input_sleep()
+			    && (r = ipc_recv_until(NULL, NULL, NULL, 0)) != -E_INTR)
+				panic("Unexpected IPC %d", r);
+			continue;
+		}
+
+		for (p = va; jif_pkt_valid(va, p); p = jif_pkt_next(p)) {
+			hexdump("input: ", p->jp_data, p->jp_len);
+			cprintf("\n");
+
+			// Only indicate that we're waiting for packets once
+			// we've received the ARP reply
+			if (first)
+				cprintf("Waiting for packets...\n");
+			first = 0;
+		}
+		input_release(va);
 	}
 }
@@ -1,11 +1,27 @@
-// Demonstrate lack of fairness in IPC.
+// Two demonstrations of (un)fairness.
+//
+// With no arguments, demonstrate lack of fairness in IPC.
 // Start three instances of this program as envs 1, 2, and 3.
 // (user/idle is env 0).
+//
+// 'fairness share' checks that the fair-share scheduler divides the
+// CPU in proportion to the weights that priorities give.  Three
+// children spin at priorities 50, 100 and 200, and should get the CPU
+// in the ratio 4:2:1.  Switch to the fair scheduler first with the
+// monitor's 'sched fair' command.  The children only compete if they
+// share one CPU, so run this with CPUS=1.
 
 #include <inc/lib.h>
+#include <inc/time.h>
 
-void
-umain(int argc, char **argv)
+#define NCHILD		3
+#define SETTLE_MS	100
+#define MEASURE_MS	1000
+
+#define timepage	((const volatile struct TimePage *) UTIME)
+
+static void
+ipc_demo(void)
 {
 	envid_t who, id;
 
@@ -23,3 +39,65 @@ umain(int argc, char **argv)
 	}
 }
 
+static void
+share_check(void)
+{
+	static const int prio[NCHILD] = { 50, 100, 200 };
+	envid_t kids[NCHILD];
+	uint64_t start[NCHILD], used[NCHILD], total, elapsed;
+	int i, share, expect, wsum;
+
+	// Stay ahead of the children so we take our samples on time.
+	sys_env_set_priority(0, ENV_PRIOR_HIGH);
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0)
+			for (;;)
+				/* spin */;
+		sys_env_set_priority(kids[i], prio[i]);
+	}
+
+	sys_sleep_until(sys_time_msec() + SETTLE_MS);
+	for (i = 0; i < NCHILD; i++)
+		start[i] = envs[ENVX(kids[i])].env_cycles;
+	sys_sleep_until(sys_time_msec() + MEASURE_MS);
+	total = 0;
+	for (i = 0; i < NCHILD; i++) {
+		used[i] = envs[ENVX(kids[i])].env_cycles - start[i];
+		total += used[i];
+		sys_env_destroy(kids[i]);
+	}
+
+	elapsed = (uint64_t) MEASURE_MS * timepage->tp_tsc_khz;
+	if (total > elapsed * 3 / 2) {
+		cprintf("children ran on several CPUs; shares not checked\n");
+		return;
+	}
+	if (total == 0)
+		panic("children did not run");
+
+	wsum = 0;
+	for (i = 0; i < NCHILD; i++)
+		wsum += 10000 / prio[i];
+	for (i = 0; i < NCHILD; i++) {
+		share = used[i] * 100 / total;
+		expect = 10000 / prio[i] * 100 / wsum;
+		cprintf("priority %d: %d%% of the CPU, expected %d%%\n",
+			prio[i], share, expect);
+		if (share < expect * 3 / 4 || share > expect * 5 / 4)
+			panic("priority %d got %d%% of the CPU, not %d%%",
+			      prio[i], share, expect);
+	}
+	cprintf("fairness ok\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+	if (argc >= 2 && strcmp(argv[1], "share") == 0)
+		share_check();
+	else
+		ipc_demo();
+}
@@ -0,0 +1,62 @@
+// Measure the cost of fork, spawn and pipe setup:
+// the number of system calls the parent makes and the elapsed time.
+
+#include <inc/lib.h>
+
+#define NFORK	50
+#define NSPAWN	10
+#define NPIPE	100
+
+static void
+report(const char *what, int n, uint32_t calls, unsigned start)
+{
+	unsigned ms = sys_time_msec() - start;
+
+	cprintf("%s: %d runs, %d syscalls each, %d.%02d ms each\n", what, n,
+		calls / n, ms / n, (ms * 100 / n) % 100);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	uint32_t calls, before;
+	unsigned start;
+	int i, p[2], r;
+
+	calls = 0;
+	start = sys_time_msec();
+	for (i = 0; i < NFORK; i++) {
+		before = thisenv->env_syscalls;
+		if ((child = fork()) < 0)
+			panic("fork: %e", child);
+		if (child == 0)
+			exit();
+		calls += thisenv->env_syscalls - before;
+		wait(child);
+	}
+	report("fork", NFORK, calls, start);
+
+	calls = 0;
+	start = sys_time_msec();
+	for (i = 0; i < NSPAWN; i++) {
+		before = thisenv->env_syscalls;
+		if ((child = spawnl("echo", "echo", "-n", 0)) < 0)
+			panic("spawn: %e", child);
+		calls += thisenv->env_syscalls - before;
+		wait(child);
+	}
+	report("spawn", NSPAWN, calls, start);
+
+	calls = 0;
+	start = sys_time_msec();
+	for (i = 0; i < NPIPE; i++) {
+		before = thisenv->env_syscalls;
+		if ((r = pipe(p)) < 0)
+			panic("pipe: %e", r);
+		calls += thisenv->env_syscalls - before;
+		close(p[0]);
+		close(p[1]);
+	}
+	report("pipe", NPIPE, calls, start);
+}
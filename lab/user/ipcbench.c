@@ -0,0 +1,34 @@
+// Measure IPC round-trip time between two environments.
+// With more than one CPU, the receiver is usually asleep on another
+// CPU when the message arrives, so this also measures how quickly an
+// idle CPU picks up newly runnable work.
+
+#include <inc/lib.h>
+
+#define NROUND	1000
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child, who;
+	unsigned start, ms;
+	int i;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < NROUND; i++)
+			ipc_send(thisenv->env_parent_id, ipc_recv(&who, 0, 0), 0, 0);
+		return;
+	}
+
+	start = sys_time_msec();
+	for (i = 0; i < NROUND; i++) {
+		ipc_send(child, i, 0, 0);
+		if (ipc_recv(&who, 0, 0) != i || who != child)
+			panic("ipcbench: bad reply");
+	}
+	ms = sys_time_msec() - start;
+	cprintf("ipc: %d round trips, %d us each\n", NROUND, ms * 1000 / NROUND);
+	wait(child);
+}
@@ -0,0 +1,59 @@
+// Measure the cost of malloc and free for the sizes the network server
+// uses: small control blocks, a mix of small sizes, and page-sized
+// thread stacks.  Prints system calls and elapsed time per operation.
+
+#include <inc/lib.h>
+
+#define NITER	2000
+#define NLIVE	64
+#define NELEM(a)	(sizeof(a) / sizeof((a)[0]))
+
+static void *live[NLIVE];
+
+static void
+report(const char *what, int n, uint32_t calls, unsigned start)
+{
+	unsigned ms = sys_time_msec() - start;
+
+	cprintf("%s: %d runs, %d.%02d syscalls each, %d us each\n", what, n,
+		calls / n, (calls * 100 / n) % 100, ms * 1000 / n);
+}
+
+// Allocate and free blocks of the given sizes, keeping up to NLIVE of
+// them alive at once the way a server keeps per-connection state.
+static void
+bench(const char *what, const size_t *sizes, int nsizes)
+{
+	uint32_t before;
+	unsigned start;
+	int i, j;
+
+	before = thisenv->env_syscalls;
+	start = sys_time_msec();
+	for (i = 0; i < NITER; i++) {
+		j = i % NLIVE;
+		free(live[j]);
+		if (!(live[j] = malloc(sizes[i % nsizes])))
+			panic("%s: malloc failed at run %d", what, i);
+		memset(live[j], i, 8);
+	}
+	for (j = 0; j < NLIVE; j++) {
+		free(live[j]);
+		live[j] = 0;
+	}
+	report(what, NITER, thisenv->env_syscalls - before, start);
+}
+
+void
+umain(int argc, char **argv)
+{
+	static const size_t small[] = { 32 };
+	static const size_t mixed[] = { 16, 200, 40, 1000, 72, 24, 500, 130 };
+	static const size_t stack[] = { PGSIZE };
+	static const size_t large[] = { 3 * PGSIZE, 2 * PGSIZE, 5000 };
+
+	bench("small", small, NELEM(small));
+	bench("mixed", mixed, NELEM(mixed));
+	bench("stack", stack, NELEM(stack));
+	bench("large", large, NELEM(large));
+}
@@ -0,0 +1,46 @@
+// Test sys_env_set_affinity: an environment pinned to a CPU only runs
+// there, and moving the pin migrates it.
+
+#include <inc/lib.h>
+
+static void
+check_on(int cpu)
+{
+	int i;
+
+	for (i = 0; i < 50; i++) {
+		sys_yield();
+		if (thisenv->env_cpunum != cpu)
+			panic("pinned to CPU %d but running on CPU %d",
+			      cpu, thisenv->env_cpunum);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t migrations;
+	int r;
+
+	if ((r = sys_env_set_affinity(0, 0)) != -E_INVAL)
+		panic("empty affinity mask returned %e", r);
+
+	if ((r = sys_env_set_affinity(0, 1 << 0)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+	check_on(0);
+	cprintf("pinned to CPU 0 ok\n");
+
+	if ((r = sys_env_set_affinity(0, 1 << 1)) == -E_INVAL) {
+		cprintf("only one CPU; testaffinity done\n");
+		return;
+	}
+	if (r < 0)
+		panic("sys_env_set_affinity: %e", r);
+	migrations = thisenv->env_migrations;
+	check_on(1);
+	if (thisenv->env_migrations != migrations + 1)
+		panic("moved to CPU 1 with %d migrations, not 1",
+		      thisenv->env_migrations - migrations);
+	cprintf("moved to CPU 1 ok\n");
+	cprintf("testaffinity done\n");
+}
@@ -0,0 +1,60 @@
+// Test sys_futex_wait and sys_futex_wake between environments sharing
+// a page, and wait() blocking on a child's exit.
+
+#include <inc/lib.h>
+
+#define SHARED	((volatile uint32_t *) 0xC0000000)
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	unsigned start, now;
+	int r, i;
+
+	if ((r = sys_page_alloc(0, (void *) SHARED, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	// A stale value returns at once; otherwise the deadline applies.
+	if ((r = sys_futex_wait(SHARED, 1, 0)) != 0)
+		panic("futex_wait on a changed word returned %e", r);
+	start = sys_time_msec();
+	if ((r = sys_futex_wait(SHARED, 0, start + 100)) != -E_TIMEOUT)
+		panic("futex_wait returned %e, not a timeout", r);
+	if ((now = sys_time_msec()) < start + 100)
+		panic("timed out after %d ms, not 100", now - start);
+	if ((r = sys_futex_wake(SHARED, 1)) != 0)
+		panic("futex_wake woke %d with nobody waiting", r);
+	cprintf("futex timeout ok\n");
+
+	// The child counts up, waking us each time; we wait for every
+	// step.  The page is PTE_SHARE, so we have it at the same
+	// physical address.
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 1; i <= 10; i++) {
+			sys_sleep_until(sys_time_msec() + 5);
+			*SHARED = i;
+			sys_futex_wake(SHARED, 1);
+		}
+		return;
+	}
+	while ((i = *SHARED) < 10)
+		if ((r = sys_futex_wait(SHARED, i, sys_time_msec() + 1000)) < 0)
+			panic("futex_wait at %d returned %e", i, r);
+	cprintf("futex wake ok\n");
+
+	// wait() sleeps until the child is gone.
+	start = sys_time_msec();
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		sys_sleep_until(sys_time_msec() + 100);
+		return;
+	}
+	wait(child);
+	if ((now = sys_time_msec()) < start + 100)
+		panic("wait returned after %d ms, before the child exited", now - start);
+	cprintf("testfutex done\n");
+}
@@ -13,7 +13,7 @@ sleep(int sec)
 		panic("sleep: wrap");
 
 	while (sys_time_msec() < end)
-		sys_yield();
+		sys_sleep_until(end);
 }
 
 void
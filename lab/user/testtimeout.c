@@ -0,0 +1,54 @@
+// Test sys_sleep_until and IPC receive timeouts.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child, who;
+	unsigned start, now;
+	int r;
+
+	// A sleep lasts at least as long as asked.
+	start = sys_time_msec();
+	if ((r = sys_sleep_until(start + 100)) < 0)
+		panic("sys_sleep_until: %e", r);
+	if ((now = sys_time_msec()) < start + 100)
+		panic("woke up after %d ms, not 100", now - start);
+	cprintf("sleep ok\n");
+
+	// Sleeping until the past returns right away.
+	if ((r = sys_sleep_until(start)) < 0)
+		panic("sys_sleep_until: %e", r);
+
+	// Nobody sends to us, so the receive times out.
+	start = sys_time_msec();
+	if ((r = ipc_recv_until(&who, 0, 0, start + 100)) != -E_TIMEOUT)
+		panic("ipc_recv_until returned %e, not a timeout", r);
+	if ((now = sys_time_msec()) < start + 100)
+		panic("timed out after %d ms, not 100", now - start);
+	if (who != 0)
+		panic("timed out receive set the sender to %08x", who);
+	cprintf("recv timeout ok\n");
+
+	// A message that arrives in time cancels the timeout.
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		sys_sleep_until(sys_time_msec() + 50);
+		ipc_send(thisenv->env_parent_id, 42, 0, 0);
+		return;
+	}
+	if ((r = ipc_recv_until(&who, 0, 0, sys_time_msec() + 1000)) != 42)
+		panic("ipc_recv_until returned %e, not 42", r);
+	if (who != child)
+		panic("got message from %08x, not %08x", who, child);
+	cprintf("recv before timeout ok\n");
+
+	// The cancelled timeout does not fire later.
+	start = sys_time_msec();
+	sys_sleep_until(start + 1100);
+	if ((now = sys_time_msec()) < start + 1100)
+		panic("sleep cut short after %d ms", now - start);
+	cprintf("testtimeout done\n");
+}